@@ -0,0 +1,40 @@
+#include <stdint.h>
+
+#include <vector>
+
+#include "accumulator.h"
+
+
+void accumulator_reset(ScoreAccumulator& acc) {
+	if (acc.mode == ACCUMULATOR_DENSE) {
+		// Only clear words which were touched.
+		for (const uint32_t& doc_id : acc.touched_docs) {
+			acc.touched_bits[doc_id >> 6] = 0;
+		}
+		acc.touched_docs.clear();
+		return;
+	}
+	acc.sparse_scores.clear();
+}
+
+void accumulator_init(
+		ScoreAccumulator& acc,
+		uint64_t num_docs,
+		uint64_t expected_candidates
+		) {
+	accumulator_reset(acc);
+
+	if ((double)expected_candidates < DENSE_ACCUMULATOR_MIN_RATIO * (double)num_docs) {
+		acc.mode = ACCUMULATOR_HASH;
+		return;
+	}
+
+	acc.mode = ACCUMULATOR_DENSE;
+
+	// Grow lazily. Buffers are retained across queries and
+	// sized to the largest partition seen.
+	if (acc.dense_scores.size() < num_docs) {
+		acc.dense_scores.resize(num_docs, 0.0f);
+		acc.touched_bits.resize((num_docs + 63) / 64, 0);
+	}
+}
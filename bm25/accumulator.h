@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "robin_hood.h"
+
+
+// Use dense accumulator once the expected number of candidates
+// is at least this fraction of the partition.
+#define DENSE_ACCUMULATOR_MIN_RATIO 0.002
+
+
+enum AccumulatorMode {
+	ACCUMULATOR_HASH,
+	ACCUMULATOR_DENSE
+};
+
+typedef struct {
+	AccumulatorMode mode = ACCUMULATOR_HASH;
+
+	// Dense mode. Indexed by partition local doc id.
+	// Bits mark which scores are valid. Touched docs are kept
+	// so that reset and iteration are O(candidates) not O(num_docs).
+	std::vector<float>    dense_scores;
+	std::vector<uint64_t> touched_bits;
+	std::vector<uint32_t> touched_docs;
+
+	// Hash mode. Used for candidate sets which are tiny relative to the partition.
+	robin_hood::unordered_map<uint64_t, float> sparse_scores;
+} ScoreAccumulator;
+
+
+void accumulator_init(
+		ScoreAccumulator& acc,
+		uint64_t num_docs,
+		uint64_t expected_candidates
+		);
+void accumulator_reset(ScoreAccumulator& acc);
+
+inline void accumulator_add(ScoreAccumulator& acc, uint64_t doc_id, float score) {
+	if (acc.mode == ACCUMULATOR_DENSE) {
+		uint64_t& word = acc.touched_bits[doc_id >> 6];
+		uint64_t  bit  = 1ULL << (doc_id & 63);
+
+		if (word & bit) {
+			acc.dense_scores[doc_id] += score;
+		} else {
+			word |= bit;
+			acc.dense_scores[doc_id] = score;
+			acc.touched_docs.push_back((uint32_t)doc_id);
+		}
+		return;
+	}
+
+	// Single lookup. Inserts 0.0f if not present.
+	acc.sparse_scores[doc_id] += score;
+}
+
+inline uint64_t accumulator_size(const ScoreAccumulator& acc) {
+	if (acc.mode == ACCUMULATOR_DENSE) {
+		return acc.touched_docs.size();
+	}
+	return acc.sparse_scores.size();
+}
+
+// Calls fn(doc_id, score) for every accumulated doc. score is a mutable reference.
+template <typename F>
+inline void accumulator_for_each(ScoreAccumulator& acc, F&& fn) {
+	if (acc.mode == ACCUMULATOR_DENSE) {
+		for (const uint32_t& doc_id : acc.touched_docs) {
+			fn((uint64_t)doc_id, acc.dense_scores[doc_id]);
+		}
+		return;
+	}
+
+	for (auto& [doc_id, score] : acc.sparse_scores) {
+		fn(doc_id, score);
+	}
+}
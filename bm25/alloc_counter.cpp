@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include "alloc_counter.h"
+
+
+#ifdef COUNT_ALLOCS
+static std::atomic<uint64_t> alloc_count(0);
+
+static void* counted_alloc_nothrow(size_t size, size_t alignment) noexcept {
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+
+	if (size == 0) size = 1;
+	if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+		return malloc(size);
+	}
+	// posix_memalign needs a multiple of sizeof(void*). Freed with free().
+	void* ptr = nullptr;
+	if (posix_memalign(&ptr, std::max(alignment, sizeof(void*)), size) != 0) {
+		return nullptr;
+	}
+	return ptr;
+}
+
+static void* counted_alloc(size_t size, size_t alignment) {
+	void* ptr = counted_alloc_nothrow(size, alignment);
+	if (ptr == nullptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+// Every replaceable form, so no allocation escapes the count. Over aligned
+// types use the std::align_val_t forms, std::nothrow callers the others.
+void* operator new(size_t size) { return counted_alloc(size, 0); }
+void* operator new[](size_t size) { return counted_alloc(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return counted_alloc_nothrow(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return counted_alloc_nothrow(size, 0); }
+void* operator new(size_t size, std::align_val_t align) { return counted_alloc(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align) { return counted_alloc(size, (size_t)align); }
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+	return counted_alloc_nothrow(size, (size_t)align);
+}
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+	return counted_alloc_nothrow(size, (size_t)align);
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+
+uint64_t get_alloc_count() {
+	return alloc_count.load(std::memory_order_relaxed);
+}
+#else
+uint64_t get_alloc_count() {
+	return 0;
+}
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Calls of any global operator new, including the aligned and nothrow
+// forms, since the process started. Only counted when built with
+// -DCOUNT_ALLOCS, otherwise always 0. Used to check that the query path
+// stops allocating once its buffers are warmed up.
+uint64_t get_alloc_count();
@@ -0,0 +1,41 @@
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "arena.h"
+
+
+void arena_reset(ScratchArena& arena) {
+	uint64_t total_bytes = 0;
+	for (const std::vector<uint8_t>& block : arena.blocks) {
+		total_bytes += block.size();
+	}
+
+	// A rare large call does not pin its memory for the life of the thread.
+	if (total_bytes > ARENA_MAX_RETAINED_BYTES) {
+		std::vector<std::vector<uint8_t>>().swap(arena.blocks);
+	}
+	else if (arena.blocks.size() > 1) {
+		arena.blocks.clear();
+		arena.blocks.emplace_back(total_bytes);
+	}
+	arena.offset = 0;
+}
+
+void* arena_alloc_bytes(ScratchArena& arena, uint64_t num_bytes, uint64_t alignment) {
+	uint64_t offset = (arena.offset + alignment - 1) & ~(alignment - 1);
+
+	if (arena.blocks.empty() || offset + num_bytes > arena.blocks.back().size()) {
+		// Block data comes from operator new, aligned for any fundamental type.
+		uint64_t block_bytes = std::max((uint64_t)ARENA_MIN_BLOCK_BYTES, num_bytes);
+		if (!arena.blocks.empty()) {
+			block_bytes = std::max(block_bytes, 2 * (uint64_t)arena.blocks.back().size());
+		}
+		arena.blocks.emplace_back(block_bytes);
+		offset = 0;
+	}
+
+	arena.offset = offset + num_bytes;
+	return arena.blocks.back().data() + offset;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+
+// Smallest block allocated by a ScratchArena.
+#define ARENA_MIN_BLOCK_BYTES 4096
+
+// Largest block kept by arena_reset. Calls using more allocate again.
+#define ARENA_MAX_RETAINED_BYTES (16 * 1048576)
+
+// Bump allocator for buffers which live for one call. Allocations are
+// never freed individually. arena_reset releases all of them at once and
+// merges the blocks used so far into one, so once an arena has seen its
+// largest call it serves every later call from a single block without
+// touching malloc. Blocks never move, so pointers stay valid until reset.
+typedef struct {
+	std::vector<std::vector<uint8_t>> blocks;
+	uint64_t offset = 0;	// Into blocks.back().
+} ScratchArena;
+
+void  arena_reset(ScratchArena& arena);
+void* arena_alloc_bytes(ScratchArena& arena, uint64_t num_bytes, uint64_t alignment);
+
+// Uninitialized storage for count values of T. T must be trivially destructible.
+template <typename T>
+inline T* arena_alloc(ScratchArena& arena, uint64_t count) {
+	return (T*)arena_alloc_bytes(arena, count * sizeof(T), alignof(T));
+}
@@ -0,0 +1,76 @@
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "bitmap.h"
+
+
+BitmapEntry init_bitmap_entry(
+		const std::vector<uint64_t>& doc_ids,
+		const std::vector<uint16_t>& term_freqs,
+		uint64_t num_docs
+		) {
+	BitmapEntry entry;
+	entry.max_tf = 0;
+
+	uint64_t num_words = (num_docs + 63) / 64;
+	entry.bits.resize(num_words, 0);
+	entry.tf_nibbles.resize((doc_ids.size() + 1) / 2, 0);
+
+	// doc_ids are ascending, so posting i is the i-th set bit.
+	for (uint64_t i = 0; i < doc_ids.size(); ++i) {
+		uint64_t doc_id = doc_ids[i];
+		uint16_t tf 	= term_freqs[i];
+
+		entry.bits[doc_id >> 6] |= 1ULL << (doc_id & 63);
+
+		uint8_t nibble = (uint8_t)tf;
+		if (tf >= BITMAP_TF_OVERFLOW) {
+			nibble = BITMAP_TF_OVERFLOW;
+			entry.tf_overflow.insert({(uint32_t)doc_id, tf});
+		}
+		entry.tf_nibbles[i >> 1] |= nibble << ((i & 1) << 2);
+
+		entry.max_tf = std::max(entry.max_tf, tf);
+	}
+
+	entry.ranks.reserve(num_words / BITMAP_RANK_WORDS + 1);
+	uint32_t rank = 0;
+	for (uint64_t word_idx = 0; word_idx < num_words; ++word_idx) {
+		if (word_idx % BITMAP_RANK_WORDS == 0) {
+			entry.ranks.push_back(rank);
+		}
+		rank += __builtin_popcountll(entry.bits[word_idx]);
+	}
+
+	return entry;
+}
+
+uint64_t bitmap_entry_size(uint64_t num_docs, uint64_t df) {
+	// Ignores tf_overflow. Almost all tfs of high df terms are small.
+	uint64_t num_words = (num_docs + 63) / 64;
+	return num_words * sizeof(uint64_t)
+		 + (num_words / BITMAP_RANK_WORDS + 1) * sizeof(uint32_t)
+		 + (df + 1) / 2;
+}
+
+uint64_t bitmap_entry_size(const BitmapEntry& entry) {
+	return entry.bits.size() * sizeof(uint64_t)
+		 + entry.ranks.size() * sizeof(uint32_t)
+		 + entry.tf_nibbles.size()
+		 + entry.tf_overflow.size() * (sizeof(uint32_t) + sizeof(uint16_t));
+}
+
+// Plain loops. Vectorized by the compiler at -O3.
+void bitmap_and(const uint64_t* a, const uint64_t* b, uint64_t* out, uint64_t num_words) {
+	for (uint64_t i = 0; i < num_words; ++i) {
+		out[i] = a[i] & b[i];
+	}
+}
+
+void bitmap_or(const uint64_t* a, const uint64_t* b, uint64_t* out, uint64_t num_words) {
+	for (uint64_t i = 0; i < num_words; ++i) {
+		out[i] = a[i] | b[i];
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "robin_hood.h"
+
+
+// Words of the bitset covered by one rank sample.
+#define BITMAP_RANK_WORDS 8
+
+// Nibble value marking a tf stored in tf_overflow.
+#define BITMAP_TF_OVERFLOW 15
+
+
+// Exact postings of a very high df term. One bit per partition doc.
+// tf of the i-th set doc is nibble i of tf_nibbles.
+typedef struct {
+	std::vector<uint64_t> bits;
+	std::vector<uint32_t> ranks;		// Set bits before each BITMAP_RANK_WORDS words.
+	std::vector<uint8_t>  tf_nibbles;
+	robin_hood::unordered_flat_map<uint32_t, uint16_t> tf_overflow;
+	uint16_t max_tf;
+} BitmapEntry;
+
+BitmapEntry init_bitmap_entry(
+		const std::vector<uint64_t>& doc_ids,
+		const std::vector<uint16_t>& term_freqs,
+		uint64_t num_docs
+		);
+
+uint64_t bitmap_entry_size(uint64_t num_docs, uint64_t df);
+uint64_t bitmap_entry_size(const BitmapEntry& entry);
+
+// tf of doc_id at rank, the number of set docs before it.
+inline uint16_t bitmap_tf_at_rank(const BitmapEntry& entry, uint64_t doc_id, uint64_t rank) {
+	uint8_t tf = (entry.tf_nibbles[rank >> 1] >> ((rank & 1) << 2)) & 0xF;
+	if (tf == BITMAP_TF_OVERFLOW) {
+		return entry.tf_overflow.at((uint32_t)doc_id);
+	}
+	return tf;
+}
+
+// tf of doc_id or 0.
+inline uint16_t bitmap_tf(const BitmapEntry& entry, uint64_t doc_id) {
+	uint64_t word_idx = doc_id >> 6;
+	if (word_idx >= entry.bits.size()) return 0;
+
+	uint64_t word = entry.bits[word_idx];
+	uint64_t bit  = 1ULL << (doc_id & 63);
+	if (!(word & bit)) return 0;
+
+	uint64_t rank = entry.ranks[word_idx / BITMAP_RANK_WORDS];
+	for (uint64_t i = word_idx - word_idx % BITMAP_RANK_WORDS; i < word_idx; ++i) {
+		rank += __builtin_popcountll(entry.bits[i]);
+	}
+	rank += __builtin_popcountll(word & (bit - 1));
+
+	return bitmap_tf_at_rank(entry, doc_id, rank);
+}
+
+// out[i] = a[i] & b[i] and out[i] = a[i] | b[i]. out may alias a or b.
+void bitmap_and(const uint64_t* a, const uint64_t* b, uint64_t* out, uint64_t num_words);
+void bitmap_or(const uint64_t* a, const uint64_t* b, uint64_t* out, uint64_t num_words);
+
+// Calls fn(doc_id) for every set bit of words[0, num_words) in order.
+template <typename F>
+inline void bitmap_for_each(const uint64_t* words, uint64_t num_words, F&& fn) {
+	for (uint64_t word_idx = 0; word_idx < num_words; ++word_idx) {
+		uint64_t word = words[word_idx];
+		while (word) {
+			fn((word_idx << 6) + __builtin_ctzll(word));
+			word &= word - 1;
+		}
+	}
+}
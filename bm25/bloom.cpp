@@ -5,9 +5,14 @@
 #include <string.h>
 #include <cmath>
 #include <random>
+#include <algorithm>
 
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "bloom.h"
 
 
@@ -26,6 +31,178 @@ uint64_t fnv1a_64(uint64_t key, uint64_t seed) {
     return hash;
 }
 
+// Multipliers spreading one 32 bit hash over the words of a block.
+static const uint32_t BLOOM_BLOCK_SALTS[BLOOM_BLOCK_BITS_PER_KEY] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// Single multiply-xorshift mix. Upper half picks the block, lower half the bits.
+static inline uint64_t bloom_block_hash(uint64_t key, uint32_t seed) {
+	uint64_t hash = key ^ (((uint64_t)seed << 32) | seed);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static inline uint64_t* bloom_block(const BloomFilter& filter, uint64_t hash) {
+	uint64_t num_blocks = filter.num_bits / (8 * BLOOM_BLOCK_BYTES);
+	uint64_t block_idx  = ((hash >> 32) * num_blocks) >> 32;
+	return (uint64_t*)(filter.bits + block_idx * BLOOM_BLOCK_BYTES);
+}
+
+static bool bloom_blocked_query_scalar(const uint64_t* block, uint32_t hash) {
+	for (uint32_t i = 0; i < BLOOM_BLOCK_BITS_PER_KEY; ++i) {
+		uint32_t bit = (hash * BLOOM_BLOCK_SALTS[i]) >> 26;
+		if (!(block[i] & (1ULL << bit))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Builds the eight one bit masks in two registers and tests them against
+// the whole cache line at once.
+__attribute__((target("avx2")))
+static bool bloom_blocked_query_avx2(const uint64_t* block, uint32_t hash) {
+	const __m256i salts = _mm256_loadu_si256((const __m256i*)BLOOM_BLOCK_SALTS);
+	const __m256i one 	= _mm256_set1_epi64x(1);
+
+	__m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(hash), salts), 26);
+	__m256i mask_lo = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits)));
+	__m256i mask_hi = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits, 1)));
+
+	__m256i lo = _mm256_load_si256((const __m256i*)block);
+	__m256i hi = _mm256_load_si256((const __m256i*)(block + 4));
+	return _mm256_testc_si256(lo, mask_lo) & _mm256_testc_si256(hi, mask_hi);
+}
+#endif
+
+typedef bool (*BlockedBloomQuery)(const uint64_t*, uint32_t);
+
+static BlockedBloomQuery select_blocked_bloom_query() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return bloom_blocked_query_avx2;
+	}
+#endif
+	return bloom_blocked_query_scalar;
+}
+
+static const BlockedBloomQuery blocked_bloom_query = select_blocked_bloom_query();
+
+
+// Keys are hashed and their blocks prefetched BLOOM_BATCH_SIZE at a time
+// before any block is tested, so cache misses overlap instead of serializing.
+static void bloom_blocked_query_batch_scalar(
+		const BloomFilter& filter,
+		const uint64_t* keys,
+		uint64_t num_keys,
+		uint8_t* out_mask
+		) {
+	uint64_t hashes[BLOOM_BATCH_SIZE];
+
+	for (uint64_t base = 0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+		uint64_t batch_size = std::min((uint64_t)BLOOM_BATCH_SIZE, num_keys - base);
+
+		for (uint64_t j = 0; j < batch_size; ++j) {
+			hashes[j] = bloom_block_hash(keys[base + j], filter.seeds[0]);
+			__builtin_prefetch(bloom_block(filter, hashes[j]));
+		}
+		for (uint64_t j = 0; j < batch_size; ++j) {
+			out_mask[base + j] = bloom_blocked_query_scalar(
+					bloom_block(filter, hashes[j]), 
+					(uint32_t)hashes[j]
+					);
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Low 64 bits of a 64 x 64 bit product. AVX2 only multiplies 32 bit halves.
+__attribute__((target("avx2")))
+static inline __m256i mullo_epi64_avx2(__m256i a, __m256i b) {
+	__m256i lo 	  = _mm256_mul_epu32(a, b);
+	__m256i cross = _mm256_add_epi64(
+			_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+			_mm256_mul_epu32(a, _mm256_srli_epi64(b, 32))
+			);
+	return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+// Same as the scalar batch with four keys hashed per register.
+__attribute__((target("avx2")))
+static void bloom_blocked_query_batch_avx2(
+		const BloomFilter& filter,
+		const uint64_t* keys,
+		uint64_t num_keys,
+		uint8_t* out_mask
+		) {
+	const uint64_t seed = ((uint64_t)filter.seeds[0] << 32) | filter.seeds[0];
+	const __m256i  seeds 	  = _mm256_set1_epi64x(seed);
+	const __m256i  mix_1 	  = _mm256_set1_epi64x(0xff51afd7ed558ccdULL);
+	const __m256i  mix_2 	  = _mm256_set1_epi64x(0xc4ceb9fe1a85ec53ULL);
+	const __m256i  num_blocks = _mm256_set1_epi64x(filter.num_bits / (8 * BLOOM_BLOCK_BYTES));
+
+	alignas(32) uint64_t hashes[BLOOM_BATCH_SIZE];
+	alignas(32) uint64_t block_idxs[BLOOM_BATCH_SIZE];
+
+	for (uint64_t base = 0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+		uint64_t batch_size = std::min((uint64_t)BLOOM_BATCH_SIZE, num_keys - base);
+
+		uint64_t j = 0;
+		for (; j + 4 <= batch_size; j += 4) {
+			__m256i hash = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&keys[base + j]), seeds);
+			hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+			hash = mullo_epi64_avx2(hash, mix_1);
+			hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+			hash = mullo_epi64_avx2(hash, mix_2);
+			hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+
+			__m256i block_idx = _mm256_srli_epi64(
+					_mm256_mul_epu32(_mm256_srli_epi64(hash, 32), num_blocks), 
+					32
+					);
+			_mm256_store_si256((__m256i*)&hashes[j], hash);
+			_mm256_store_si256((__m256i*)&block_idxs[j], block_idx);
+		}
+		for (; j < batch_size; ++j) {
+			hashes[j] 	  = bloom_block_hash(keys[base + j], filter.seeds[0]);
+			block_idxs[j] = ((hashes[j] >> 32) * (filter.num_bits / (8 * BLOOM_BLOCK_BYTES))) >> 32;
+		}
+
+		for (j = 0; j < batch_size; ++j) {
+			__builtin_prefetch(filter.bits + block_idxs[j] * BLOOM_BLOCK_BYTES);
+		}
+		for (j = 0; j < batch_size; ++j) {
+			out_mask[base + j] = bloom_blocked_query_avx2(
+					(const uint64_t*)(filter.bits + block_idxs[j] * BLOOM_BLOCK_BYTES),
+					(uint32_t)hashes[j]
+					);
+		}
+	}
+}
+#endif
+
+typedef void (*BlockedBloomQueryBatch)(const BloomFilter&, const uint64_t*, uint64_t, uint8_t*);
+
+static BlockedBloomQueryBatch select_blocked_bloom_query_batch() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return bloom_blocked_query_batch_avx2;
+	}
+#endif
+	return bloom_blocked_query_batch_scalar;
+}
+
+static const BlockedBloomQueryBatch blocked_bloom_query_batch = select_blocked_bloom_query_batch();
+
 void get_optimal_params(
 		uint64_t num_docs,
 		double fpr,
@@ -38,13 +215,33 @@ void get_optimal_params(
 }
 
 
-BloomFilter init_bloom_filter(uint64_t max_entries, double fpr) {
+BloomFilter init_bloom_filter(
+		uint64_t max_entries,
+		double fpr,
+		BloomFilterType type
+		) {
     uint64_t num_hashes, num_bits;
     get_optimal_params(max_entries, fpr, num_hashes, num_bits);
 
     BloomFilter filter;
-    filter.bits = (uint8_t*)calloc((num_bits + 7) / 8, sizeof(uint8_t));
-    filter.num_bits = num_bits;
+    filter.type = type;
+
+    if (type == BLOOM_BLOCKED) {
+        // Hash count is fixed by the block layout. Size for the word fill
+        // at which BLOOM_BLOCK_BITS_PER_KEY probes reach the target fpr.
+        double word_fill 	  = pow(fpr, 1.0 / BLOOM_BLOCK_BITS_PER_KEY);
+        double keys_per_block = -64.0 * log(1.0 - word_fill);
+        uint64_t num_blocks   = (uint64_t)ceil(max_entries / keys_per_block);
+        if (num_blocks == 0) num_blocks = 1;
+
+        filter.bits = (uint8_t*)aligned_alloc(BLOOM_BLOCK_BYTES, num_blocks * BLOOM_BLOCK_BYTES);
+        memset(filter.bits, 0, num_blocks * BLOOM_BLOCK_BYTES);
+        filter.num_bits = num_blocks * BLOOM_BLOCK_BYTES * 8;
+        num_hashes = 1;
+    } else {
+        filter.bits = (uint8_t*)calloc((num_bits + 7) / 8, sizeof(uint8_t));
+        filter.num_bits = num_bits;
+    }
     filter.seeds.reserve(num_hashes);
 
     std::random_device rd;
@@ -66,6 +263,15 @@ void bloom_free(BloomFilter& filter) {
 }
 
 void bloom_put(BloomFilter& filter, const uint64_t key) {
+    if (filter.type == BLOOM_BLOCKED) {
+        uint64_t  hash  = bloom_block_hash(key, filter.seeds[0]);
+        uint64_t* block = bloom_block(filter, hash);
+        for (uint32_t i = 0; i < BLOOM_BLOCK_BITS_PER_KEY; ++i) {
+            block[i] |= 1ULL << (((uint32_t)hash * BLOOM_BLOCK_SALTS[i]) >> 26);
+        }
+        return;
+    }
+
     for (uint64_t i = 0; i < filter.seeds.size(); ++i) {
         uint64_t hash = fnv1a_64(key, filter.seeds[i]) % filter.num_bits;
         filter.bits[hash / 8] |= 1 << (hash % 8);
@@ -73,6 +279,11 @@ void bloom_put(BloomFilter& filter, const uint64_t key) {
 }
 
 bool bloom_query(const BloomFilter& filter, const uint64_t key) {
+    if (filter.type == BLOOM_BLOCKED) {
+        uint64_t hash = bloom_block_hash(key, filter.seeds[0]);
+        return blocked_bloom_query(bloom_block(filter, hash), (uint32_t)hash);
+    }
+
     for (uint64_t i = 0; i < filter.seeds.size(); ++i) {
         uint64_t hash = fnv1a_64(key, filter.seeds[i]) % filter.num_bits;
         if (!(filter.bits[hash / 8] & (1 << (hash % 8)))) {
@@ -83,10 +294,80 @@ bool bloom_query(const BloomFilter& filter, const uint64_t key) {
     return true;
 }
 
+void bloom_query_batch(
+		const BloomFilter& filter,
+		const uint64_t* keys,
+		uint64_t num_keys,
+		uint8_t* out_mask
+		) {
+    if (filter.type == BLOOM_BLOCKED) {
+        blocked_bloom_query_batch(filter, keys, num_keys, out_mask);
+        return;
+    }
+
+    if (filter.seeds.empty()) {
+        memset(out_mask, 1, num_keys);
+        return;
+    }
+
+    // FNV-1a needs a full 64 bit multiply per byte, so hashes stay scalar.
+    // Filters are about half full, so most misses are decided within the
+    // first two probes. Prefetch those.
+    uint64_t positions[2][BLOOM_BATCH_SIZE];
+    const uint64_t num_prefetched = std::min((uint64_t)2, (uint64_t)filter.seeds.size());
+
+    for (uint64_t base = 0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        uint64_t batch_size = std::min((uint64_t)BLOOM_BATCH_SIZE, num_keys - base);
+
+        for (uint64_t j = 0; j < batch_size; ++j) {
+            for (uint64_t i = 0; i < num_prefetched; ++i) {
+                positions[i][j] = fnv1a_64(keys[base + j], filter.seeds[i]) % filter.num_bits;
+                __builtin_prefetch(filter.bits + positions[i][j] / 8);
+            }
+        }
+        for (uint64_t j = 0; j < batch_size; ++j) {
+            const uint64_t key = keys[base + j];
+
+            bool hit = true;
+            for (uint64_t i = 0; hit && i < filter.seeds.size(); ++i) {
+                uint64_t hash = (i < num_prefetched) ? positions[i][j] : fnv1a_64(key, filter.seeds[i]) % filter.num_bits;
+                hit = filter.bits[hash / 8] & (1 << (hash % 8));
+            }
+            out_mask[base + j] = hit;
+        }
+    }
+}
+
 void bloom_clear(BloomFilter& filter) {
 	memset(filter.bits, 0, (filter.num_bits + 7) / 8);
 }
 
+double bloom_estimated_fpr(const BloomFilter& filter) {
+	if (filter.num_bits == 0) return 0.0;
+
+	if (filter.type == BLOOM_BLOCKED) {
+		// A probe lands in one block and needs one set bit in each word.
+		uint64_t num_blocks = filter.num_bits / (8 * BLOOM_BLOCK_BYTES);
+		double fpr = 0.0;
+		for (uint64_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+			const uint64_t* block = (const uint64_t*)(filter.bits + block_idx * BLOOM_BLOCK_BYTES);
+
+			double block_fpr = 1.0;
+			for (uint32_t i = 0; i < BLOOM_BLOCK_BITS_PER_KEY; ++i) {
+				block_fpr *= __builtin_popcountll(block[i]) / 64.0;
+			}
+			fpr += block_fpr;
+		}
+		return fpr / num_blocks;
+	}
+
+	uint64_t num_set = 0;
+	for (uint64_t i = 0; i < (filter.num_bits + 7) / 8; ++i) {
+		num_set += __builtin_popcount(filter.bits[i]);
+	}
+	return pow((double)num_set / filter.num_bits, (double)filter.seeds.size());
+}
+
 void bloom_save(const BloomFilter& filter, const char* filename) {
     FILE* file = fopen(filename, "wb");
     if (file) {
@@ -6,10 +6,29 @@
 #include <vector>
 
 
+// Blocked filters set BLOOM_BLOCK_BITS_PER_KEY bits within a single
+// BLOOM_BLOCK_BYTES block. One bit in each 64 bit word of the block.
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BLOCK_BITS_PER_KEY 8
+
+// Keys hashed and prefetched ahead of probing by bloom_query_batch.
+#define BLOOM_BATCH_SIZE 32
+
+enum BloomFilterType {
+	// seeds.size() independent hashes over the whole bit array.
+	BLOOM_STANDARD,
+	// One hash selects a cache line. All probes hit that line.
+	BLOOM_BLOCKED,
+	// No per tf bloom filters. One xor filter per term maps doc id to tf.
+	// See xor_filter.h.
+	BLOOM_XOR_TF
+};
+
 typedef struct {
 	std::vector<uint32_t> seeds;
 	uint8_t* bits;
 	size_t   num_bits;
+	BloomFilterType type = BLOOM_STANDARD;
 } BloomFilter;
 
 uint64_t fnv1a_64(uint64_t key, uint64_t seed);
@@ -21,10 +40,25 @@ void get_optimal_params(
 		uint64_t &num_bits
 		);
 
-BloomFilter init_bloom_filter(uint64_t max_entries, double fpr);
+BloomFilter init_bloom_filter(
+		uint64_t max_entries,
+		double fpr,
+		BloomFilterType type = BLOOM_STANDARD
+		);
 void bloom_free(BloomFilter& filter);
 void bloom_put(BloomFilter& filter, const uint64_t key);
 bool bloom_query(const BloomFilter& filter, const uint64_t key);
+
+// out_mask[i] = bloom_query(filter, keys[i]).
+void bloom_query_batch(
+		const BloomFilter& filter,
+		const uint64_t* keys,
+		uint64_t num_keys,
+		uint8_t* out_mask
+		);
 void bloom_clear(BloomFilter& filter);
+
+// False positive rate expected from the bits set so far.
+double bloom_estimated_fpr(const BloomFilter& filter);
 void bloom_save(const BloomFilter& filter, const char* filename);
 void bloom_load(BloomFilter& filter, const char* filename);
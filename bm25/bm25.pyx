@@ -1,14 +1,18 @@
 # cython: language_level=3
 
 cimport cython
+from cpython cimport array
 
 from libc.stdint cimport uint16_t, int32_t, uint32_t, uint64_t 
+from libc.string cimport memcpy
+from libc.float cimport FLT_MAX
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp.pair cimport pair
 from libcpp cimport bool
 
 from time import perf_counter
+import array
 import os
 
 
@@ -30,12 +34,59 @@ cdef vector[string] ENGLISH_STOPWORDS = {
 cdef int INT_MAX = 2147483647
 
 cdef extern from "engine.h":
+    cdef enum PostingFormat:
+        POSTINGS_VBYTE
+        POSTINGS_BLOCK_PACKED
+
+    cdef enum BloomFilterType:
+        BLOOM_STANDARD
+        BLOOM_BLOCKED
+        BLOOM_XOR_TF
+
+    cdef enum PostingBuild:
+        BUILD_APPEND
+        BUILD_TWO_PASS
+
+    cdef enum QueryMode:
+        QUERY_BLOOM
+        QUERY_STREAMING
+        QUERY_MAXSCORE
+        QUERY_BLOCK_MAX_WAND
+        QUERY_IMPACT
+        QUERY_TAAT
+        QUERY_AUTO
+
     ctypedef struct BM25Result:
         uint64_t doc_id 
         float score
         uint16_t partition_id
 
+    ctypedef struct ThresholdStats:
+        uint64_t docs_skipped
+        uint64_t bloom_probes_skipped
+        uint64_t candidates_skipped
+        uint64_t threshold_raises
+
+    ctypedef struct QueryPlan:
+        QueryMode mode
+        float     cost
+        float     costs[6]
+        uint64_t  num_postings
+        uint64_t  num_candidates
+        uint32_t  num_terms
+        uint32_t  num_bloom_terms
+        float     block_selectivity
+
+    ctypedef struct BM25BatchResult:
+        vector[uint64_t] doc_ids
+        vector[float] scores
+        vector[uint16_t] partition_ids
+        vector[uint64_t] offsets
+
     cdef cppclass _BM25:
+        QueryMode query_mode
+        uint64_t impact_budget
+
         _BM25(
                 string filename,
                 vector[string] search_col,
@@ -44,7 +95,10 @@ cdef extern from "engine.h":
                 float  k1,
                 float  b,
                 uint16_t num_partitions,
-                const vector[string]& stopwords
+                const vector[string]& stopwords,
+                PostingFormat posting_format,
+                BloomFilterType bloom_filter_type,
+                PostingBuild posting_build
                 ) nogil
         _BM25(string db_dir) nogil
         _BM25(
@@ -54,7 +108,10 @@ cdef extern from "engine.h":
                 float  k1,
                 float  b,
                 uint16_t num_partitions,
-                const vector[string]& stopwords
+                const vector[string]& stopwords,
+                PostingFormat posting_format,
+                BloomFilterType bloom_filter_type,
+                PostingBuild posting_build
                 ) nogil
         vector[BM25Result] query(
                 string& query, 
@@ -62,6 +119,19 @@ cdef extern from "engine.h":
                 uint32_t query_max_df,
                 vector[float] boost_factors
                 ) nogil
+        void query(
+                string& query, 
+                uint32_t top_k, 
+                uint32_t query_max_df,
+                vector[float] boost_factors,
+                vector[BM25Result]& result
+                ) nogil
+        BM25BatchResult query_batch(
+                vector[string]& queries, 
+                uint32_t top_k, 
+                uint32_t query_max_df,
+                vector[float] boost_factors
+                ) nogil
         vector[vector[pair[string, string]]] get_topk_internal(
                 string& query, 
                 uint32_t k, 
@@ -76,6 +146,71 @@ cdef extern from "engine.h":
                 ) nogil 
         void save_to_disk(string db_dir) nogil
         void load_from_disk(string db_dir) nogil
+        void init_query_pool(uint16_t num_threads, bool pin_threads) nogil
+        void build_impact_index() nogil
+        uint64_t get_impact_fallbacks()
+        void reset_impact_fallbacks()
+        vector[QueryPlan] explain(
+                string& query, 
+                uint32_t top_k, 
+                uint32_t query_max_df
+                ) nogil
+        ThresholdStats get_threshold_stats() nogil
+        void reset_threshold_stats() nogil
+
+cdef extern from "alloc_counter.h":
+    uint64_t get_alloc_count() nogil
+
+        
+## bloom:     Score all postings of low df terms.
+## streaming: Same results as bloom. Merges postings one doc at a time
+##            so memory stays bounded on huge posting lists.
+## maxscore:  Exact top-k. Skips docs which cannot enter the top-k.
+## bmw:       Block-Max WAND. Exact top-k. Also skips blocks of postings.
+## impact:    Reads postings in order of decreasing impact and stops once
+##            the top-k is settled. Builds an impact ordered copy of the
+##            postings when first selected, uncompressed at 5 bytes per
+##            posting. Partitions where a query term has a negative idf
+##            run bmw instead; see impact_fallbacks().
+## taat:      Same results as bloom. Skips the bloom bookkeeping when no
+##            query term is high df, which suits short rare term queries.
+## vbyte: Variable byte deltas.
+## block: Bit packed blocks of 128 deltas. Faster to decode.
+POSTING_FORMATS = {
+    "vbyte": POSTINGS_VBYTE,
+    "block": POSTINGS_BLOCK_PACKED,
+}
+
+BLOOM_FILTER_TYPES = {
+    "standard": BLOOM_STANDARD,
+    "blocked": BLOOM_BLOCKED,
+    "xor": BLOOM_XOR_TF,
+}
+
+## append:   Append postings as docs are read.
+## two_pass: Read the docs twice. Count the size of every posting list,
+##           then fill lists allocated once at their exact size. Lower
+##           peak memory and no reallocation.
+POSTING_BUILDS = {
+    "append":   BUILD_APPEND,
+    "two_pass": BUILD_TWO_PASS,
+}
+
+QUERY_MODES = {
+    "bloom":     QUERY_BLOOM,
+    "streaming": QUERY_STREAMING,
+    "maxscore":  QUERY_MAXSCORE,
+    "bmw":       QUERY_BLOCK_MAX_WAND,
+    "impact":    QUERY_IMPACT,
+    "taat":      QUERY_TAAT,
+    "auto":      QUERY_AUTO,
+}
+
+
+def alloc_count():
+    ## C++ heap allocations so far. Always 0 unless built with
+    ## BLOOM25_COUNT_ALLOCS=1 set in the environment.
+    return get_alloc_count()
 
         
 def is_pandas_dataframe(obj):
@@ -104,7 +239,17 @@ cdef class BM25:
     cdef bool   is_parquet
     cdef vector[string] stopwords
     cdef uint16_t num_partitions
+    cdef uint16_t num_query_threads
+    cdef bool   pin_query_threads
+    cdef QueryMode query_mode
+    cdef uint64_t impact_budget
+    cdef PostingFormat posting_format
+    cdef BloomFilterType bloom_filter_type
+    cdef PostingBuild posting_build
     cdef vector[string] search_cols
+    ## Reused by get_topk_indices so a warmed up query does not allocate.
+    cdef string query_buf
+    cdef vector[BM25Result] results
 
 
     def __init__(
@@ -114,7 +259,13 @@ cdef class BM25:
             float  k1     = 1.2,
             float  b      = 0.4,
             stopwords = [],
-            int   num_partitions = os.cpu_count()
+            int   num_partitions = os.cpu_count(),
+            int   num_query_threads = 0,
+            bool  pin_query_threads = False,
+            str   query_mode = "bloom",
+            str   posting_format = "vbyte",
+            str   bloom_filter_type = "standard",
+            str   posting_build = "append"
             ):
         self.bloom_df_threshold = bloom_df_threshold
         self.bloom_fpr = bloom_fpr
@@ -126,6 +277,30 @@ cdef class BM25:
 
         self.num_partitions = num_partitions
 
+        ## Size of the persistent query worker pool.
+        ## 0 uses one worker per partition.
+        if num_query_threads < 0:
+            num_query_threads = 0
+
+        self.num_query_threads = num_query_threads
+        self.pin_query_threads = pin_query_threads
+
+        if query_mode not in QUERY_MODES:
+            raise ValueError(f"query_mode must be one of {list(QUERY_MODES.keys())}")
+        self.query_mode = QUERY_MODES[query_mode]
+
+        if posting_format not in POSTING_FORMATS:
+            raise ValueError(f"posting_format must be one of {list(POSTING_FORMATS.keys())}")
+        self.posting_format = POSTING_FORMATS[posting_format]
+
+        if bloom_filter_type not in BLOOM_FILTER_TYPES:
+            raise ValueError(f"bloom_filter_type must be one of {list(BLOOM_FILTER_TYPES.keys())}")
+        self.bloom_filter_type = BLOOM_FILTER_TYPES[bloom_filter_type]
+
+        if posting_build not in POSTING_BUILDS:
+            raise ValueError(f"posting_build must be one of {list(POSTING_BUILDS.keys())}")
+        self.posting_build = POSTING_BUILDS[posting_build]
+
         if stopwords == 'english':
             self.stopwords = ENGLISH_STOPWORDS
         else:
@@ -133,6 +308,10 @@ cdef class BM25:
                 self.stopwords.push_back(stopword.upper().encode("utf-8"))
 
 
+    def __dealloc__(self):
+        del self.bm25
+
+
     def index_file(self, str filename, list search_cols):
         self.filename = filename
         for text_col in search_cols:
@@ -194,10 +373,110 @@ cdef class BM25:
         with open(os.path.join(self.db_dir, "filename.txt"), "r") as f:
             self.filename = f.read()
 
+        del self.bm25
         self.bm25 = new _BM25(self.db_dir.encode("utf-8"))
+        self._init_query_pool()
         return True
 
 
+    def set_query_mode(self, str query_mode, uint64_t impact_budget = 0):
+        ## impact_budget: Postings read per partition in "impact" mode before
+        ## returning approximate scores. 0 returns the exact top-k.
+        if query_mode not in QUERY_MODES:
+            raise ValueError(f"query_mode must be one of {list(QUERY_MODES.keys())}")
+        self.query_mode = QUERY_MODES[query_mode]
+        self.impact_budget = impact_budget
+
+        if self.bm25 != NULL:
+            self._set_engine_query_mode()
+
+
+    def threshold_stats(self, bool reset = False):
+        ## Work skipped since the last reset because another partition of
+        ## the same query had already found k docs scoring higher.
+        if self.bm25 == NULL:
+            raise RuntimeError("Index is not built or loaded.")
+
+        cdef ThresholdStats stats = self.bm25.get_threshold_stats()
+        if reset:
+            self.bm25.reset_threshold_stats()
+
+        return {
+            "docs_skipped":         stats.docs_skipped,
+            "bloom_probes_skipped": stats.bloom_probes_skipped,
+            "candidates_skipped":   stats.candidates_skipped,
+            "threshold_raises":     stats.threshold_raises,
+        }
+
+
+    def impact_fallbacks(self, bool reset = False):
+        ## Partitions since the last reset which "impact" mode ran as "bmw"
+        ## because a query term had a negative idf.
+        if self.bm25 == NULL:
+            raise RuntimeError("Index is not built or loaded.")
+
+        cdef uint64_t fallbacks = self.bm25.get_impact_fallbacks()
+        if reset:
+            self.bm25.reset_impact_fallbacks()
+        return fallbacks
+
+
+    def explain(self, str query, int k = 10, int query_max_df = INT_MAX):
+        ## Plan chosen per partition by query_mode="auto" and its estimated
+        ## cost, in units of one posting scored by "bloom". Modes missing
+        ## from costs are not eligible for this query.
+        if self.bm25 == NULL:
+            raise RuntimeError("Index is not built or loaded.")
+
+        cdef string _query = query.upper().encode("utf-8")
+        cdef vector[QueryPlan] plans
+        with nogil:
+            plans = self.bm25.explain(_query, k, query_max_df)
+
+        cdef list mode_names = list(QUERY_MODES.keys())
+        cdef list explained = []
+        cdef QueryPlan plan
+        for partition_id in range(plans.size()):
+            plan  = plans[partition_id]
+            costs = {}
+            for mode_idx in range(<int>QUERY_AUTO):
+                if plan.costs[mode_idx] < FLT_MAX:
+                    costs[mode_names[mode_idx]] = plan.costs[mode_idx]
+
+            explained.append({
+                "partition_id":    partition_id,
+                "mode":            mode_names[<int>plan.mode],
+                "estimated_cost":  plan.cost,
+                "costs":           costs,
+                "num_postings":    plan.num_postings,
+                "num_candidates":  plan.num_candidates,
+                "num_terms":       plan.num_terms,
+                "num_bloom_terms": plan.num_bloom_terms,
+                "block_selectivity": plan.block_selectivity,
+            })
+        return explained
+
+
+    cdef void _set_engine_query_mode(self):
+        if self.query_mode == QUERY_IMPACT:
+            with nogil:
+                self.bm25.build_impact_index()
+
+        self.bm25.query_mode    = self.query_mode
+        self.bm25.impact_budget = self.impact_budget
+
+
+    cdef void _init_query_pool(self):
+        self._set_engine_query_mode()
+
+        ## Engine starts with one worker per partition. Only respawn if
+        ## the user asked for something different.
+        if self.num_query_threads == 0 and not self.pin_query_threads:
+            return
+
+        self.bm25.init_query_pool(self.num_query_threads, self.pin_query_threads)
+
+
     cdef void _init_lists(self, list documents):
         init = perf_counter()
 
@@ -212,6 +491,7 @@ cdef class BM25:
 
                 docs[idx].push_back(doc.upper().encode("utf-8"))
 
+        del self.bm25
         self.bm25 = new _BM25(
                 docs,
                 self.bloom_df_threshold,
@@ -219,8 +499,12 @@ cdef class BM25:
                 self.k1,
                 self.b,
                 self.num_partitions,
-                self.stopwords
+                self.stopwords,
+                self.posting_format,
+                self.bloom_filter_type,
+                self.posting_build
                 )
+        self._init_query_pool()
 
     cdef void _init_dicts(self, list documents):
         init = perf_counter()
@@ -235,6 +519,7 @@ cdef class BM25:
             for doc in doc_list:
                 docs[idx].push_back(doc.upper().encode("utf-8"))
 
+        del self.bm25
         self.bm25 = new _BM25(
                 docs,
                 self.bloom_df_threshold,
@@ -242,8 +527,12 @@ cdef class BM25:
                 self.k1,
                 self.b,
                 self.num_partitions,
-                self.stopwords
+                self.stopwords,
+                self.posting_format,
+                self.bloom_filter_type,
+                self.posting_build
                 )
+        self._init_query_pool()
 
     cdef void _init_documents(self, list documents):
         init = perf_counter()
@@ -254,6 +543,7 @@ cdef class BM25:
         for idx, doc in enumerate(documents):
             docs[idx].push_back(doc.upper().encode("utf-8"))
 
+        del self.bm25
         self.bm25 = new _BM25(
                 docs,
                 self.bloom_df_threshold,
@@ -261,8 +551,12 @@ cdef class BM25:
                 self.k1,
                 self.b,
                 self.num_partitions,
-                self.stopwords
+                self.stopwords,
+                self.posting_format,
+                self.bloom_filter_type,
+                self.posting_build
                 )
+        self._init_query_pool()
 
     cdef void _init_with_file(self, str filename, vector[string] search_cols):
         if filename.endswith(".parquet"):
@@ -271,6 +565,7 @@ cdef class BM25:
             return
 
         self.is_parquet = False
+        del self.bm25
         self.bm25 = new _BM25(
                 filename.encode("utf-8"),
                 self.search_cols,
@@ -279,8 +574,12 @@ cdef class BM25:
                 self.k1,
                 self.b,
                 self.num_partitions,
-                self.stopwords
+                self.stopwords,
+                self.posting_format,
+                self.bloom_filter_type,
+                self.posting_build
                 )
+        self._init_query_pool()
 
     cdef void _init_with_parquet(self, str filename, str text_col):
         from pyarrow import parquet as pq
@@ -299,6 +598,7 @@ cdef class BM25:
         for idx in range(num_docs):
             docs.push_back(pydocs[idx].encode("utf-8"))
 
+        del self.bm25
         self.bm25 = new _BM25(
                 docs,
                 self.bloom_df_threshold,
@@ -306,8 +606,12 @@ cdef class BM25:
                 self.k1,
                 self.b,
                 self.num_partitions,
-                self.stopwords
+                self.stopwords,
+                self.posting_format,
+                self.bloom_filter_type,
+                self.posting_build
                 )
+        self._init_query_pool()
         print(f"Reading parquet file took {perf_counter() - init:.2f} seconds")
 
     cpdef get_topk_indices(
@@ -325,24 +629,74 @@ cdef class BM25:
         for factor in boost_factors:
             _boost_factors.push_back(factor)
 
-        cdef vector[BM25Result] results = self.bm25.query(
-                query.upper().encode("utf-8"), 
+        cdef bytes encoded = query.upper().encode("utf-8")
+        self.query_buf.assign(<const char*>encoded, len(encoded))
+        self.bm25.query(
+                self.query_buf, 
                 k, 
                 query_max_df,
-                _boost_factors
+                _boost_factors,
+                self.results
                 )
 
-        if results.size() == 0:
+        if self.results.size() == 0:
             return [], []
 
         cdef list scores  = []
         cdef list indices = []
-        for result in results:
+        for result in self.results:
             scores.append(result.score)
             indices.append(result.doc_id)
 
         return scores, indices
 
+    cpdef get_topk_indices_batch(
+            self, 
+            list queries, 
+            int query_max_df = INT_MAX, 
+            int k = 10,
+            list boost_factors = [] 
+            ):
+        ## Runs all queries at once across the worker pool.
+        ## Returns flat arrays of scores and indices plus offsets, where
+        ## results of queries[i] are scores[offsets[i]:offsets[i + 1]].
+        cdef vector[string] _queries
+        _queries.reserve(len(queries))
+        for query in queries:
+            if query is None:
+                query = ""
+            _queries.push_back(query.upper().encode("utf-8"))
+
+        cdef vector[float] _boost_factors
+        _boost_factors.reserve(len(boost_factors))
+        for factor in boost_factors:
+            _boost_factors.push_back(factor)
+
+        cdef BM25BatchResult results
+        with nogil:
+            results = self.bm25.query_batch(
+                    _queries, 
+                    k, 
+                    query_max_df,
+                    _boost_factors
+                    )
+
+        cdef uint64_t num_results = results.scores.size()
+        cdef array.array scores  = array.array('f')
+        cdef array.array indices = array.array('Q')
+        cdef array.array offsets = array.array('Q')
+
+        array.resize(scores, num_results)
+        array.resize(indices, num_results)
+        array.resize(offsets, results.offsets.size())
+
+        if num_results > 0:
+            memcpy(scores.data.as_voidptr, results.scores.data(), num_results * sizeof(float))
+            memcpy(indices.data.as_voidptr, results.doc_ids.data(), num_results * sizeof(uint64_t))
+        memcpy(offsets.data.as_voidptr, results.offsets.data(), results.offsets.size() * sizeof(uint64_t))
+
+        return scores, indices, offsets
+
     cdef list _get_topk_docs_parquet(
             self, 
             str query, 
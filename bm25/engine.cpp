@@ -5,14 +5,18 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <queue>
+#include <new>
 #include <string>
 #include <cstdint>
 #include <cmath>
+#include <cfloat>
 #include <fstream>
 #include <sstream>
 
@@ -30,22 +34,37 @@
 #include "vbyte_encoding.h"
 #include "serialize.h"
 #include "bloom.h"
+#include "thread_pool.h"
+#include "accumulator.h"
+#include "score_kernel.h"
+#include "arena.h"
 
 
 
 BloomEntry init_bloom_entry(
 		double fpr, 
-		robin_hood::unordered_flat_map<uint16_t, uint64_t>& tf_map 
+		robin_hood::unordered_flat_map<uint16_t, uint64_t>& tf_map,
+		BloomFilterType type
 		) {
 	BloomEntry bloom_entry;
 
+	// Xor entries are built from the postings directly.
+	if (type == BLOOM_XOR_TF) return bloom_entry;
+
 	for (const auto& [term_freq, num_docs] : tf_map) {
-		BloomFilter bf = init_bloom_filter(num_docs, fpr);
+		BloomFilter bf = init_bloom_filter(num_docs, fpr, type);
 		bloom_entry.bloom_filters.insert({term_freq, bf});
 	}
 	return bloom_entry;
 }
 
+void free_bloom_entry(BloomEntry& bloom_entry) {
+	for (auto& [term_freq, bf] : bloom_entry.bloom_filters) {
+		bloom_free(bf);
+	}
+	xor_filter_free(bloom_entry.tf_filter);
+}
+
 static inline ssize_t rfc4180_getline(char** lineptr, size_t* n, FILE* stream) {
     if (lineptr == nullptr || n == nullptr || stream == nullptr) {
         return -1;
@@ -95,7 +114,7 @@ static inline ssize_t rfc4180_getline(char** lineptr, size_t* n, FILE* stream) {
 }
 
 
-static inline bool is_valid_token(std::string& str) {
+static inline bool is_valid_token(std::string_view str) {
 	return (str.size() > 1 || isalnum(str[0]));
 }
 
@@ -180,6 +199,126 @@ void _BM25::init_terminal() {
 }
 
 
+void _BM25::init_query_pool(uint16_t num_threads, bool pin_threads) {
+	// Default to one worker per partition.
+	if (num_threads == 0) {
+		num_threads = num_partitions;
+	}
+
+	// Join old workers before spawning new ones.
+	query_pool.reset();
+	query_pool = std::make_unique<ThreadPool>(num_threads, pin_threads);
+
+	query_scratch.clear();
+	query_scratch.resize(query_pool->size());
+
+	unit_boost_factors.assign(search_cols.size(), 1.0f);
+}
+
+const std::vector<float>& _BM25::_resolve_boost_factors(const std::vector<float>& boost_factors) {
+	// Empty means a boost of 1 for every field. Avoids building one per query.
+	if (boost_factors.size() == 0) {
+		return unit_boost_factors;
+	}
+
+	if (boost_factors.size() != search_cols.size()) {
+		std::cout << "Error: Boost factors must be the same size as the number of search fields." << std::endl;
+		std::cout << "Number of search fields: " << search_cols.size() << std::endl;
+		std::cout << "Number of boost factors: " << boost_factors.size() << std::endl;
+		std::exit(1);
+	}
+	return boost_factors;
+}
+
+void reset_query_scratch(QueryScratch& scratch, uint16_t num_cols, bool keep_terms) {
+	// clear() retains capacity of all buffers.
+	if (!keep_terms) {
+		scratch.low_df_term_idxs.resize(num_cols);
+		scratch.high_df_term_idxs.resize(num_cols);
+		scratch.bloom_entries.resize(num_cols);
+		for (uint16_t col_idx = 0; col_idx < num_cols; ++col_idx) {
+			scratch.low_df_term_idxs[col_idx].clear();
+			scratch.high_df_term_idxs[col_idx].clear();
+			scratch.bloom_entries[col_idx].clear();
+		}
+	}
+	accumulator_reset(scratch.doc_scores);
+	scratch.top_k_heap.clear();
+	scratch.substr.clear();
+	scratch.ordered_cursors.clear();
+	scratch.bloom_terms.clear();
+	scratch.bloom_tf_filters.clear();
+	scratch.batch_doc_ids.clear();
+	scratch.batch_scores.clear();
+}
+
+static bool all_bitmap_entries(const std::vector<std::vector<const BloomEntry*>>& bloom_entries) {
+	for (const auto& col_entries : bloom_entries) {
+		for (const BloomEntry* bloom_entry : col_entries) {
+			if (bloom_entry->bitmap == nullptr) return false;
+		}
+	}
+	return true;
+}
+
+static void gather_bloom_candidates(QueryScratch& scratch) {
+	// Candidate set is fixed while high df terms are scored. Score pointers
+	// stay valid since nothing is inserted into the accumulator meanwhile.
+	scratch.bloom_keys.clear();
+	scratch.bloom_scores.clear();
+	accumulator_for_each(scratch.doc_scores, [&](uint64_t doc_id, float& score) {
+		scratch.bloom_keys.push_back(doc_id);
+		scratch.bloom_scores.push_back(&score);
+	});
+	scratch.bloom_hits.resize(scratch.bloom_keys.size());
+}
+
+static void pop_top_k(
+		std::vector<BM25Result>& heap,
+		uint64_t doc_offset,
+		std::vector<BM25Result>& result
+		) {
+	// Empties the min heap into result, descending by score, adding
+	// doc_offset to every doc id.
+	result.resize(heap.size());
+	int idx = heap.size() - 1;
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), _compare_bm25_result());
+		result[idx] = heap.back();
+		result[idx].doc_id += doc_offset;
+		heap.pop_back();
+		--idx;
+	}
+}
+
+static void get_topk_doc_scores(
+		ScoreAccumulator& doc_scores,
+		uint32_t k,
+		uint16_t partition_id,
+		uint64_t doc_offset,
+		std::vector<BM25Result>& heap,
+		std::vector<BM25Result>& result
+		) {
+	// Min heap of size k on score.
+	heap.clear();
+	accumulator_for_each(doc_scores, [&](uint64_t doc_id, float& score) {
+		BM25Result doc {
+			.doc_id = doc_id + doc_offset,
+			.score  = score,
+			.partition_id = partition_id
+		};
+		heap.push_back(doc);
+		std::push_heap(heap.begin(), heap.end(), _compare_bm25_result());
+		if (heap.size() > k) {
+			std::pop_heap(heap.begin(), heap.end(), _compare_bm25_result());
+			heap.pop_back();
+		}
+	});
+
+	pop_top_k(heap, 0, result);
+}
+
+
 void _BM25::determine_partition_boundaries_csv() {
 	// First find number of bytes in file.
 	// Get avg chunk size in bytes.
@@ -300,8 +439,10 @@ void _BM25::determine_partition_boundaries_csv_rfc_4180() {
     size_t byte_offset = header_bytes;
     fseek(f, byte_offset, SEEK_SET);
 
+    // Start of every row. The newline ending the last row starts none.
     std::vector<uint64_t> line_offsets;
     line_offsets.reserve(file_size / 64);
+    if (header_bytes < file_size) line_offsets.push_back(header_bytes);
 
 	// Use mmap instead
 	char* file_data = (char*)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
@@ -310,9 +451,18 @@ void _BM25::determine_partition_boundaries_csv_rfc_4180() {
 		std::exit(1);
 	}
 
+	// Scanned pages are dropped as the scan goes. The mapping would
+	// otherwise make the whole file resident.
+	const size_t release_bytes = 8 * 1048576;
+	size_t released = 0;
+
 	uint64_t cntr = 0;
     size_t file_pos = header_bytes;
 	while (file_pos < file_size - 1) {
+		if (file_pos - released > 2 * release_bytes) {
+			madvise(file_data + released, release_bytes, MADV_DONTNEED);
+			released += release_bytes;
+		}
 		if (file_data[file_pos] == '"') {
 			// Skip to next unescaped quote
 			++file_pos;
@@ -339,21 +489,25 @@ void _BM25::determine_partition_boundaries_csv_rfc_4180() {
 			}
 		}
 	}
+	munmap(file_data, file_size);
 
     uint64_t num_lines  = line_offsets.size();
     size_t   chunk_size = num_lines / num_partitions;
 
     for (size_t i = 0; i < num_partitions; ++i) {
-        partition_boundaries.push_back(line_offsets[i * chunk_size]);
+        // The last partition also takes the remainder.
+        size_t start = i * chunk_size;
+        size_t end   = (i == (size_t)num_partitions - 1) ? num_lines : start + chunk_size;
+        partition_boundaries.push_back((start < num_lines) ? line_offsets[start] : file_size);
 
         BM25Partition& IP = index_partitions[i];
-        IP.num_docs = chunk_size;
+        IP.num_docs = end - start;
         IP.line_offsets = std::vector<uint64_t>(
-                line_offsets.begin() + i * chunk_size, 
-                line_offsets.begin() + (i + 1) * chunk_size
+                line_offsets.begin() + start, 
+                line_offsets.begin() + end
                 );
     }
-    partition_boundaries.push_back(line_offsets.back());
+    partition_boundaries.push_back(file_size);
 
     if (partition_boundaries.size() != num_partitions + 1) {
         printf("Partition boundaries: %lu\n", partition_boundaries.size());
@@ -417,9 +571,62 @@ void add_rle_element_u8(std::vector<RLEElement_u8>& rle_row, uint8_t value) {
 	}
 }
 
-uint32_t _BM25::process_doc_partition(
-		const char* doc,
-		const char terminator,
+// Term frequencies of the field being read. stamps[term_idx] equals
+// generation once term_idx is seen in it, so a new field is started by
+// bumping generation and only the terms it holds are touched.
+typedef struct {
+	std::vector<uint32_t> stamps;
+	std::vector<uint8_t>  tfs;
+	std::vector<uint32_t> terms;		// Distinct terms in order of first occurrence.
+	uint32_t generation = 0;
+} TermFreqScratch;
+
+static inline void tf_scratch_begin(TermFreqScratch& scratch) {
+	scratch.terms.clear();
+	if (++scratch.generation == 0) {
+		// Wrapped. Old stamps could alias.
+		std::fill(scratch.stamps.begin(), scratch.stamps.end(), 0);
+		scratch.generation = 1;
+	}
+}
+
+// Counts term_idx. Returns true if it is the first occurrence in the field.
+static inline bool tf_scratch_add(TermFreqScratch& scratch, uint32_t term_idx) {
+	if (term_idx >= scratch.stamps.size()) {
+		uint64_t size = std::max((uint64_t)term_idx + 1, 2 * (uint64_t)scratch.stamps.size());
+		scratch.stamps.resize(size, 0);
+		scratch.tfs.resize(size);
+	}
+	if (scratch.stamps[term_idx] != scratch.generation) {
+		scratch.stamps[term_idx] = scratch.generation;
+		scratch.tfs[term_idx] 	 = 1;
+		scratch.terms.push_back(term_idx);
+		return true;
+	}
+	++scratch.tfs[term_idx];
+	return false;
+}
+
+// Thread local since each partition is read on its own thread.
+static thread_local std::string term_buf;
+static thread_local TermFreqScratch tf_scratch;
+
+static void intern_stop_words(
+		TermDictionary& dict,
+		const robin_hood::unordered_flat_set<std::string>& stop_words
+		) {
+	for (const std::string& stop_word : stop_words) {
+		uint64_t hash = term_hash(stop_word);
+		if (term_dict_find(dict, stop_word, hash) == TERM_NOT_FOUND) {
+			term_dict_insert(dict, stop_word, hash, TERM_STOP_WORD);
+		}
+	}
+}
+
+template <FieldFormat FORMAT, char TERMINATOR>
+uint64_t _BM25::process_doc_partition(
+		const char* field,
+		const char* end,
 		uint64_t doc_id,
 		uint32_t& unique_terms_found,
 		uint16_t partition_id,
@@ -427,510 +634,273 @@ uint32_t _BM25::process_doc_partition(
 		) {
 	BM25Partition& IP = index_partitions[partition_id];
 	InvertedIndex& II = IP.II[col_idx];
+	TermDictionary& vocab = IP.unique_term_mapping[col_idx];
 
-	uint32_t char_idx = 0;
-
-	std::string term = "";
-
-	robin_hood::unordered_flat_map<uint64_t, uint8_t> terms_seen;
+	tf_scratch_begin(tf_scratch);
 
-	// Split by commas not inside double quotes
 	uint64_t doc_size = 0;
-	while (true) {
-		if (char_idx > 1048576) {
-			std::cout << "Search field not found on line: " << doc_id << std::endl;
-			std::cout << "Doc: " << doc << std::endl;
-			std::cout << std::flush;
-			std::exit(1);
-		}
-		if (doc[char_idx] == '\\') {
-			++char_idx;
-			term += toupper(doc[char_idx]);
-			++char_idx;
-			continue;
-		}
-
-		if (terminator == ',' && doc[char_idx] == ',') {
-			++char_idx;
-			break;
-		}
+	const char* field_end = tokenize_field<FORMAT, TERMINATOR>(
+			field,
+			end,
+			term_buf,
+			[&](std::string_view term) {
+				++doc_size;
 
-		if (doc[char_idx] == '\n') {
-			++char_idx;
-			break;
-		}
+				// Hashed once. Stop words and invalid tokens resolve to TERM_STOP_WORD.
+				uint64_t hash 	  = term_hash(term);
+				uint32_t term_idx = term_dict_find(vocab, term, hash);
+				if (term_idx == TERM_STOP_WORD) {
+					return;
+				}
 
-		if (terminator == '"' && doc[char_idx] == '"') {
-			if (doc[++char_idx] == ',') {
-				break;
-			}
+				if (term_idx == TERM_NOT_FOUND) {
+					if (!is_valid_token(term)) {
+						term_dict_insert(vocab, term, hash, TERM_STOP_WORD);
+						return;
+					}
 
-			if (doc[char_idx] == terminator) {
-				term += terminator;
-				++char_idx;
-				continue;
+					// New term
+					if (IP.build_pass == PASS_FILL) {
+						std::cerr << "Input changed between the passes of a two pass build." << std::endl;
+						std::exit(1);
+					}
+					term_dict_insert(vocab, term, hash, unique_terms_found);
+					tf_scratch_add(tf_scratch, unique_terms_found);
+					if (IP.build_pass == PASS_APPEND) {
+						II.appended_postings.emplace_back();
+					}
+					II.prev_doc_ids.push_back(0);
+					II.doc_freqs.push_back(1);
+					++unique_terms_found;
+				}
+				else if (tf_scratch_add(tf_scratch, term_idx)) {
+					// Term already exists. First time in this doc.
+					++(II.doc_freqs[term_idx]);
+				}
 			}
-		}
+			);
+	if (field_end == nullptr) {
+		std::cout << "Search field not found on line: " << doc_id << std::endl;
+		std::cout << std::flush;
+		std::exit(1);
+	}
 
-		if (doc[char_idx] == ' ' && term == "") {
-			++char_idx;
-			continue;
-		}
+	if (doc_id == IP.doc_sizes.size() - 1) {
+		IP.doc_sizes[doc_id] += (uint16_t)doc_size;
+	}
+	else {
+		IP.doc_sizes.push_back((uint16_t)doc_size);
+	}
 
-		if (doc[char_idx] == ' ') {
-			if ((stop_words.find(term) != stop_words.end()) || !is_valid_token(term)) {
-				term.clear();
-				++char_idx;
-				++doc_size;
-				continue;
-			}
+	if (IP.build_pass == PASS_COUNT) {
+		II.posting_sizes.resize(II.doc_freqs.size(), {0, 0, 0, 0});
+		for (uint32_t term_idx : tf_scratch.terms) {
+			// Mirrors compress_uint64_differential_single and add_rle_element_u8.
+			PostingSize& size = II.posting_sizes[term_idx];
+			uint8_t tf = tf_scratch.tfs[term_idx];
 
-			auto [it, add] = IP.unique_term_mapping[col_idx].try_emplace(
-					term, 
-					unique_terms_found
-					);
-			if (add) {
-				// New term
-				terms_seen.insert({it->second, 1});
-				II.inverted_index_compressed.emplace_back();
-				II.prev_doc_ids.push_back(0);
-				II.doc_freqs.push_back(1);
-				++unique_terms_found;
+			size.num_bytes += vbyte_size_uint64(doc_id - II.prev_doc_ids[term_idx]);
+			if (size.num_runs == 0 || size.last_tf != tf || size.run_length == 65535) {
+				++size.num_runs;
+				size.run_length = 1;
+				size.last_tf 	= tf;
 			}
 			else {
-				// Term already exists
-				if (terms_seen.find(it->second) == terms_seen.end()) {
-					terms_seen.insert({it->second, 1});
-					++(II.doc_freqs[it->second]);
-				}
-				else {
-					++(terms_seen[it->second]);
-				}
+				++size.run_length;
 			}
-
-			++doc_size;
-			term.clear();
-
-			++char_idx;
-			continue;
+			II.prev_doc_ids[term_idx] = doc_id;
 		}
-
-		term += toupper(doc[char_idx]);
-		++char_idx;
+		return field_end - field;
 	}
 
-	if (term != "") {
-		if ((stop_words.find(term) == stop_words.end()) && is_valid_token(term)) {
-			auto [it, add] = IP.unique_term_mapping[col_idx].try_emplace(
-					term, 
-					unique_terms_found
+	if (IP.build_pass == PASS_FILL) {
+		for (uint32_t term_idx : tf_scratch.terms) {
+			// Lists were laid out at their counted size. posting_sizes holds fill positions.
+			PostingSize& pos = II.posting_sizes[term_idx];
+			PostingList list = get_posting_list(II, term_idx);
+			uint8_t tf = tf_scratch.tfs[term_idx];
+
+			uint64_t num_bytes;
+			vbyte_encode_uint64(
+					doc_id - II.prev_doc_ids[term_idx],
+					(uint8_t*)list.doc_ids + pos.num_bytes,
+					&num_bytes
 					);
+			pos.num_bytes += num_bytes;
 
-			if (add) {
-				// New term
-				terms_seen.insert({it->second, 1});
-				II.inverted_index_compressed.emplace_back();
-				II.prev_doc_ids.push_back(0);
-				II.doc_freqs.push_back(1);
-				++unique_terms_found;
+			RLEElement_u8* runs = (RLEElement_u8*)list.term_freqs;
+			if (pos.num_runs == 0 || pos.last_tf != tf || pos.run_length == 65535) {
+				runs[pos.num_runs++] = init_rle_element_u8(tf);
+				pos.run_length = 1;
+				pos.last_tf    = tf;
 			}
 			else {
-				// Term already exists
-				if (terms_seen.find(it->second) == terms_seen.end()) {
-					terms_seen.insert({it->second, 1});
-					++(II.doc_freqs[it->second]);
-				}
-				else {
-					++(terms_seen[it->second]);
-				}
+				++runs[pos.num_runs - 1].num_repeats;
+				++pos.run_length;
 			}
+			II.prev_doc_ids[term_idx] = doc_id;
 		}
-		++doc_size;
-	}
-
-	if (doc_id == IP.doc_sizes.size() - 1) {
-		IP.doc_sizes[doc_id] += (uint16_t)doc_size;
-	}
-	else {
-		IP.doc_sizes.push_back((uint16_t)doc_size);
+		return field_end - field;
 	}
 
-	for (const auto& [term_idx, tf] : terms_seen) {
+	for (uint32_t term_idx : tf_scratch.terms) {
 		compress_uint64_differential_single(
-				II.inverted_index_compressed[term_idx].doc_ids,
+				II.appended_postings[term_idx].doc_ids,
 				doc_id,
 				II.prev_doc_ids[term_idx]
 				);
 		add_rle_element_u8(
-				II.inverted_index_compressed[term_idx].term_freqs, 
-				tf
+				II.appended_postings[term_idx].term_freqs, 
+				tf_scratch.tfs[term_idx]
 				);
 		II.prev_doc_ids[term_idx] = doc_id;
 	}
 
-	return char_idx;
+	return field_end - field;
 }
 
+template <typename Read>
+void _BM25::read_partition(uint16_t partition_id, Read&& read) {
+	BM25Partition& IP = index_partitions[partition_id];
+	if (posting_build == BUILD_TWO_PASS) {
+		// Readers append to line offsets found before reading.
+		uint64_t num_line_offsets = IP.line_offsets.size();
+
+		IP.build_pass = PASS_COUNT;
+		read();
+		reserve_postings(partition_id);
+		IP.line_offsets.resize(num_line_offsets);
+		IP.build_pass = PASS_FILL;
+	}
+	read();
+	seal_postings(partition_id);
+	IP.build_pass = PASS_APPEND;
+}
 
-uint32_t _BM25::process_doc_partition_rfc_4180(
-		const char* doc,
-		const char terminator,
-		uint64_t doc_id,
-		uint32_t& unique_terms_found,
-		uint16_t partition_id,
-		uint16_t col_idx
-		) {
+void _BM25::reserve_postings(uint16_t partition_id) {
+	// The fill pass reads the same docs again, so it also rebuilds doc
+	// freqs and doc sizes. Only the vocabulary is kept.
 	BM25Partition& IP = index_partitions[partition_id];
-	InvertedIndex& II = IP.II[col_idx];
 
-	uint32_t char_idx = 0;
+	for (InvertedIndex& II : IP.II) {
+		// Sized like doc_freqs even when no doc of the column was counted.
+		II.posting_sizes.resize(II.doc_freqs.size(), {0, 0, 0, 0});
+		layout_posting_lists(II);
 
-	std::string term = "";
+		std::fill(II.prev_doc_ids.begin(), II.prev_doc_ids.end(), 0);
+		std::fill(II.doc_freqs.begin(), II.doc_freqs.end(), 0);
+	}
+}
 
-	robin_hood::unordered_flat_map<uint64_t, uint8_t> terms_seen;
+void _BM25::seal_postings(uint16_t partition_id) {
+	// Appended lists are copied into an arena of exact size. A two pass
+	// build filled the arena in place and only drops its fill positions.
+	BM25Partition& IP = index_partitions[partition_id];
 
-	// Split by commas not inside double quotes
-	uint64_t doc_size = 0;
-	while (true) {
-		if (char_idx > 1048576) {
-			std::cout << "Search field not found on line: " << doc_id << std::endl;
-			std::cout << "Doc: " << doc << std::endl;
-			std::cout << std::flush;
-			std::exit(1);
-		}
+	for (InvertedIndex& II : IP.II) {
+		std::vector<PostingSize>().swap(II.posting_sizes);
+		if (IP.build_pass != PASS_APPEND) continue;
 
-		if (terminator == ',' && doc[char_idx] == ',') {
-			++char_idx;
-			break;
+		uint64_t num_bytes = 0;
+		for (const StandardEntry& entry : II.appended_postings) {
+			num_bytes += posting_arena_size(entry.doc_ids.size(), entry.term_freqs.size());
 		}
-
-		if (doc[char_idx] == '\n') {
-			++char_idx;
-			break;
+		II.postings.clear();
+		II.postings.reserve(II.appended_postings.size());
+		II.posting_bytes.clear();
+		II.posting_bytes.reserve(num_bytes);
+
+		for (StandardEntry& entry : II.appended_postings) {
+			append_posting_list(
+					II,
+					entry.doc_ids.data(),
+					entry.doc_ids.size(),
+					entry.term_freqs.data(),
+					entry.term_freqs.size()
+					);
+			std::vector<uint8_t>().swap(entry.doc_ids);
+			std::vector<RLEElement_u8>().swap(entry.term_freqs);
 		}
+		std::vector<StandardEntry>().swap(II.appended_postings);
+	}
+}
 
-		if (terminator == '"' && doc[char_idx] == '"') {
-			++char_idx;
-			if (doc[char_idx] == ',' || doc[char_idx] == '\n') {
-				break;
-			}
-
-			if (doc[char_idx] == terminator) {
-				// term += terminator;
-				++char_idx;
-				continue;
-			}
-		}
+void _BM25::update_progress(int line_num, int num_lines, uint16_t partition_id) {
+    const int bar_width = 121;
 
-		if (doc[char_idx] == ' ' && term == "") {
-			++char_idx;
-			continue;
-		}
+    // Final updates may count one past the last doc.
+    line_num = std::min(line_num, num_lines);
 
-		if (doc[char_idx] == ' ') {
-			if ((stop_words.find(term) != stop_words.end()) || !is_valid_token(term)) {
-				term.clear();
-				++char_idx;
-				++doc_size;
-				continue;
-			}
+    // An empty partition is read as soon as it starts.
+    float percentage = (num_lines > 0) ? static_cast<float>(line_num) / num_lines : 1.0f;
+    int pos = bar_width * percentage;
 
-			auto [it, add] = IP.unique_term_mapping[col_idx].try_emplace(
-					term, 
-					unique_terms_found
-					);
-			if (add) {
-				// New term
-				terms_seen.insert({it->second, 1});
-				II.inverted_index_compressed.emplace_back();
-				II.prev_doc_ids.push_back(0);
-				II.doc_freqs.push_back(1);
-				++unique_terms_found;
-			}
-			else {
-				// Term already exists
-				if (terms_seen.find(it->second) == terms_seen.end()) {
-					terms_seen.insert({it->second, 1});
-					++(II.doc_freqs[it->second]);
-				}
-				else {
-					++(terms_seen[it->second]);
-				}
-			}
+    std::string bar;
+    if (pos == bar_width) {
+        bar = "[" + std::string(bar_width - 1, '=') + ">" + "]";
+    } else {
+        bar = "[" + std::string(pos, '=') + ">" + std::string(bar_width - pos - 1, ' ') + "]";
+    }
 
-			++doc_size;
-			term.clear();
+    std::string info = std::to_string(static_cast<int>(percentage * 100)) + "% " +
+                       std::to_string(line_num) + " / " + std::to_string(num_lines) + " docs read";
+    std::string output = "Partition " + std::to_string(partition_id + 1) + ": " + bar + " " + info;
 
-			++char_idx;
-			continue;
-		}
+    {
+        std::lock_guard<std::mutex> lock(progress_mutex);
 
-		term += toupper(doc[char_idx]);
-		++char_idx;
-	}
+        progress_bars.resize(std::max(progress_bars.size(), static_cast<size_t>(partition_id + 1)));
+        progress_bars[partition_id] = output;
 
-	if (term != "") {
-		if ((stop_words.find(term) == stop_words.end()) && is_valid_token(term)) {
-			auto [it, add] = IP.unique_term_mapping[col_idx].try_emplace(
-					term, 
-					unique_terms_found
-					);
+        std::cout << "\033[s";  // Save the cursor position
 
-			if (add) {
-				// New term
-				terms_seen.insert({it->second, 1});
-				II.inverted_index_compressed.emplace_back();
-				II.prev_doc_ids.push_back(0);
-				II.doc_freqs.push_back(1);
-				++unique_terms_found;
-			}
-			else {
-				// Term already exists
-				if (terms_seen.find(it->second) == terms_seen.end()) {
-					terms_seen.insert({it->second, 1});
-					++(II.doc_freqs[it->second]);
-				}
-				else {
-					++(terms_seen[it->second]);
-				}
-			}
-		}
-		++doc_size;
-	}
+		// Move the cursor to the appropriate position for this partition
+        std::cout << "\033[" << (partition_id + 1 + init_cursor_row) << ";1H";
 
-	if (doc_id == IP.doc_sizes.size() - 1) {
-		IP.doc_sizes[doc_id] += (uint16_t)doc_size;
-	}
-	else {
-		IP.doc_sizes.push_back((uint16_t)doc_size);
-	}
+        std::cout << output << std::endl;
 
-	for (const auto& [term_idx, tf] : terms_seen) {
-		compress_uint64_differential_single(
-				II.inverted_index_compressed[term_idx].doc_ids,
-				doc_id,
-				II.prev_doc_ids[term_idx]
-				);
-		add_rle_element_u8(
-				II.inverted_index_compressed[term_idx].term_freqs, 
-				tf
-				);
-		II.prev_doc_ids[term_idx] = doc_id;
-	}
+        std::cout << "\033[u";  // Restore the cursor to the original position after updating
+        std::cout << std::flush;
+    }
+}
 
-	return char_idx;
+void _BM25::finalize_progress_bar() {
+    std::cout << "\033[" << (num_partitions + 1 + init_cursor_row) << ";1H";
+	fflush(stdout);
 }
 
 
-void _BM25::process_doc_partition_rfc_4180_mmap(
-		const char* file_data,
-		const char terminator,
-		uint64_t doc_id,
-		uint32_t& unique_terms_found,
-		uint16_t partition_id,
-		uint16_t col_idx,
-		uint64_t& byte_offset
+void get_II_row(
+		InvertedIndex* II, 
+		uint64_t term_idx,
+		IIRow& row
 		) {
-	BM25Partition& IP = index_partitions[partition_id];
-	InvertedIndex& II = IP.II[col_idx];
-
-	std::string term = "";
-
-	robin_hood::unordered_flat_map<uint64_t, uint8_t> terms_seen;
-
-	// Split by commas not inside double quotes
-	uint64_t doc_size = 0;
-	while (true) {
-		if (doc_size > 131072) {
-			std::cout << "Search field not found on line: " << doc_id << std::endl;
-			std::cout << std::flush;
-			std::exit(1);
-		}
-
-		if (terminator == '"' && file_data[byte_offset] == '"') {
-			++byte_offset;
-			if (file_data[byte_offset] == ',' || file_data[byte_offset] == '\n') {
-				++byte_offset;
-				break;
-			}
+	PostingList list = get_posting_list(*II, term_idx);
+	row.df = posting_list_df(list);
 
-			if (file_data[byte_offset] == terminator) {
-				// Escaped quote. Continue.
-				++byte_offset;
-				continue;
-			}
+	if (II->format == POSTINGS_BLOCK_PACKED) {
+		// Prefix sum is fused into block decoding.
+		decompress_uint64_block_packed(list.doc_ids, row.df, row.doc_ids);
+	} else {
+		row.doc_ids.resize(row.df);
+		if (row.df > 0) {
+			decompress_uint64_differential_masked(
+					list.doc_ids,
+					list.doc_ids + list.num_doc_id_bytes,
+					0,
+					(uint32_t)row.df,
+					row.doc_ids.data()
+					);
 		}
+	}
 
-		if ((file_data[byte_offset] == terminator) && (terminator != '"')) {
-			++byte_offset;
-			break;
+	// Get term frequencies
+	row.term_freqs.clear();
+	for (uint32_t i = 0; i < list.num_runs; ++i) {
+		for (uint32_t j = 0; j < list.term_freqs[i].num_repeats; ++j) {
+			row.term_freqs.push_back((uint16_t)list.term_freqs[i].value);
 		}
-
-		// Whitespace. Add term if not empty.
-		if (file_data[byte_offset] == ' ') {
-			if (term == "") {
-				++byte_offset;
-				continue;
-			} else {
-				if ((stop_words.find(term) != stop_words.end()) || !is_valid_token(term)) {
-					term.clear();
-					++byte_offset;
-					++doc_size;
-					continue;
-				}
-
-				auto [it, add] = IP.unique_term_mapping[col_idx].try_emplace(
-						term, 
-						unique_terms_found
-						);
-				if (add) {
-					// New term
-					terms_seen.insert({it->second, 1});
-					II.inverted_index_compressed.emplace_back();
-					II.prev_doc_ids.push_back(0);
-					II.doc_freqs.push_back(1);
-					++unique_terms_found;
-				}
-				else {
-					// Term already exists
-					if (terms_seen.find(it->second) == terms_seen.end()) {
-						terms_seen.insert({it->second, 1});
-						++(II.doc_freqs[it->second]);
-					}
-					else {
-						++(terms_seen[it->second]);
-					}
-				}
-
-				++doc_size;
-				term.clear();
-
-				++byte_offset;
-				continue;
-			}
-		}
-
-		term += toupper(file_data[byte_offset]);
-		++byte_offset;
-	}
-
-	if (term != "") {
-		if ((stop_words.find(term) == stop_words.end()) && is_valid_token(term)) {
-			auto [it, add] = IP.unique_term_mapping[col_idx].try_emplace(
-					term, 
-					unique_terms_found
-					);
-
-			if (add) {
-				// New term
-				terms_seen.insert({it->second, 1});
-				II.inverted_index_compressed.emplace_back();
-				II.prev_doc_ids.push_back(0);
-				II.doc_freqs.push_back(1);
-				++unique_terms_found;
-			}
-			else {
-				// Term already exists
-				if (terms_seen.find(it->second) == terms_seen.end()) {
-					terms_seen.insert({it->second, 1});
-					++(II.doc_freqs[it->second]);
-				}
-				else {
-					++(terms_seen[it->second]);
-				}
-			}
-		}
-		++doc_size;
-	}
-
-	if (doc_id == IP.doc_sizes.size() - 1) {
-		IP.doc_sizes[doc_id] += (uint16_t)doc_size;
-	}
-	else {
-		IP.doc_sizes.push_back((uint16_t)doc_size);
-	}
-
-	for (const auto& [term_idx, tf] : terms_seen) {
-		compress_uint64_differential_single(
-				II.inverted_index_compressed[term_idx].doc_ids,
-				doc_id,
-				II.prev_doc_ids[term_idx]
-				);
-		add_rle_element_u8(
-				II.inverted_index_compressed[term_idx].term_freqs, 
-				tf
-				);
-		II.prev_doc_ids[term_idx] = doc_id;
-	}
-}
-
-void _BM25::update_progress(int line_num, int num_lines, uint16_t partition_id) {
-    const int bar_width = 121;
-
-    float percentage = static_cast<float>(line_num) / num_lines;
-    int pos = bar_width * percentage;
-
-    std::string bar;
-    if (pos == bar_width) {
-        bar = "[" + std::string(bar_width - 1, '=') + ">" + "]";
-    } else {
-        bar = "[" + std::string(pos, '=') + ">" + std::string(bar_width - pos - 1, ' ') + "]";
-    }
-
-    std::string info = std::to_string(static_cast<int>(percentage * 100)) + "% " +
-                       std::to_string(line_num) + " / " + std::to_string(num_lines) + " docs read";
-    std::string output = "Partition " + std::to_string(partition_id + 1) + ": " + bar + " " + info;
-
-    {
-        std::lock_guard<std::mutex> lock(progress_mutex);
-
-        progress_bars.resize(std::max(progress_bars.size(), static_cast<size_t>(partition_id + 1)));
-        progress_bars[partition_id] = output;
-
-        std::cout << "\033[s";  // Save the cursor position
-
-		// Move the cursor to the appropriate position for this partition
-        std::cout << "\033[" << (partition_id + 1 + init_cursor_row) << ";1H";
-
-        std::cout << output << std::endl;
-
-        std::cout << "\033[u";  // Restore the cursor to the original position after updating
-        std::cout << std::flush;
-    }
-}
-
-void _BM25::finalize_progress_bar() {
-    std::cout << "\033[" << (num_partitions + 1 + init_cursor_row) << ";1H";
-	fflush(stdout);
-}
-
-
-IIRow get_II_row(
-		InvertedIndex* II, 
-		uint64_t term_idx
-		) {
-	IIRow row;
-
-	row.df = get_rle_u8_row_size(II->inverted_index_compressed[term_idx].term_freqs);
-
-	decompress_uint64(
-			II->inverted_index_compressed[term_idx].doc_ids,
-			row.doc_ids
-			);
-
-	// Convert doc_ids back to absolute values
-	for (size_t i = 1; i < row.doc_ids.size(); ++i) {
-		row.doc_ids[i] += row.doc_ids[i - 1];
-	}
-
-	// Get term frequencies
-	for (size_t i = 0; i < II->inverted_index_compressed[term_idx].term_freqs.size(); ++i) {
-		for (size_t j = 0; j < II->inverted_index_compressed[term_idx].term_freqs[i].num_repeats; ++j) {
-			row.term_freqs.push_back(
-					(uint16_t)II->inverted_index_compressed[term_idx].term_freqs[i].value
-					);
-		}
-	}
+	}
 
 	if (row.doc_ids.size() != row.term_freqs.size()) {
 		std::cerr << "Doc ids and term freqs size mismatch." << std::endl;
@@ -938,8 +908,6 @@ IIRow get_II_row(
 		printf("Term freqs size: %lu\n", row.term_freqs.size());
 		std::exit(1);
 	}
-
-	return row;
 }
 
 static inline void get_key(
@@ -963,7 +931,7 @@ static inline void scan_to_next_key(
 		int& char_idx
 		) {
 	while (line[char_idx] != ',') {
-		if (line[char_idx] == '}') return;
+		if (line[char_idx] == '}' || line[char_idx] == '\0') return;
 
 		if (line[char_idx] == '\\') {
 			char_idx += 2;
@@ -975,6 +943,7 @@ static inline void scan_to_next_key(
 
 			// Scan to next unescaped quote
 			while (line[char_idx] != '"') {
+				if (line[char_idx] == '\0') return;
 				if (line[char_idx] == '\\') {
 					char_idx += 2;
 					continue;
@@ -987,6 +956,44 @@ static inline void scan_to_next_key(
 	++char_idx;
 }
 
+static uint64_t estimated_bloom_size(uint64_t df, double fpr, BloomFilterType type) {
+	if (type == BLOOM_XOR_TF) {
+		return (uint64_t)(XOR_LOAD_FACTOR * df) * sizeof(uint32_t);
+	}
+
+	uint64_t num_hashes, num_bits;
+	get_optimal_params(df, fpr, num_hashes, num_bits);
+	return num_bits / 8;
+}
+
+static const char* bloom_filter_type_name(BloomFilterType type) {
+	switch (type) {
+		case BLOOM_BLOCKED: return "blocked";
+		case BLOOM_XOR_TF:  return "xor";
+		default: 			return "standard";
+	}
+}
+
+static double mean_bloom_fpr(const std::vector<BM25Partition>& index_partitions) {
+	double   fpr_sum 	 = 0.0;
+	uint64_t num_filters = 0;
+	for (const BM25Partition& IP : index_partitions) {
+		for (const InvertedIndex& II : IP.II) {
+			for (const auto& bf : II.bloom_filters) {
+				if (bf.second.tf_filter.slots != nullptr) {
+					fpr_sum += xor_filter_fpr();
+					++num_filters;
+				}
+				for (const auto& filter : bf.second.bloom_filters) {
+					fpr_sum += bloom_estimated_fpr(filter.second);
+					++num_filters;
+				}
+			}
+		}
+	}
+	return (num_filters > 0) ? fpr_sum / num_filters : 0.0;
+}
+
 void _BM25::write_bloom_filters(uint16_t partition_id) {
 	uint32_t min_df_bloom;
 	if (bloom_df_threshold <= 1.0f) {
@@ -1006,7 +1013,8 @@ void _BM25::write_bloom_filters(uint16_t partition_id) {
 
 			// robin_hood::unordered_flat_set<uint16_t> distinct_term_freq_values;
 			robin_hood::unordered_flat_map<uint16_t, uint64_t> tf_map;
-			IIRow row = get_II_row(&II, idx);
+			IIRow row;
+			get_II_row(&II, idx, row);
 
 			// Construct min heap to keep track of top k term frequencies and doc ids
 			std::priority_queue<
@@ -1028,7 +1036,13 @@ void _BM25::write_bloom_filters(uint16_t partition_id) {
 				}
 			}
 
-			BloomEntry bloom_entry = init_bloom_entry(bloom_fpr, tf_map);
+			// Exact bitmap once it is no larger than the filters it replaces.
+			bool use_bitmap = bitmap_entry_size(IP.num_docs, df) <= estimated_bloom_size(df, bloom_fpr, bloom_filter_type);
+
+			BloomEntry bloom_entry;
+			if (!use_bitmap) {
+				bloom_entry = init_bloom_entry(bloom_fpr, tf_map, bloom_filter_type);
+			}
 
 			// partial sort TOP_K term_freqs descending. Get idxs
 			bloom_entry.topk_doc_ids.reserve(min_heap.size());
@@ -1039,13 +1053,25 @@ void _BM25::write_bloom_filters(uint16_t partition_id) {
 				min_heap.pop();
 			}
 
-			II.inverted_index_compressed[idx].doc_ids.clear();
-			II.inverted_index_compressed[idx].term_freqs.clear();
+			// Bytes are dropped from the arena by encode_postings.
+			II.postings[idx] = {};
 
-			for (uint32_t i = 0; i < row.doc_ids.size(); ++i) {
-				uint64_t doc_id    = row.doc_ids[i];
-				uint16_t term_freq = row.term_freqs[i];
-				bloom_put(bloom_entry.bloom_filters[term_freq], doc_id);
+			if (use_bitmap) {
+				bloom_entry.bitmap = std::make_shared<const BitmapEntry>(
+						init_bitmap_entry(row.doc_ids, row.term_freqs, IP.num_docs)
+						);
+			} else if (bloom_filter_type == BLOOM_XOR_TF) {
+				std::vector<uint8_t> term_freqs(row.term_freqs.size());
+				for (uint32_t i = 0; i < row.term_freqs.size(); ++i) {
+					term_freqs[i] = (uint8_t)std::min(row.term_freqs[i], (uint16_t)UINT8_MAX);
+				}
+				bloom_entry.tf_filter = init_xor_filter(row.doc_ids.data(), term_freqs.data(), row.doc_ids.size());
+			} else {
+				for (uint32_t i = 0; i < row.doc_ids.size(); ++i) {
+					uint64_t doc_id    = row.doc_ids[i];
+					uint16_t term_freq = row.term_freqs[i];
+					bloom_put(bloom_entry.bloom_filters[term_freq], doc_id);
+				}
 			}
 
 			II.bloom_filters.insert({idx, bloom_entry});
@@ -1053,6 +1079,105 @@ void _BM25::write_bloom_filters(uint16_t partition_id) {
 	}
 }
 
+void _BM25::encode_postings(uint16_t partition_id) {
+	// Postings are appended as vbyte during ingestion. Re-encode once
+	// complete, and drop the arena bytes of lists cleared for bloom terms.
+	BM25Partition& IP = index_partitions[partition_id];
+	for (InvertedIndex& II : IP.II) {
+		pack_posting_lists(II, posting_format);
+	}
+}
+
+void _BM25::build_block_max_index(uint16_t partition_id) {
+	// Must run after write_bloom_filters. Bloom term postings are cleared there.
+	BM25Partition& IP = index_partitions[partition_id];
+	for (uint16_t col_idx = 0; col_idx < IP.II.size(); ++col_idx) {
+		build_posting_blocks(IP.II[col_idx], IP.doc_norms, norm_table);
+	}
+}
+
+void _BM25::compute_global_stats() {
+	// Partitions hold disjoint docs, so a term's global df is the sum of
+	// its partition dfs. Must run after all partitions are ingested.
+	// An empty partition has a NaN avg_doc_size and adds nothing.
+	num_docs = 0;
+	double total_doc_size = 0.0;
+	for (const BM25Partition& IP : index_partitions) {
+		if (IP.num_docs == 0) continue;
+		num_docs 	   += IP.num_docs;
+		total_doc_size += (double)IP.avg_doc_size * IP.num_docs;
+	}
+	// No docs to score. Any positive avg_doc_size keeps the norms finite.
+	avg_doc_size = (num_docs > 0) ? (float)(total_doc_size / num_docs) : 1.0f;
+	init_norm_table(norm_table, avg_doc_size, k1, b);
+
+	// Terms of all partitions. Values index global_dfs. Hashes are taken
+	// from the partition dictionaries, so no term is hashed again.
+	std::vector<TermDictionary> global_terms(search_cols.size());
+	std::vector<std::vector<uint32_t>> global_dfs(search_cols.size());
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		TermDictionary& terms = global_terms[col_idx];
+		std::vector<uint32_t>& dfs = global_dfs[col_idx];
+
+		for (const BM25Partition& IP : index_partitions) {
+			term_dict_for_each(
+					IP.unique_term_mapping[col_idx],
+					[&](std::string_view term, uint64_t hash, uint32_t term_idx) {
+						uint32_t global_idx = term_dict_find(terms, term, hash);
+						if (global_idx == TERM_NOT_FOUND) {
+							global_idx = dfs.size();
+							term_dict_insert(terms, term, hash, global_idx);
+							dfs.push_back(0);
+						}
+						dfs[global_idx] += IP.II[col_idx].doc_freqs[term_idx];
+					}
+					);
+		}
+	}
+
+	std::vector<std::thread> threads;
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		threads.push_back(std::thread(
+			[this, &global_terms, &global_dfs, partition_id] {
+				BM25Partition& IP = index_partitions[partition_id];
+				for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+					InvertedIndex& II = IP.II[col_idx];
+					II.global_doc_freqs.resize(II.doc_freqs.size());
+					term_dict_for_each(
+							IP.unique_term_mapping[col_idx],
+							[&](std::string_view term, uint64_t hash, uint32_t term_idx) {
+								uint32_t global_idx = term_dict_find(global_terms[col_idx], term, hash);
+								II.global_doc_freqs[term_idx] = global_dfs[col_idx][global_idx];
+							}
+							);
+				}
+				// Block max scores depend on the global avg_doc_size.
+				build_block_max_index(partition_id);
+			}
+		));
+	}
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+void _BM25::build_impact_index() {
+	// Impacts depend on global norms, so this runs after compute_global_stats
+	// or a load. The index is rebuilt rather than saved.
+	if (impact_index_built) return;
+
+	// One partition per pool task, like queries.
+	auto task = [this](uint32_t partition_id, uint16_t) {
+		BM25Partition& IP = index_partitions[partition_id];
+		for (uint16_t col_idx = 0; col_idx < IP.II.size(); ++col_idx) {
+			build_impact_postings(IP.II[col_idx], IP.doc_norms, norm_table);
+		}
+	};
+	query_pool->run(num_partitions, std::ref(task));
+	impact_index_built = true;
+}
+
 void _BM25::read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition_id) {
 	FILE* f = reference_file_handles[partition_id];
 	BM25Partition& IP = index_partitions[partition_id];
@@ -1124,76 +1249,64 @@ void _BM25::read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition
 		// First char is always `{`
 		int char_idx = 1;
 		while (true) {
-			start:
-				while (line[char_idx] == ' ') ++char_idx;
-
-				// Found key. Match against search_col.
-				if (line[char_idx] == '"') {
-					// Iter over quote.
-					++char_idx;
+			while (line[char_idx] == ' ') ++char_idx;
 
-					// Get key. char_idx will now be on a ':'.
-					get_key(line, char_idx, key); ++char_idx;
+			// Found key. Match against search_col.
+			if (line[char_idx] == '"') {
+				// Iter over quote.
+				++char_idx;
 
-					uint16_t search_col_idx = 0;
-					for (const auto& search_col : search_cols) {
-						if (key == search_col) {
-							found = true;
+				// Get key. char_idx will now be on a ':'.
+				get_key(line, char_idx, key); ++char_idx;
 
-							// Go to first char of value.
-							while (line[char_idx] == ' ') ++char_idx;
+				for (uint16_t search_col_idx = 0; search_col_idx < search_cols.size(); ++search_col_idx) {
+					if (key != search_cols[search_col_idx]) continue;
+					found = true;
 
-							if (line[char_idx] != '"') {
-								// Assume null. Must be string values.
-								scan_to_next_key(line, char_idx);
-								key.clear();
-								++search_col_idx;
-								goto start;
-							}
+					// Go to first char of value.
+					while (line[char_idx] == ' ') ++char_idx;
 
-							// Iter over quote.
-							++char_idx;
-
-							char_idx += process_doc_partition(
-									&line[char_idx], 
-									'"', 
-									line_num, 
-									unique_terms_found[search_col_idx], 
-									partition_id,
-									search_col_idx++
-									); ++char_idx;
-							scan_to_next_key(line, char_idx);
-							key.clear();
-							goto start;
-						}
-					}
+					// Assume null. Must be string values.
+					if (line[char_idx] != '"') break;
 
-					key.clear();
-					scan_to_next_key(line, char_idx);
-					++search_col_idx;
-				}
-				else if (line[char_idx] == '}') {
-					if (!found) {
-						std::cout << "Search field not found on line: " << line_num << std::endl;
-						std::cout << std::flush;
-						std::exit(1);
-					}
-					// Success. Break.
+					// Iter over quote. The field ends past the closing quote.
+					++char_idx;
+					char_idx += process_doc_partition<FIELD_ESCAPED, '"'>(
+							&line[char_idx], 
+							line + read, 
+							line_num, 
+							unique_terms_found[search_col_idx], 
+							partition_id,
+							search_col_idx
+							);
 					break;
 				}
-				else if (char_idx > 1048576) {
+
+				key.clear();
+				scan_to_next_key(line, char_idx);
+			}
+			else if (line[char_idx] == '}') {
+				if (!found) {
 					std::cout << "Search field not found on line: " << line_num << std::endl;
 					std::cout << std::flush;
 					std::exit(1);
 				}
-				else {
-					std::cerr << "Invalid json." << std::endl;
-					std::cout << "Line: " << line << std::endl;
-					std::cout << &line[char_idx] << std::endl;
-					std::cout << char_idx << std::endl;
-					std::cout << std::flush;
-					std::exit(1);
-				}
+				// Success. Break.
+				break;
+			}
+			else if (char_idx > 1048576) {
+				std::cout << "Search field not found on line: " << line_num << std::endl;
+				std::cout << std::flush;
+				std::exit(1);
+			}
+			else {
+				std::cerr << "Invalid json." << std::endl;
+				std::cout << "Line: " << line << std::endl;
+				std::cout << &line[char_idx] << std::endl;
+				std::cout << char_idx << std::endl;
+				std::cout << std::flush;
+				std::exit(1);
+			}
 		}
 
 		if (!DEBUG) {
@@ -1221,6 +1334,8 @@ void _BM25::read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition
 		avg_doc_size += (double)size;
 	}
 	IP.avg_doc_size = (float)(avg_doc_size / num_lines);
+
+	encode_doc_norms(IP.doc_sizes, IP.doc_norms);
 }
 
 void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t partition_id) {
@@ -1318,9 +1433,9 @@ void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t p
 			// Split by commas not inside double quotes
 			if (line[char_idx] == '"') {
 				++char_idx;
-				char_idx += process_doc_partition_rfc_4180(
+				char_idx += process_doc_partition<FIELD_RFC_4180, '"'>(
 					&line[char_idx],
-					'"',
+					line + read,
 					line_num,
 					unique_terms_found[_search_col_idx],
 					partition_id,
@@ -1330,14 +1445,26 @@ void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t p
 				continue;
 			}
 
-			char_idx += process_doc_partition_rfc_4180(
-				&line[char_idx], 
-				end_delim,
-				line_num, 
-				unique_terms_found[_search_col_idx], 
-				partition_id,
-				_search_col_idx
-				); // ++char_idx;
+			if (end_delim == '\n') {
+				char_idx += process_doc_partition<FIELD_RFC_4180, '\n'>(
+					&line[char_idx], 
+					line + read,
+					line_num, 
+					unique_terms_found[_search_col_idx], 
+					partition_id,
+					_search_col_idx
+					);
+			}
+			else {
+				char_idx += process_doc_partition<FIELD_RFC_4180, ','>(
+					&line[char_idx], 
+					line + read,
+					line_num, 
+					unique_terms_found[_search_col_idx], 
+					partition_id,
+					_search_col_idx
+					);
+			}
 			++_search_col_idx;
 		}
 		++line_num;
@@ -1358,6 +1485,8 @@ void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t p
 		avg_doc_size += (double)size;
 	}
 	IP.avg_doc_size = (float)(avg_doc_size / IP.num_docs);
+
+	encode_doc_norms(IP.doc_sizes, IP.doc_norms);
 }
 
 
@@ -1453,28 +1582,38 @@ void _BM25::read_csv_rfc_4180_mmap(uint64_t start_byte, uint64_t end_byte, uint1
 			if (data[byte_offset] == '"') {
 				++byte_offset;
 
-				process_doc_partition_rfc_4180_mmap(
-					data,
-					'"',
+				byte_offset += process_doc_partition<FIELD_RFC_4180_MMAP, '"'>(
+					data + byte_offset,
+					data + sb.st_size,
 					line_num,
 					unique_terms_found[_search_col_idx],
 					partition_id,
-					_search_col_idx,
-					byte_offset
+					_search_col_idx
 					);
 				_search_col_idx = (_search_col_idx + 1) % search_cols.size();
 				continue;
 			}
 
-			process_doc_partition_rfc_4180_mmap(
-				data,
-				end_delim,
-				line_num, 
-				unique_terms_found[_search_col_idx], 
-				partition_id,
-				_search_col_idx,
-				byte_offset
-				);
+			if (end_delim == '\n') {
+				byte_offset += process_doc_partition<FIELD_RFC_4180_MMAP, '\n'>(
+					data + byte_offset,
+					data + sb.st_size,
+					line_num, 
+					unique_terms_found[_search_col_idx], 
+					partition_id,
+					_search_col_idx
+					);
+			}
+			else {
+				byte_offset += process_doc_partition<FIELD_RFC_4180_MMAP, ','>(
+					data + byte_offset,
+					data + sb.st_size,
+					line_num, 
+					unique_terms_found[_search_col_idx], 
+					partition_id,
+					_search_col_idx
+					);
+			}
 			_search_col_idx = (_search_col_idx + 1) % search_cols.size();
 		}
 
@@ -1502,6 +1641,8 @@ void _BM25::read_csv_rfc_4180_mmap(uint64_t start_byte, uint64_t end_byte, uint1
 		avg_doc_size += (double)size;
 	}
 	IP.avg_doc_size = (float)(avg_doc_size / IP.num_docs);
+
+	encode_doc_norms(IP.doc_sizes, IP.doc_norms);
 }
 
 
@@ -1529,9 +1670,9 @@ void _BM25::read_in_memory(
 
 		for (uint16_t col = 0; col < search_cols.size(); ++col) {
 			std::string& doc = documents[line_num][col];
-			process_doc_partition(
-				(doc + "\n").c_str(),
-				'\n',
+			process_doc_partition<FIELD_ESCAPED, '\n'>(
+				doc.data(),
+				doc.data() + doc.size(),
 				cntr, 
 				unique_terms_found[col],
 				partition_id,
@@ -1548,6 +1689,8 @@ void _BM25::read_in_memory(
 		avg_doc_size += (double)size;
 	}
 	IP.avg_doc_size = (float)(avg_doc_size / IP.num_docs);
+
+	encode_doc_norms(IP.doc_sizes, IP.doc_norms);
 }
 
 
@@ -1672,14 +1815,17 @@ void _BM25::save_index_partition(
 		) {
 	std::string UNIQUE_TERM_MAPPING_PATH = db_dir + "/unique_term_mapping.bin";
 	std::string INVERTED_INDEX_PATH 	 = db_dir + "/inverted_index.bin";
-	std::string DOC_SIZES_PATH 		     = db_dir + "/doc_sizes.bin";
+	std::string DOC_NORMS_PATH 		     = db_dir + "/doc_norms.bin";
 	std::string LINE_OFFSETS_PATH 		 = db_dir + "/line_offsets.bin";
+	std::string DOC_FREQS_PATH 			 = db_dir + "/doc_freqs.bin";
+	std::string GLOBAL_DOC_FREQS_PATH 	 = db_dir + "/global_doc_freqs.bin";
+	std::string BLOOM_FILTERS_PATH 		 = db_dir + "/bloom_filters.bin";
 
 	BM25Partition& IP = index_partitions[partition_id];
 
 
 	for (uint16_t col_idx = 0; col_idx < search_col_idxs.size(); ++col_idx) {
-		serialize_robin_hood_flat_map_string_u32(
+		serialize_term_dictionary(
 				IP.unique_term_mapping[col_idx],
 				UNIQUE_TERM_MAPPING_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
 				);
@@ -1687,8 +1833,20 @@ void _BM25::save_index_partition(
 				IP.II[col_idx], 
 				INVERTED_INDEX_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
 				);
+		serialize_vector_u32(
+				IP.II[col_idx].doc_freqs,
+				DOC_FREQS_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
+				);
+		serialize_vector_u32(
+				IP.II[col_idx].global_doc_freqs,
+				GLOBAL_DOC_FREQS_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
+				);
+		serialize_bloom_filters(
+				IP.II[col_idx].bloom_filters,
+				BLOOM_FILTERS_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
+				);
 	}
-	serialize_vector_u16(IP.doc_sizes, DOC_SIZES_PATH + "_" + std::to_string(partition_id));
+	serialize_vector_u8(IP.doc_norms, DOC_NORMS_PATH + "_" + std::to_string(partition_id));
 
 	std::vector<uint8_t> compressed_line_offsets;
 	compressed_line_offsets.reserve(IP.line_offsets.size() * 2);
@@ -1705,15 +1863,18 @@ void _BM25::load_index_partition(
 		) {
 	std::string UNIQUE_TERM_MAPPING_PATH = db_dir + "/unique_term_mapping.bin";
 	std::string INVERTED_INDEX_PATH 	 = db_dir + "/inverted_index.bin";
-	std::string DOC_SIZES_PATH 		     = db_dir + "/doc_sizes.bin";
+	std::string DOC_NORMS_PATH 		     = db_dir + "/doc_norms.bin";
 	std::string LINE_OFFSETS_PATH 		 = db_dir + "/line_offsets.bin";
+	std::string DOC_FREQS_PATH 			 = db_dir + "/doc_freqs.bin";
+	std::string GLOBAL_DOC_FREQS_PATH 	 = db_dir + "/global_doc_freqs.bin";
+	std::string BLOOM_FILTERS_PATH 		 = db_dir + "/bloom_filters.bin";
 
 	BM25Partition& IP = index_partitions[partition_id];
 	IP.unique_term_mapping.resize(search_col_idxs.size());
 	IP.II.resize(search_col_idxs.size());
 
 	for (uint16_t col_idx = 0; col_idx < search_col_idxs.size(); ++col_idx) {
-		deserialize_robin_hood_flat_map_string_u32(
+		deserialize_term_dictionary(
 				IP.unique_term_mapping[col_idx],
 				UNIQUE_TERM_MAPPING_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
 				);
@@ -1721,8 +1882,28 @@ void _BM25::load_index_partition(
 				IP.II[col_idx], 
 				INVERTED_INDEX_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
 				);
+		deserialize_vector_u32(
+				IP.II[col_idx].doc_freqs,
+				DOC_FREQS_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
+				);
+		deserialize_vector_u32(
+				IP.II[col_idx].global_doc_freqs,
+				GLOBAL_DOC_FREQS_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
+				);
+
+		uint8_t* mapping;
+		size_t   mapping_size;
+		deserialize_bloom_filters(
+				IP.II[col_idx].bloom_filters,
+				BLOOM_FILTERS_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx),
+				mapping,
+				mapping_size
+				);
+		if (mapping != nullptr) {
+			IP.bloom_mappings.push_back({mapping, mapping_size});
+		}
 	}
-	deserialize_vector_u16(IP.doc_sizes, DOC_SIZES_PATH + "_" + std::to_string(partition_id));
+	deserialize_vector_u8(IP.doc_norms, DOC_NORMS_PATH + "_" + std::to_string(partition_id));
 
 	std::vector<uint8_t> compressed_line_offsets;
 	deserialize_vector_u8(
@@ -1730,6 +1911,8 @@ void _BM25::load_index_partition(
 			);
 
 	decompress_uint64(compressed_line_offsets, IP.line_offsets);
+
+	build_block_max_index(partition_id);
 }
 
 void _BM25::save_to_disk(const std::string& db_dir) {
@@ -1773,8 +1956,13 @@ void _BM25::save_to_disk(const std::string& db_dir) {
 		return;
 	}
 
+	uint32_t format_version = INDEX_FORMAT_VERSION;
+	out_file.write(INDEX_FORMAT_MAGIC, INDEX_FORMAT_MAGIC_BYTES);
+	out_file.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
+
 	// Write basic types directly
 	out_file.write(reinterpret_cast<const char*>(&num_docs), sizeof(num_docs));
+	out_file.write(reinterpret_cast<const char*>(&avg_doc_size), sizeof(avg_doc_size));
 	out_file.write(reinterpret_cast<const char*>(&bloom_df_threshold), sizeof(bloom_df_threshold));
 	out_file.write(reinterpret_cast<const char*>(&bloom_fpr), sizeof(bloom_fpr));
 	out_file.write(reinterpret_cast<const char*>(&k1), sizeof(k1));
@@ -1784,6 +1972,7 @@ void _BM25::save_to_disk(const std::string& db_dir) {
 	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
 		BM25Partition& IP = index_partitions[partition_id];
 
+		out_file.write(reinterpret_cast<const char*>(&IP.num_docs), sizeof(IP.num_docs));
 		out_file.write(reinterpret_cast<const char*>(&IP.avg_doc_size), sizeof(IP.avg_doc_size));
 	}
 
@@ -1830,7 +2019,7 @@ void _BM25::load_from_disk(const std::string& db_dir) {
 	// Join paths
 	std::string UNIQUE_TERM_MAPPING_PATH = db_dir + "/unique_term_mapping.bin";
 	std::string INVERTED_INDEX_PATH 	 = db_dir + "/inverted_index.bin";
-	std::string DOC_SIZES_PATH 		     = db_dir + "/doc_sizes.bin";
+	std::string DOC_NORMS_PATH 		     = db_dir + "/doc_norms.bin";
 	std::string LINE_OFFSETS_PATH 		 = db_dir + "/line_offsets.bin";
 	std::string METADATA_PATH 			 = db_dir + "/metadata.bin";
 	std::string PARTITION_BOUNDARY_PATH  = db_dir + "/partition_boundaries.bin";
@@ -1842,14 +2031,34 @@ void _BM25::load_from_disk(const std::string& db_dir) {
         return;
     }
 
+	// Indexes saved before the format was versioned start with num_docs.
+	char magic[INDEX_FORMAT_MAGIC_BYTES] = {0};
+	uint32_t format_version = 0;
+	in_file.read(magic, INDEX_FORMAT_MAGIC_BYTES);
+	in_file.read(reinterpret_cast<char*>(&format_version), sizeof(format_version));
+	if (memcmp(magic, INDEX_FORMAT_MAGIC, INDEX_FORMAT_MAGIC_BYTES) != 0) {
+		std::cerr << "Error: " << db_dir << " is not a saved index, or was saved by a version "
+				  << "older than index format " << INDEX_FORMAT_VERSION << ". Rebuild the index." << std::endl;
+		std::exit(1);
+	}
+	if (format_version != INDEX_FORMAT_VERSION) {
+		std::cerr << "Error: " << db_dir << " has index format " << format_version 
+				  << ", but this version reads format " << INDEX_FORMAT_VERSION << ". Rebuild the index." << std::endl;
+		std::exit(1);
+	}
+
     // Read basic types directly
     in_file.read(reinterpret_cast<char*>(&num_docs), sizeof(num_docs));
+    in_file.read(reinterpret_cast<char*>(&avg_doc_size), sizeof(avg_doc_size));
     in_file.read(reinterpret_cast<char*>(&bloom_df_threshold), sizeof(bloom_df_threshold));
     in_file.read(reinterpret_cast<char*>(&bloom_fpr), sizeof(bloom_fpr));
     in_file.read(reinterpret_cast<char*>(&k1), sizeof(k1));
     in_file.read(reinterpret_cast<char*>(&b), sizeof(b));
 	in_file.read(reinterpret_cast<char*>(&num_partitions), sizeof(num_partitions));
 
+	// Partitions build their block max index from it as they load.
+	init_norm_table(norm_table, avg_doc_size, k1, b);
+
 	// Load partition boundaries
 	deserialize_vector_u64(partition_boundaries, PARTITION_BOUNDARY_PATH);
 
@@ -1860,6 +2069,7 @@ void _BM25::load_from_disk(const std::string& db_dir) {
 	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
 		BM25Partition& IP = index_partitions[partition_id];
 
+		in_file.read(reinterpret_cast<char*>(&IP.num_docs), sizeof(IP.num_docs));
 		in_file.read(reinterpret_cast<char*>(&IP.avg_doc_size), sizeof(IP.avg_doc_size));
 	}
 
@@ -1926,14 +2136,20 @@ _BM25::_BM25(
 		float  k1,
 		float  b,
 		uint16_t num_partitions,
-		const std::vector<std::string>& _stop_words
+		const std::vector<std::string>& _stop_words,
+		PostingFormat posting_format,
+		BloomFilterType bloom_filter_type,
+		PostingBuild posting_build
 		) : bloom_df_threshold(bloom_df_threshold),
 			bloom_fpr(bloom_fpr),
 			k1(k1), 
 			b(b),
 			num_partitions(num_partitions),
 			search_cols(search_cols), 
-			filename(filename) {
+			filename(filename),
+			posting_format(posting_format),
+			bloom_filter_type(bloom_filter_type),
+			posting_build(posting_build) {
 
 
 	for (const std::string& stop_word : _stop_words) {
@@ -1958,6 +2174,9 @@ _BM25::_BM25(
 	for (uint16_t i = 0; i < num_partitions; ++i) {
 		index_partitions[i].II.resize(search_cols.size());
 		index_partitions[i].unique_term_mapping.resize(search_cols.size());
+		for (TermDictionary& vocab : index_partitions[i].unique_term_mapping) {
+			intern_stop_words(vocab, stop_words);
+		}
 	}
 
 	num_docs = 0;
@@ -1977,18 +2196,24 @@ _BM25::_BM25(
 		for (uint16_t i = 0; i < num_partitions; ++i) {
 			threads.push_back(std::thread(
 				[this, i] {
-					read_csv_rfc_4180(partition_boundaries[i], partition_boundaries[i + 1], i);
+					read_partition(i, [&] {
+						read_csv_rfc_4180(partition_boundaries[i], partition_boundaries[i + 1], i);
+					});
 					// read_csv_rfc_4180_mmap(partition_boundaries[i], partition_boundaries[i + 1], i);
 					if (DEBUG) {
 						BM25Partition& IP = index_partitions[i];
 						IP.reverse_term_mapping.resize(this->search_cols.size());
 						for (uint16_t col = 0; col < this->search_cols.size(); ++col) {
-							for (const auto& term : IP.unique_term_mapping[col]) {
-								IP.reverse_term_mapping[col].insert({term.second, term.first});
-							}
+							term_dict_for_each(
+									IP.unique_term_mapping[col],
+									[&](std::string_view term, uint64_t, uint32_t term_idx) {
+										IP.reverse_term_mapping[col].insert({term_idx, std::string(term)});
+									}
+									);
 						}
 					}
 					write_bloom_filters(i);
+					encode_postings(i);
 				}
 			));
 		}
@@ -2003,17 +2228,23 @@ _BM25::_BM25(
 		for (uint16_t i = 0; i < num_partitions; ++i) {
 			threads.push_back(std::thread(
 				[this, i] {
-					read_json(partition_boundaries[i], partition_boundaries[i + 1], i);
+					read_partition(i, [&] {
+						read_json(partition_boundaries[i], partition_boundaries[i + 1], i);
+					});
 					if (DEBUG) {
 						BM25Partition& IP = index_partitions[i];
 						IP.reverse_term_mapping.resize(this->search_cols.size());
 						for (uint16_t col = 0; col < this->search_cols.size(); ++col) {
-							for (const auto& term : IP.unique_term_mapping[col]) {
-								IP.reverse_term_mapping[col].insert({term.second, term.first});
-							}
+							term_dict_for_each(
+									IP.unique_term_mapping[col],
+									[&](std::string_view term, uint64_t, uint32_t term_idx) {
+										IP.reverse_term_mapping[col].insert({term_idx, std::string(term)});
+									}
+									);
 						}
 					}
 					write_bloom_filters(i);
+					encode_postings(i);
 				}
 			));
 		}
@@ -2029,10 +2260,7 @@ _BM25::_BM25(
 		thread.join();
 	}
 
-	num_docs = 0;
-	for (uint16_t i = 0; i < num_partitions; ++i) {
-		num_docs += index_partitions[i].num_docs;
-	}
+	compute_global_stats();
 
 	if (!DEBUG) finalize_progress_bar();
 
@@ -2040,21 +2268,25 @@ _BM25::_BM25(
 	uint32_t unique_terms_found = 0;
 	uint64_t bloom_filters_size = 0;
 	uint64_t total_bloom_filters = 0;
+	uint64_t total_bitmap_entries = 0;
 	for (uint16_t i = 0; i < num_partitions; ++i) {
 		BM25Partition& IP = index_partitions[i];
 
 		uint64_t part_size = 0;
 		for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-			for (const auto& row : IP.II[col_idx].inverted_index_compressed) {
-				part_size += sizeof(uint8_t) * row.doc_ids.size();
-				part_size += sizeof(RLEElement_u8) * row.term_freqs.size();
-			}
-			unique_terms_found += IP.unique_term_mapping[col_idx].size();
+			part_size += IP.II[col_idx].posting_bytes.size();
+			part_size += sizeof(PostingEntry) * IP.II[col_idx].postings.size();
+			unique_terms_found += IP.unique_term_mapping[col_idx].num_terms;
 			total_bloom_filters += IP.II[col_idx].bloom_filters.size();
 			for (const auto& bf : index_partitions[i].II[col_idx].bloom_filters) {
 				for (const auto& filter : bf.second.bloom_filters) {
 					bloom_filters_size += filter.second.num_bits / 8;
 				}
+				bloom_filters_size += xor_filter_num_slots(bf.second.tf_filter) * sizeof(uint32_t);
+				if (bf.second.bitmap != nullptr) {
+					bloom_filters_size += bitmap_entry_size(*bf.second.bitmap);
+					++total_bitmap_entries;
+				}
 			}
 		}
 		total_size += part_size;
@@ -2063,7 +2295,7 @@ _BM25::_BM25(
 	total_size /= 1024 * 1024;
 	uint64_t vocab_size = unique_terms_found * (4 + 5 + 1) / 1048576;
 	uint64_t line_offsets_size = num_docs * 8 / 1048576;
-	uint64_t doc_sizes_size = num_docs * 2 / 1048576;
+	uint64_t doc_sizes_size = num_docs / 1048576;
 	uint64_t inverted_index_size = total_size;
 	bloom_filters_size /= 1048576;
 	total_size = vocab_size + line_offsets_size + doc_sizes_size + inverted_index_size + bloom_filters_size;
@@ -2079,6 +2311,12 @@ _BM25::_BM25(
 	std::cout << "Total number of documents:      " << num_docs << std::endl;
 	std::cout << "Total number of unique terms:   " << unique_terms_found << std::endl;
 	std::cout << "Total number of bloom filters:  " << total_bloom_filters << std::endl;
+	std::cout << "Of which exact bitmaps:         " << total_bitmap_entries << std::endl;
+	std::cout << "Mean estimated bloom FPR:       " << mean_bloom_fpr(index_partitions);
+	std::cout << " (" << bloom_filter_type_name(bloom_filter_type);
+	std::cout << ", target " << bloom_fpr << ")" << std::endl;
+
+	init_query_pool(num_partitions, false);
 
 	if (DEBUG) {
 		auto read_end = std::chrono::high_resolution_clock::now();
@@ -2095,12 +2333,18 @@ _BM25::_BM25(
 		float  k1,
 		float  b,
 		uint16_t num_partitions,
-		const std::vector<std::string>& _stop_words
+		const std::vector<std::string>& _stop_words,
+		PostingFormat posting_format,
+		BloomFilterType bloom_filter_type,
+		PostingBuild posting_build
 		) : bloom_df_threshold(bloom_df_threshold),
 			bloom_fpr(bloom_fpr),
 			k1(k1), 
 			b(b),
-			num_partitions(num_partitions) {
+			num_partitions(num_partitions),
+			posting_format(posting_format),
+			bloom_filter_type(bloom_filter_type),
+			posting_build(posting_build) {
 	
 	for (const std::string& stop_word : _stop_words) {
 		stop_words.insert(stop_word);
@@ -2118,6 +2362,9 @@ _BM25::_BM25(
 	for (uint16_t i = 0; i < num_partitions; ++i) {
 		index_partitions[i].II.resize(search_cols.size());
 		index_partitions[i].unique_term_mapping.resize(search_cols.size());
+		for (TermDictionary& vocab : index_partitions[i].unique_term_mapping) {
+			intern_stop_words(vocab, stop_words);
+		}
 	}
 
 	index_partitions.resize(num_partitions);
@@ -2147,13 +2394,16 @@ _BM25::_BM25(
 	for (uint16_t i = 0; i < num_partitions; ++i) {
 		threads.push_back(std::thread(
 			[this, &documents, i] {
-				read_in_memory(
-						documents, 
-						partition_boundaries[i], 
-						partition_boundaries[i + 1], 
-						i
-						);
+				read_partition(i, [&] {
+					read_in_memory(
+							documents, 
+							partition_boundaries[i], 
+							partition_boundaries[i + 1], 
+							i
+							);
+				});
 				write_bloom_filters(i);
+				encode_postings(i);
 			}
 		));
 	}
@@ -2162,6 +2412,8 @@ _BM25::_BM25(
 		thread.join();
 	}
 
+	compute_global_stats();
+
 	if (!DEBUG) finalize_progress_bar();
 
 	uint64_t total_size = 0;
@@ -2171,11 +2423,9 @@ _BM25::_BM25(
 
 		uint64_t part_size = 0;
 		for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-			for (const auto& row : IP.II[col_idx].inverted_index_compressed) {
-				part_size += sizeof(uint8_t) * row.doc_ids.size();
-				part_size += sizeof(RLEElement_u8) * row.term_freqs.size();
-			}
-			unique_terms_found += IP.unique_term_mapping[col_idx].size();
+			part_size += IP.II[col_idx].posting_bytes.size();
+			part_size += sizeof(PostingEntry) * IP.II[col_idx].postings.size();
+			unique_terms_found += IP.unique_term_mapping[col_idx].num_terms;
 		}
 		total_size += part_size;
 
@@ -2183,7 +2433,7 @@ _BM25::_BM25(
 	total_size /= 1024 * 1024;
 	uint64_t vocab_size = unique_terms_found * (4 + 5 + 1) / 1048576;
 	uint64_t line_offsets_size = num_docs * 8 / 1048576;
-	uint64_t doc_sizes_size = num_docs * 2 / 1048576;
+	uint64_t doc_sizes_size = num_docs / 1048576;
 	uint64_t inverted_index_size = total_size;
 	total_size = vocab_size + line_offsets_size + doc_sizes_size + inverted_index_size;
 
@@ -2196,6 +2446,11 @@ _BM25::_BM25(
 
 	std::cout << "Total number of documents:      " << num_docs << std::endl;
 	std::cout << "Total number of unique terms:   " << unique_terms_found << std::endl;
+	std::cout << "Mean estimated bloom FPR:       " << mean_bloom_fpr(index_partitions);
+	std::cout << " (" << bloom_filter_type_name(bloom_filter_type);
+	std::cout << ", target " << bloom_fpr << ")" << std::endl;
+
+	init_query_pool(num_partitions, false);
 }
 
 inline float _BM25::_compute_bm25(
@@ -2206,62 +2461,43 @@ inline float _BM25::_compute_bm25(
 		) {
 	BM25Partition& IP = index_partitions[partition_id];
 
-	float doc_size = IP.doc_sizes[doc_id];
-	return idf * tf / (tf + k1 * (1 - b + b * doc_size / IP.avg_doc_size));
+	return idf * tf / (tf + norm_table[IP.doc_norms[doc_id]]);
 }
 
-void _BM25::add_query_term(
-		std::string& substr,
-		std::vector<std::vector<uint64_t>>& term_idxs,
-		uint16_t partition_id
+inline float _BM25::_compute_idf(
+		uint16_t partition_id,
+		uint16_t col_idx,
+		uint64_t term_idx
 		) {
-	BM25Partition& IP = index_partitions[partition_id];
-
-	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		robin_hood::unordered_map<std::string, uint32_t>& vocab = IP.unique_term_mapping[col_idx];
-
-		if (vocab.find(substr) == vocab.end()) {
-			continue;
-		}
-
-		if (stop_words.find(substr) != stop_words.end()) {
-			continue;
-		}
-
-		term_idxs[col_idx].push_back(vocab[substr]);
-	}
-	substr.clear();
-}
+	// Global df and doc count. Scores are equal for any number of partitions.
+	float df = index_partitions[partition_id].II[col_idx].global_doc_freqs[term_idx];
+	return log((num_docs - df + 0.5) / (df + 0.5));
+}
 
 
 void _BM25::add_query_term_bloom(
 		std::string& substr,
 		std::vector<std::vector<uint64_t>>& low_df_term_idxs,
 		std::vector<std::vector<uint64_t>>& high_df_term_idxs,
-		std::vector<std::vector<BloomEntry>>& bloom_entries,
+		std::vector<std::vector<const BloomEntry*>>& bloom_entries,
 		uint16_t partition_id
 		) {
 	BM25Partition& IP = index_partitions[partition_id];
 
+	uint64_t hash = term_hash(substr);
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		robin_hood::unordered_map<std::string, uint32_t>& vocab = IP.unique_term_mapping[col_idx];
-
-		auto it = vocab.find(substr);
-		if (it == vocab.end()) {
+		uint32_t term_idx = term_dict_find(IP.unique_term_mapping[col_idx], substr, hash);
+		if (term_idx == TERM_NOT_FOUND || term_idx == TERM_STOP_WORD) {
 			continue;
 		}
 
-		if (stop_words.find(substr) != stop_words.end()) {
-			continue;
-		}
-
-		auto it2 = IP.II[col_idx].bloom_filters.find(it->second);
-		if (it2 == IP.II[col_idx].bloom_filters.end()) {
-			low_df_term_idxs[col_idx].push_back(it->second);
+		auto it = IP.II[col_idx].bloom_filters.find(term_idx);
+		if (it == IP.II[col_idx].bloom_filters.end()) {
+			low_df_term_idxs[col_idx].push_back(term_idx);
 		}
 		else {
-			high_df_term_idxs[col_idx].push_back(it->second);
-			bloom_entries[col_idx].push_back(it2->second);
+			high_df_term_idxs[col_idx].push_back(term_idx);
+			bloom_entries[col_idx].push_back(&it->second);
 		}
 	}
 	substr.clear();
@@ -2272,183 +2508,251 @@ void _BM25::add_query_term_bloom(
 		std::string& substr,
 		std::vector<std::vector<uint64_t>>& low_df_term_idxs,
 		std::vector<std::vector<uint64_t>>& high_df_term_idxs,
-		std::vector<std::vector<BloomEntry>>& bloom_entries,
+		std::vector<std::vector<const BloomEntry*>>& bloom_entries,
 		uint16_t partition_id,
 		uint16_t col_idx
 		) {
 	BM25Partition& IP = index_partitions[partition_id];
 
-	robin_hood::unordered_map<std::string, uint32_t>& vocab = IP.unique_term_mapping[col_idx];
-
-	auto it = vocab.find(substr);
-	if (it == vocab.end()) {
+	uint32_t term_idx = term_dict_find(IP.unique_term_mapping[col_idx], substr, term_hash(substr));
+	if (term_idx == TERM_NOT_FOUND || term_idx == TERM_STOP_WORD) {
 		substr.clear();
 		return;
 	}
 
-	if (stop_words.find(substr) != stop_words.end()) {
-		substr.clear();
-		return;
-	}
-
-	auto it2 = IP.II[col_idx].bloom_filters.find(it->second);
-	if (it2 == IP.II[col_idx].bloom_filters.end()) {
-		low_df_term_idxs[col_idx].push_back(it->second);
+	auto it = IP.II[col_idx].bloom_filters.find(term_idx);
+	if (it == IP.II[col_idx].bloom_filters.end()) {
+		low_df_term_idxs[col_idx].push_back(term_idx);
 	}
 	else {
-		high_df_term_idxs[col_idx].push_back(it->second);
-		bloom_entries[col_idx].push_back(it2->second);
+		high_df_term_idxs[col_idx].push_back(term_idx);
+		bloom_entries[col_idx].push_back(&it->second);
 	}
 	substr.clear();
 }
 
 
-std::vector<BM25Result> _BM25::_query_partition(
-		std::string& query, 
-		uint32_t k,
-		uint32_t query_max_df,
+void _BM25::_tokenize_query(
+		std::string& query,
 		uint16_t partition_id,
-		std::vector<float> boost_factors
+		QueryScratch& scratch
 		) {
-	auto start = std::chrono::high_resolution_clock::now();
-	std::vector<std::vector<uint64_t>> term_idxs(search_cols.size());
-	BM25Partition& IP = index_partitions[partition_id];
-
-	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+	// Resets scratch and splits query on spaces into the low and high df
+	// terms of the partition. Terms marked ready are kept instead.
+	if (scratch.terms_ready) {
+		scratch.terms_ready = false;
+		reset_query_scratch(scratch, search_cols.size(), true);
+		return;
+	}
+	reset_query_scratch(scratch, search_cols.size());
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
 
-	std::string substr = "";
+	std::string& substr = scratch.substr;
 	for (const char& c : query) {
 		if (c != ' ') {
 			substr += toupper(c); 
 			continue;
 		}
 
-		add_query_term(substr, term_idxs, partition_id);	
+		add_query_term_bloom(
+				substr, 
+				low_df_term_idxs, 
+				high_df_term_idxs, 
+				bloom_entries,
+				partition_id
+				);	
 	}
 	if (!substr.empty()) {
-		add_query_term(substr, term_idxs, partition_id);
+		add_query_term_bloom(
+				substr, 
+				low_df_term_idxs, 
+				high_df_term_idxs, 
+				bloom_entries,
+				partition_id
+				);	
 	}
+}
 
-	if (term_idxs.size() == 0) return std::vector<BM25Result>();
+
+static uint64_t expected_candidates(
+		BM25Partition& IP,
+		const std::vector<std::vector<uint64_t>>& low_df_term_idxs,
+		const std::vector<std::vector<uint64_t>>& high_df_term_idxs,
+		uint32_t query_max_df
+		) {
+	// Upper bound on number of docs scored by a query.
+	// Used to choose between dense and hash accumulators.
+	uint64_t num_candidates = 0;
+	for (uint16_t col_idx = 0; col_idx < low_df_term_idxs.size(); ++col_idx) {
+		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
+			uint64_t df = IP.II[col_idx].doc_freqs[term_idx];
+			if (df <= query_max_df) {
+				num_candidates += df;
+			}
+		}
+	}
+
+	if (num_candidates == 0) {
+		// Only high df terms. Candidates come from bloom entry top-k docs.
+		for (uint16_t col_idx = 0; col_idx < high_df_term_idxs.size(); ++col_idx) {
+			for (const uint64_t& term_idx : high_df_term_idxs[col_idx]) {
+				auto it = IP.II[col_idx].bloom_filters.find(term_idx);
+				if (it != IP.II[col_idx].bloom_filters.end()) {
+					num_candidates = std::max(num_candidates, (uint64_t)it->second.topk_doc_ids.size());
+				}
+			}
+		}
+	}
+	return std::min(num_candidates, IP.num_docs);
+}
+
+void _BM25::_query_partition(
+		std::string& query, 
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
+		) {
+	// QUERY_TAAT. Scores every posting of the low df terms with no bloom
+	// entry bookkeeping. High df terms need _query_partition_bloom.
+	auto start = std::chrono::high_resolution_clock::now();
+
+	_tokenize_query(query, partition_id, scratch);
+	result.clear();
+	std::vector<std::vector<uint64_t>>& term_idxs = scratch.low_df_term_idxs;
+	BM25Partition& IP = index_partitions[partition_id];
+
+	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		if (!scratch.bloom_entries[col_idx].empty()) {
+			scratch.terms_ready = true;
+			return _query_partition_bloom(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+		}
+	}
 
 	// Gather docs that contain at least one term from the query
 	// Uses dynamic max_df for performance
-	robin_hood::unordered_map<uint64_t, float> doc_scores;
+	ScoreAccumulator& doc_scores = scratch.doc_scores;
+	accumulator_init(
+			doc_scores,
+			IP.num_docs,
+			expected_candidates(IP, term_idxs, scratch.high_df_term_idxs, query_max_df)
+			);
 
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 		for (const uint64_t& term_idx : term_idxs[col_idx]) {
 			float boost_factor = boost_factors[col_idx];
 
-			uint64_t df = get_rle_u8_row_size(
-					IP.II[col_idx].inverted_index_compressed[term_idx].term_freqs
-					);
+			uint64_t df = posting_list_df(get_posting_list(IP.II[col_idx], term_idx));
 
 			if (df == 0 || df > query_max_df) {
 				continue;
 			}
 
-			float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-			IIRow row = get_II_row(&IP.II[col_idx], term_idx);
-
-			// Partial sort row.doc_ids by row.term_freqs to get top k
-			for (uint64_t i = 0; i < df; ++i) {
-
-				uint64_t doc_id  = row.doc_ids[i];
-				float tf 		 = row.term_freqs[i];
-				float bm25_score = _compute_bm25(doc_id, tf, idf, partition_id) * boost_factor;
-
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
-			}
+			float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+			IIRow& row = scratch.row;
+			get_II_row(&IP.II[col_idx], term_idx, row);
+			accumulate_postings(
+					doc_scores,
+					row.doc_ids.data(),
+					row.term_freqs.data(),
+					df,
+					IP.doc_norms.data(),
+					norm_table,
+					idf * boost_factor
+					);
 		}
 	}
 
 	if (DEBUG) {
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
-		std::cout << "Number of docs: " << doc_scores.size() << "   GATHER TIME: ";
+		std::cout << "Number of docs: " << accumulator_size(doc_scores) << "   GATHER TIME: ";
 		std::cout << elapsed_ms.count() << "ms" << std::endl;
 		fflush(stdout);
 	}
 	
-	if (doc_scores.size() == 0) {
-		return std::vector<BM25Result>();
+	if (accumulator_size(doc_scores) == 0) {
+		return;
 	}
 
-	start = std::chrono::high_resolution_clock::now();
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+	get_topk_doc_scores(doc_scores, k, partition_id, doc_offset, scratch.top_k_heap, result);
+}
 
-	for (const auto& pair : doc_scores) {
-		BM25Result result {
-			.doc_id = pair.first,
-			.score  = pair.second,
-			.partition_id = partition_id
-		};
-		top_k_docs.push(result);
-		if (top_k_docs.size() > k) {
-			top_k_docs.pop();
-		}
+static inline void push_top_k(
+		std::vector<BM25Result>& heap,
+		uint32_t k,
+		uint64_t doc_id,
+		float score,
+		uint16_t partition_id,
+		float& threshold
+		) {
+	BM25Result doc {
+		.doc_id = doc_id,
+		.score  = score,
+		.partition_id = partition_id
+	};
+
+	if (heap.size() < k) {
+		heap.push_back(doc);
+		std::push_heap(heap.begin(), heap.end(), _compare_bm25_result());
+	} else {
+		std::pop_heap(heap.begin(), heap.end(), _compare_bm25_result());
+		heap.back() = doc;
+		std::push_heap(heap.begin(), heap.end(), _compare_bm25_result());
 	}
 
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+	// Only prune once k docs have been found.
+	if (heap.size() == k) {
+		threshold = heap.front().score;
 	}
+}
 
-	return result;
+static inline void sync_threshold(QueryScratch& scratch, float local_threshold, float& threshold) {
+	// Publishes the local k-th score and adopts a higher one from another partition.
+	shared_threshold_raise(scratch.shared_threshold, local_threshold);
+
+	float shared = shared_threshold_get(scratch.shared_threshold);
+	if (shared > threshold) {
+		if (shared > local_threshold) ++scratch.threshold_stats.threshold_raises;
+		threshold = shared;
+	}
+	threshold = std::max(threshold, local_threshold);
+}
+
+static inline bool queue_bloom_candidate(QueryScratch& scratch, uint64_t doc_id, float score) {
+	// Returns true once a full batch is queued for _score_bloom_batch.
+	scratch.batch_doc_ids.push_back(doc_id);
+	scratch.batch_scores.push_back(score);
+	return scratch.batch_doc_ids.size() == BLOOM_BATCH_SIZE;
 }
 
-std::vector<BM25Result> _BM25::_query_partition_bloom(
+void _BM25::_query_partition_bloom(
 		std::string& query, 
 		uint32_t k,
 		uint32_t query_max_df,
 		uint16_t partition_id,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
 		) {
 	auto start = std::chrono::high_resolution_clock::now();
-	std::vector<std::vector<uint64_t>> low_df_term_idxs(search_cols.size());
-	std::vector<std::vector<uint64_t>> high_df_term_idxs(search_cols.size());
-	std::vector<std::vector<BloomEntry>> bloom_entries(search_cols.size());
+
+	_tokenize_query(query, partition_id, scratch);
+	result.clear();
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
 	BM25Partition& IP = index_partitions[partition_id];
 
 	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
 
-	std::string substr = "";
-	for (const char& c : query) {
-		if (c != ' ') {
-			substr += toupper(c); 
-			continue;
-		}
-
-		add_query_term_bloom(
-				substr, 
-				low_df_term_idxs, 
-				high_df_term_idxs, 
-				bloom_entries,
-				partition_id
-				);	
-	}
-	if (!substr.empty()) {
-		add_query_term_bloom(
-				substr, 
-				low_df_term_idxs, 
-				high_df_term_idxs, 
-				bloom_entries,
-				partition_id
-				);	
-	}
 
 	uint16_t num_low_df_terms = 0;
 	uint16_t num_high_df_terms = 0;
@@ -2456,10 +2760,15 @@ std::vector<BM25Result> _BM25::_query_partition_bloom(
 		num_low_df_terms  += low_df_term_idxs[col_idx].size();
 		num_high_df_terms += high_df_term_idxs[col_idx].size();
 	}
-	if (num_low_df_terms + num_high_df_terms == 0) return std::vector<BM25Result>();
+	if (num_low_df_terms + num_high_df_terms == 0) return;
 
 	// Score low_df terms first.
-	robin_hood::unordered_map<uint64_t, float> doc_scores;
+	ScoreAccumulator& doc_scores = scratch.doc_scores;
+	accumulator_init(
+			doc_scores,
+			IP.num_docs,
+			expected_candidates(IP, low_df_term_idxs, high_df_term_idxs, query_max_df)
+			);
 
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
@@ -2471,462 +2780,1517 @@ std::vector<BM25Result> _BM25::_query_partition_bloom(
 				continue;
 			}
 
-			float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-			IIRow row = get_II_row(&IP.II[col_idx], term_idx);
-			for (uint64_t i = 0; i < df; ++i) {
-
-				uint64_t doc_id  = row.doc_ids[i];
-				float tf 		 = row.term_freqs[i];
-				float bm25_score = _compute_bm25(doc_id, tf, idf, partition_id) * boost_factor;
-
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
-			}
+			float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+			IIRow& row = scratch.row;
+			get_II_row(&IP.II[col_idx], term_idx, row);
+			accumulate_postings(
+					doc_scores,
+					row.doc_ids.data(),
+					row.term_freqs.data(),
+					df,
+					IP.doc_norms.data(),
+					norm_table,
+					idf * boost_factor
+					);
 		}
 	}
 
 	// Now score high_df terms
 	if (num_high_df_terms > 0) {
-		if (doc_scores.size() == 0) {
+		if (accumulator_size(doc_scores) == 0 && all_bitmap_entries(bloom_entries)) {
+			_score_bitmap_union(scratch, partition_id, boost_factors);
+		} else if (accumulator_size(doc_scores) == 0) {
 			// Sort high_df_term_idxs by df.
 			// Get top-k docs for lowest df term. Then use bloom scoring for the rest.
-			std::vector<uint32_t> df_values;
 			uint32_t min_df = UINT32_MAX;
-			uint16_t min_df_col_idx;
-			uint16_t min_df_term_idx;
+			uint16_t min_df_col_idx = 0;
+			uint16_t min_df_idx 	= 0;	// Index into high_df_term_idxs[min_df_col_idx].
 
 			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-				uint16_t cntr = 0;
-				for (const uint64_t& term_idx : high_df_term_idxs[col_idx]) {
+				for (uint16_t idx = 0; idx < high_df_term_idxs[col_idx].size(); ++idx) {
+					const uint64_t& term_idx = high_df_term_idxs[col_idx][idx];
 					uint32_t df = IP.II[col_idx].doc_freqs[term_idx];
 					if (df < min_df) {
 						min_df_col_idx = col_idx;
-						min_df_term_idx = cntr++;
-						min_df = df;
+						min_df_idx 	   = idx;
+						min_df 		   = df;
 					}
-					df_values.push_back(
-								IP.II[col_idx].doc_freqs[term_idx]
-								);
 				}
 			}
 
 			// First score the term with the lowest df.
-			float idf = log((IP.num_docs - min_df + 0.5) / (min_df + 0.5));
-			BloomEntry& bloom_entry = bloom_entries[min_df_col_idx][min_df_term_idx];
+			float idf = _compute_idf(partition_id, min_df_col_idx, high_df_term_idxs[min_df_col_idx][min_df_idx]);
+			const BloomEntry& bloom_entry = *bloom_entries[min_df_col_idx][min_df_idx];
 			for (uint64_t i = 0; i < bloom_entry.topk_doc_ids.size(); ++i) {
 				uint64_t doc_id  = bloom_entry.topk_doc_ids[i];
 				float tf 		 = bloom_entry.topk_term_freqs[i];
 				float bm25_score = _compute_bm25(doc_id, tf, idf, partition_id) * boost_factors[min_df_col_idx];
 
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
+				accumulator_add(doc_scores, doc_id, bm25_score);
 			}
 
 			// Now score the rest using bloom filters.
+			gather_bloom_candidates(scratch);
 			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 				for (uint16_t idx = 0; idx < high_df_term_idxs[col_idx].size(); ++idx) {
 					const uint64_t& term_idx = high_df_term_idxs[col_idx][idx];
 
-					if (col_idx == min_df_col_idx && term_idx == min_df_term_idx) {
-						continue;
-					}
+					if (col_idx == min_df_col_idx && idx == min_df_idx) {
+						continue;
+					}
+
+					const BloomEntry& bloom_entry = *bloom_entries[col_idx][idx];
+					float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+					_score_bloom_entry(scratch, bloom_entry, idf, boost_factors[col_idx], partition_id);
+				}
+			}
+		} else if (k > 0) {
+			// Candidates are probed a batch at a time, so the local k-th score
+			// rises as they go. It is published after every batch, and a higher
+			// one from another partition prunes the remaining candidates.
+			float bloom_bound 	  = _init_bloom_terms(scratch, partition_id, boost_factors);
+			float local_threshold = -FLT_MAX;
+			float threshold 	  = -FLT_MAX;
+			sync_threshold(scratch, local_threshold, threshold);
+
+			accumulator_for_each(doc_scores, [&](uint64_t doc_id, float& score) {
+				if (score + bloom_bound <= threshold) {
+					if (score + bloom_bound > local_threshold) ++scratch.threshold_stats.candidates_skipped;
+					return;
+				}
+				if (queue_bloom_candidate(scratch, doc_id, score)) {
+					_score_bloom_batch(scratch, k, threshold, local_threshold, bloom_bound, partition_id);
+				}
+			});
+			_score_bloom_batch(scratch, k, threshold, local_threshold, bloom_bound, partition_id);
+
+			pop_top_k(scratch.top_k_heap, doc_offset, result);
+			return;
+		}
+	}
+
+	if (DEBUG) {
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
+		std::cout << "Number of docs: " << accumulator_size(doc_scores) << "   GATHER TIME: ";
+		std::cout << elapsed_ms.count() << "ms" << std::endl;
+		fflush(stdout);
+	}
+	
+	if (accumulator_size(doc_scores) == 0) {
+		return;
+	}
+
+	get_topk_doc_scores(doc_scores, k, partition_id, doc_offset, scratch.top_k_heap, result);
+
+	// Partitions still running prune with this k-th score.
+	if (k > 0 && result.size() == k) {
+		shared_threshold_raise(scratch.shared_threshold, result.back().score);
+	}
+}
+
+
+static inline float cursor_block_max(PostingCursor& cursor, uint64_t target) {
+	const PostingBlock* block = cursor_shallow_block(cursor, target);
+	if (block == nullptr) return 0.0f;
+	return std::max(0.0f, cursor.weight * block->max_score);
+}
+
+static inline uint64_t cursor_block_end(PostingCursor& cursor, uint64_t target) {
+	const PostingBlock* block = cursor_shallow_block(cursor, target);
+	if (block == nullptr) return POSTING_END;
+	return block->last_doc_id + 1;
+}
+
+void _BM25::_score_bloom_entry(
+		QueryScratch& scratch,
+		const BloomEntry& bloom_entry,
+		float idf,
+		float boost_factor,
+		uint16_t partition_id
+		) {
+	// Probes all gathered candidates one filter at a time.
+	const uint64_t num_keys = scratch.bloom_keys.size();
+
+	if (bloom_entry.bitmap != nullptr) {
+		const BitmapEntry& bitmap = *bloom_entry.bitmap;
+		ScoreAccumulator&  acc 	  = scratch.doc_scores;
+
+		if (acc.mode == ACCUMULATOR_DENSE) {
+			// Candidates holding the term are the AND of touched docs and the bitmap.
+			uint64_t num_words = std::min(acc.touched_bits.size(), bitmap.bits.size());
+			scratch.bitmap_words.resize(num_words);
+			bitmap_and(acc.touched_bits.data(), bitmap.bits.data(), scratch.bitmap_words.data(), num_words);
+
+			bitmap_for_each(scratch.bitmap_words.data(), num_words, [&](uint64_t doc_id) {
+				acc.dense_scores[doc_id] += _compute_bm25(
+						doc_id, 
+						(float)bitmap_tf(bitmap, doc_id),
+						idf, 
+						partition_id
+						) * boost_factor;
+			});
+			return;
+		}
+
+		for (uint64_t i = 0; i < num_keys; ++i) {
+			uint64_t doc_id = scratch.bloom_keys[i];
+			uint16_t tf 	= bitmap_tf(bitmap, doc_id);
+			if (tf == 0) continue;
+
+			*scratch.bloom_scores[i] += _compute_bm25(
+					doc_id, 
+					(float)tf,
+					idf, 
+					partition_id
+					) * boost_factor;
+		}
+		return;
+	}
+
+	if (bloom_entry.tf_filter.slots != nullptr) {
+		// Single lookup returns tf or 0.
+		xor_filter_get_batch(bloom_entry.tf_filter, scratch.bloom_keys.data(), num_keys, scratch.bloom_hits.data());
+
+		for (uint64_t i = 0; i < num_keys; ++i) {
+			uint8_t tf = scratch.bloom_hits[i];
+			if (tf == 0) continue;
+
+			uint64_t doc_id = scratch.bloom_keys[i];
+			*scratch.bloom_scores[i] += _compute_bm25(
+					doc_id, 
+					(float)tf,
+					idf, 
+					partition_id
+					) * boost_factor;
+		}
+		return;
+	}
+
+	for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
+		bloom_query_batch(bf, scratch.bloom_keys.data(), num_keys, scratch.bloom_hits.data());
+
+		for (uint64_t i = 0; i < num_keys; ++i) {
+			if (!scratch.bloom_hits[i]) continue;
+
+			uint64_t doc_id = scratch.bloom_keys[i];
+			*scratch.bloom_scores[i] += _compute_bm25(
+					doc_id, 
+					(float)tf,
+					idf, 
+					partition_id
+					) * boost_factor;
+		}
+	}
+}
+
+void _BM25::_score_bitmap_union(
+		QueryScratch& scratch,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors
+		) {
+	// Every high df term of the query has exact postings. Candidates are
+	// the OR of their bitmaps, and each is scored exactly.
+	BM25Partition& IP = index_partitions[partition_id];
+
+	uint64_t num_words = (IP.num_docs + 63) / 64;
+	scratch.bitmap_words.assign(num_words, 0);
+
+	scratch.bloom_terms.clear();
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (uint16_t idx = 0; idx < scratch.high_df_term_idxs[col_idx].size(); ++idx) {
+			const BloomEntry& bloom_entry = *scratch.bloom_entries[col_idx][idx];
+			const BitmapEntry& bitmap 	  = *bloom_entry.bitmap;
+
+			bitmap_or(
+					scratch.bitmap_words.data(), 
+					bitmap.bits.data(), 
+					scratch.bitmap_words.data(), 
+					std::min(num_words, (uint64_t)bitmap.bits.size())
+					);
+
+			BloomTerm bloom_term;
+			bloom_term.entry 	 = &bloom_entry;
+			bloom_term.weight 	 = _compute_idf(partition_id, col_idx, scratch.high_df_term_idxs[col_idx][idx]);
+			bloom_term.max_score = 0.0f;
+			bloom_term.col_idx 	 = col_idx;
+			bloom_term.filters_begin = 0;
+			bloom_term.filters_end 	 = 0;
+			scratch.bloom_terms.push_back(bloom_term);
+		}
+	}
+
+	uint64_t num_candidates = 0;
+	for (const uint64_t& word : scratch.bitmap_words) {
+		num_candidates += __builtin_popcountll(word);
+	}
+	accumulator_init(scratch.doc_scores, IP.num_docs, num_candidates);
+
+	bitmap_for_each(scratch.bitmap_words.data(), num_words, [&](uint64_t doc_id) {
+		float score = 0.0f;
+		for (const BloomTerm& bloom_term : scratch.bloom_terms) {
+			uint16_t tf = bitmap_tf(*bloom_term.entry->bitmap, doc_id);
+			if (tf == 0) continue;
+
+			score += _compute_bm25(
+					doc_id, 
+					(float)tf,
+					bloom_term.weight, 
+					partition_id
+					) * boost_factors[bloom_term.col_idx];
+		}
+		accumulator_add(scratch.doc_scores, doc_id, score);
+	});
+	scratch.bloom_terms.clear();
+}
+
+float _BM25::_init_bloom_terms(
+		QueryScratch& scratch,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors
+		) {
+	// Fills scratch.bloom_terms from the high df terms of the query.
+	// Returns the sum of their upper bounds. Each term scores at most one
+	// tf per doc, so a term is bounded by the score of its largest tf.
+	float bloom_bound = 0.0f;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (uint16_t idx = 0; idx < scratch.high_df_term_idxs[col_idx].size(); ++idx) {
+			const BloomEntry& bloom_entry = *scratch.bloom_entries[col_idx][idx];
+
+			float idf = _compute_idf(partition_id, col_idx, scratch.high_df_term_idxs[col_idx][idx]);
+
+			uint16_t max_tf = bloom_entry.tf_filter.max_value;
+			if (bloom_entry.bitmap != nullptr) {
+				max_tf = bloom_entry.bitmap->max_tf;
+			}
+
+			BloomTerm bloom_term;
+			bloom_term.filters_begin = scratch.bloom_tf_filters.size();
+			for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
+				scratch.bloom_tf_filters.push_back({&bf, tf});
+				max_tf = std::max(max_tf, tf);
+			}
+			bloom_term.filters_end = scratch.bloom_tf_filters.size();
+			std::sort(
+					scratch.bloom_tf_filters.begin() + bloom_term.filters_begin,
+					scratch.bloom_tf_filters.end(),
+					[](const BloomTfFilter& a, const BloomTfFilter& b) {
+						return a.tf > b.tf;
+					}
+					);
+
+			bloom_term.entry 	 = &bloom_entry;
+			bloom_term.weight 	 = idf * boost_factors[col_idx];
+			bloom_term.max_score = std::max(
+					0.0f, 
+					bloom_term.weight * bm25_tf_norm((float)max_tf, norm_table[encode_doc_norm(0)])
+					);
+			bloom_term.col_idx 	 = col_idx;
+			scratch.bloom_terms.push_back(bloom_term);
+
+			bloom_bound += bloom_term.max_score;
+		}
+	}
+	return bloom_bound;
+}
+
+float _BM25::_score_bloom_terms(
+		QueryScratch& scratch,
+		uint64_t doc_id,
+		float score,
+		float threshold,
+		float local_threshold,
+		float bloom_bound,
+		uint16_t partition_id
+		) {
+	// Adds bloom term scores of doc_id. A doc is put in one tf filter of
+	// a term, so only the largest tf whose filter hits is scored. Stops
+	// once the doc can no longer exceed threshold.
+	const std::vector<BloomTerm>& bloom_terms = scratch.bloom_terms;
+
+	float remaining = bloom_bound;
+	for (uint32_t i = 0; i < bloom_terms.size(); ++i) {
+		const BloomTerm& bloom_term = bloom_terms[i];
+
+		if (score + remaining <= threshold) {
+			if (score + remaining > local_threshold) {
+				scratch.threshold_stats.bloom_probes_skipped += bloom_terms.size() - i;
+			}
+			break;
+		}
+		remaining -= bloom_term.max_score;
+
+		if (bloom_term.entry->bitmap != nullptr) {
+			uint16_t tf = bitmap_tf(*bloom_term.entry->bitmap, doc_id);
+			if (tf > 0) {
+				score += _compute_bm25(doc_id, (float)tf, bloom_term.weight, partition_id);
+			}
+			continue;
+		}
+
+		if (bloom_term.entry->tf_filter.slots != nullptr) {
+			uint8_t tf = xor_filter_get(bloom_term.entry->tf_filter, doc_id);
+			if (tf > 0) {
+				score += _compute_bm25(doc_id, (float)tf, bloom_term.weight, partition_id);
+			}
+			continue;
+		}
+
+		for (uint32_t j = bloom_term.filters_begin; j < bloom_term.filters_end; ++j) {
+			const BloomTfFilter& tf_filter = scratch.bloom_tf_filters[j];
+			if (bloom_query(*tf_filter.filter, doc_id)) {
+				score += _compute_bm25(doc_id, (float)tf_filter.tf, bloom_term.weight, partition_id);
+				break;
+			}
+		}
+	}
+	return score;
+}
+
+void _BM25::_score_bloom_batch(
+		QueryScratch& scratch,
+		uint32_t k,
+		float& threshold,
+		float& local_threshold,
+		float bloom_bound,
+		uint16_t partition_id
+		) {
+	// Adds bloom term scores of the queued candidates one term at a time,
+	// probing the filters for the whole batch at once. Candidates drop out
+	// once they can no longer exceed threshold. Survivors go into the top-k
+	// heap and the new local threshold is synced with other partitions.
+	const std::vector<BloomTerm>& bloom_terms = scratch.bloom_terms;
+	std::vector<uint64_t>& doc_ids = scratch.batch_doc_ids;
+	std::vector<float>&    scores  = scratch.batch_scores;
+	std::vector<uint16_t>& tfs 	   = scratch.batch_tfs;
+
+	uint32_t num_live  = doc_ids.size();
+	float    remaining = bloom_bound;
+	for (uint32_t i = 0; i < bloom_terms.size() && num_live > 0; ++i) {
+		const BloomTerm& bloom_term = bloom_terms[i];
+
+		uint32_t num_kept = 0;
+		for (uint32_t j = 0; j < num_live; ++j) {
+			if (scores[j] + remaining <= threshold) {
+				if (scores[j] + remaining > local_threshold) {
+					scratch.threshold_stats.bloom_probes_skipped += bloom_terms.size() - i;
+				}
+				continue;
+			}
+			doc_ids[num_kept] = doc_ids[j];
+			scores[num_kept]  = scores[j];
+			++num_kept;
+		}
+		num_live = num_kept;
+		remaining -= bloom_term.max_score;
+
+		tfs.assign(num_live, 0);
+		if (bloom_term.entry->bitmap != nullptr) {
+			for (uint32_t j = 0; j < num_live; ++j) {
+				tfs[j] = bitmap_tf(*bloom_term.entry->bitmap, doc_ids[j]);
+			}
+		} else if (bloom_term.entry->tf_filter.slots != nullptr) {
+			scratch.bloom_hits.resize(num_live);
+			xor_filter_get_batch(bloom_term.entry->tf_filter, doc_ids.data(), num_live, scratch.bloom_hits.data());
+			for (uint32_t j = 0; j < num_live; ++j) {
+				tfs[j] = scratch.bloom_hits[j];
+			}
+		} else {
+			// A doc is put in one tf filter of a term, so only the largest
+			// tf whose filter hits is scored. Filters are sorted by tf
+			// descending and each probes only the docs not hit yet.
+			std::vector<uint32_t>& pending = scratch.batch_pending;
+			pending.resize(num_live);
+			for (uint32_t j = 0; j < num_live; ++j) pending[j] = j;
+
+			for (uint32_t f = bloom_term.filters_begin; f < bloom_term.filters_end && !pending.empty(); ++f) {
+				const BloomTfFilter& tf_filter = scratch.bloom_tf_filters[f];
+
+				scratch.batch_keys.resize(pending.size());
+				for (uint32_t p = 0; p < pending.size(); ++p) {
+					scratch.batch_keys[p] = doc_ids[pending[p]];
+				}
+				scratch.bloom_hits.resize(pending.size());
+				bloom_query_batch(*tf_filter.filter, scratch.batch_keys.data(), pending.size(), scratch.bloom_hits.data());
+
+				uint32_t num_pending = 0;
+				for (uint32_t p = 0; p < pending.size(); ++p) {
+					if (scratch.bloom_hits[p]) {
+						tfs[pending[p]] = tf_filter.tf;
+					} else {
+						pending[num_pending++] = pending[p];
+					}
+				}
+				pending.resize(num_pending);
+			}
+		}
+
+		for (uint32_t j = 0; j < num_live; ++j) {
+			if (tfs[j] == 0) continue;
+			scores[j] += _compute_bm25(doc_ids[j], (float)tfs[j], bloom_term.weight, partition_id);
+		}
+	}
+
+	for (uint32_t j = 0; j < num_live; ++j) {
+		if (scores[j] > threshold) {
+			push_top_k(scratch.top_k_heap, k, doc_ids[j], scores[j], partition_id, local_threshold);
+			threshold = std::max(threshold, local_threshold);
+		}
+	}
+	doc_ids.clear();
+	scores.clear();
+
+	sync_threshold(scratch, local_threshold, threshold);
+}
+
+void _BM25::_query_partition_pruned(
+		std::string& query, 
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
+		) {
+	// Exact document-at-a-time top-k over low df terms using MaxScore or Block-Max WAND.
+	// High df terms are probed in their bloom filters only for docs which can still
+	// enter the top-k. query_max_df is not needed to bound work and is ignored.
+	auto start = std::chrono::high_resolution_clock::now();
+
+	_tokenize_query(query, partition_id, scratch);
+	result.clear();
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
+	BM25Partition& IP = index_partitions[partition_id];
+
+	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+
+
+	uint16_t num_low_df_terms = 0;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		num_low_df_terms += low_df_term_idxs[col_idx].size();
+	}
+	if (num_low_df_terms == 0) {
+		// Nothing to iterate. Bloom path takes candidates from bloom entry top-k docs.
+		scratch.terms_ready = true;
+		return _query_partition_bloom(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+	}
+	if (k == 0) return;
+
+	std::vector<PostingCursor>& cursors = scratch.cursors;
+	cursors.resize(num_low_df_terms);
+
+	uint16_t cursor_idx = 0;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
+			float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+			PostingCursor& cursor = cursors[cursor_idx++];
+			cursor_init(
+					cursor,
+					IP.II[col_idx],
+					term_idx,
+					idf * boost_factors[col_idx],
+					IP.doc_norms,
+					norm_table
+					);
+			cursor.col_idx = col_idx;
+		}
+	}
+
+	float bloom_bound = _init_bloom_terms(scratch, partition_id, boost_factors);
+
+	// threshold is the higher of the local k-th score and the shared one.
+	std::vector<BM25Result>& heap = scratch.top_k_heap;
+	float local_threshold = -FLT_MAX;
+	float threshold 	  = -FLT_MAX;
+
+	// True if a doc bounded by bound cannot enter the top-k.
+	auto pruned = [&](float bound) {
+		if (bound > threshold) return false;
+		if (bound > local_threshold) ++scratch.threshold_stats.docs_skipped;
+		return true;
+	};
+
+	// Adds bloom term scores of doc_id. Stops once the doc can no longer reach threshold.
+	auto score_bloom_terms = [&](uint64_t doc_id, float score) {
+		return _score_bloom_terms(scratch, doc_id, score, threshold, local_threshold, bloom_bound, partition_id);
+	};
+
+	std::vector<PostingCursor*>& ordered = scratch.ordered_cursors;
+	ordered.clear();
+	for (PostingCursor& cursor : cursors) {
+		ordered.push_back(&cursor);
+	}
+	uint32_t num_cursors = ordered.size();
+
+	uint64_t num_scored = 0;
+	if (scratch.mode == QUERY_MAXSCORE) {
+		// Ascending upper bound. Cursors [0, first_essential) are non-essential.
+		// A doc found only in non-essential lists cannot enter the top-k.
+		std::sort(
+				ordered.begin(), 
+				ordered.end(), 
+				[](const PostingCursor* a, const PostingCursor* b) {
+					return a->max_score < b->max_score;
+				}
+				);
+
+		// bounds[i] is the best score of a doc found only in cursors [0, i].
+		std::vector<float>& bounds = scratch.cursor_bounds;
+		bounds.resize(num_cursors);
+		float bound = bloom_bound;
+		for (uint32_t i = 0; i < num_cursors; ++i) {
+			bound += ordered[i]->max_score;
+			bounds[i] = bound;
+		}
+
+		uint32_t first_essential = 0;
+		while (true) {
+			// Lists whose bound cannot exceed threshold become non-essential.
+			sync_threshold(scratch, local_threshold, threshold);
+			while (first_essential < num_cursors && bounds[first_essential] <= threshold) {
+				++first_essential;
+			}
+			if (first_essential == num_cursors) break;
+
+			uint64_t doc_id = POSTING_END;
+			for (uint32_t i = first_essential; i < num_cursors; ++i) {
+				doc_id = std::min(doc_id, cursor_doc(*ordered[i]));
+			}
+			if (doc_id == POSTING_END) break;
+
+			float score = 0.0f;
+			for (uint32_t i = first_essential; i < num_cursors; ++i) {
+				PostingCursor& cursor = *ordered[i];
+				if (cursor_doc(cursor) == doc_id) {
+					score += _compute_bm25(doc_id, (float)cursor_tf(cursor), cursor.weight, partition_id);
+					cursor_next(cursor);
+				}
+			}
+
+			bool can_enter = true;
+			for (int32_t i = (int32_t)first_essential - 1; i >= 0; --i) {
+				if (pruned(score + bounds[i])) {
+					can_enter = false;
+					break;
+				}
+
+				PostingCursor& cursor = *ordered[i];
+				cursor_next_geq(cursor, doc_id);
+				if (cursor_doc(cursor) == doc_id) {
+					score += _compute_bm25(doc_id, (float)cursor_tf(cursor), cursor.weight, partition_id);
+				}
+			}
+			if (!can_enter || pruned(score + bloom_bound)) continue;
+
+			score = score_bloom_terms(doc_id, score);
+			++num_scored;
+
+			if (score > threshold) {
+				push_top_k(heap, k, doc_id, score, partition_id, local_threshold);
+			}
+		}
+	} else {
+		// Block-Max WAND. Cursors are kept sorted by current doc.
+		auto by_doc = [](const PostingCursor* a, const PostingCursor* b) {
+			return cursor_doc(*a) < cursor_doc(*b);
+		};
+
+		while (true) {
+			sync_threshold(scratch, local_threshold, threshold);
+
+			// Few cursors and mostly sorted. Insertion sort.
+			for (uint32_t i = 1; i < num_cursors; ++i) {
+				PostingCursor* cursor = ordered[i];
+				int32_t j = (int32_t)i - 1;
+				while (j >= 0 && by_doc(cursor, ordered[j])) {
+					ordered[j + 1] = ordered[j];
+					--j;
+				}
+				ordered[j + 1] = cursor;
+			}
+
+			// Pivot is the first cursor where the sum of upper bounds can exceed threshold.
+			// No doc before the pivot doc can enter the top-k.
+			float bound = bloom_bound;
+			int32_t pivot = -1;
+			for (uint32_t i = 0; i < num_cursors; ++i) {
+				if (cursor_doc(*ordered[i]) == POSTING_END) break;
+
+				bound += ordered[i]->max_score;
+				if (bound > threshold) {
+					pivot = (int32_t)i;
+					break;
+				}
+			}
+			if (pivot < 0) break;
+
+			uint64_t pivot_doc = cursor_doc(*ordered[pivot]);
+			while (pivot + 1 < (int32_t)num_cursors && cursor_doc(*ordered[pivot + 1]) == pivot_doc) {
+				++pivot;
+			}
+
+			// Refine bound with the max scores of the blocks holding pivot_doc.
+			float block_bound = bloom_bound;
+			for (int32_t i = 0; i <= pivot; ++i) {
+				block_bound += cursor_block_max(*ordered[i], pivot_doc);
+			}
+
+			if (!pruned(block_bound)) {
+				if (cursor_doc(*ordered[0]) == pivot_doc) {
+					float score = 0.0f;
+					for (int32_t i = 0; i <= pivot; ++i) {
+						PostingCursor& cursor = *ordered[i];
+						score += _compute_bm25(pivot_doc, (float)cursor_tf(cursor), cursor.weight, partition_id);
+						cursor_next(cursor);
+					}
+
+					if (!pruned(score + bloom_bound)) {
+						score = score_bloom_terms(pivot_doc, score);
+						++num_scored;
+
+						if (score > threshold) {
+							push_top_k(heap, k, pivot_doc, score, partition_id, local_threshold);
+						}
+					}
+				} else {
+					// Move the highest bound cursor behind the pivot up to it.
+					int32_t move_idx = 0;
+					for (int32_t i = 1; i <= pivot && cursor_doc(*ordered[i]) < pivot_doc; ++i) {
+						if (ordered[i]->max_score > ordered[move_idx]->max_score) {
+							move_idx = i;
+						}
+					}
+					cursor_next_geq(*ordered[move_idx], pivot_doc);
+				}
+			} else {
+				// No doc can enter the top-k until one of the current blocks ends
+				// or a cursor past the pivot is reached.
+				uint64_t next_doc = POSTING_END;
+				int32_t  move_idx = 0;
+				for (int32_t i = 0; i <= pivot; ++i) {
+					next_doc = std::min(next_doc, cursor_block_end(*ordered[i], pivot_doc));
+					if (ordered[i]->max_score > ordered[move_idx]->max_score) {
+						move_idx = i;
+					}
+				}
+				if (pivot + 1 < (int32_t)num_cursors) {
+					next_doc = std::min(next_doc, cursor_doc(*ordered[pivot + 1]));
+				}
+				next_doc = std::max(next_doc, pivot_doc + 1);
+
+				cursor_next_geq(*ordered[move_idx], next_doc);
+			}
+		}
+	}
+	shared_threshold_raise(scratch.shared_threshold, local_threshold);
+
+	if (DEBUG) {
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
+		std::cout << "Number of docs scored: " << num_scored << "   GATHER TIME: ";
+		std::cout << elapsed_ms.count() << "ms" << std::endl;
+		fflush(stdout);
+	}
+
+	pop_top_k(heap, doc_offset, result);
+}
+
+// Tf norms in a segment are below (impact + 1) / IMPACT_LEVELS. Slack absorbs rounding.
+#define IMPACT_SLACK 1.0001f
+
+static inline float impact_segment_bound(const ImpactTerm& term) {
+	if (term.segment_idx == term.end_segment_idx) return 0.0f;
+
+	uint8_t impact = term.index->segments[term.segment_idx].impact;
+	return term.weight * (float)(impact + 1) / IMPACT_LEVELS * IMPACT_SLACK;
+}
+
+static float kth_largest_score(ScoreAccumulator& acc, uint32_t k, std::vector<float>& scores) {
+	// -FLT_MAX until k docs are accumulated.
+	if (accumulator_size(acc) < k) return -FLT_MAX;
+
+	scores.clear();
+	accumulator_for_each(acc, [&](uint64_t, float& score) {
+		scores.push_back(score);
+	});
+	std::nth_element(scores.begin(), scores.begin() + (k - 1), scores.end(), std::greater<float>());
+	return scores[k - 1];
+}
+
+void _BM25::_query_partition_impact(
+		std::string& query, 
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
+		) {
+	// Score-at-a-time (Anh & Moffat). Impact segments of the low df terms are
+	// read in order of decreasing score bound into an accumulator of partial
+	// scores. Reading stops once an unseen doc, bounded by the unread segments,
+	// can no longer beat the k-th partial score. Seen docs which may still
+	// enter the top-k are then rescored exactly from the doc ordered postings.
+	// With impact_budget set, reading also stops after that many postings and
+	// the partial scores are returned instead. query_max_df is ignored.
+	if (!impact_index_built) {
+		std::cerr << "Impact mode needs the impact index. Call build_impact_index first." << std::endl;
+		std::exit(1);
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+
+	_tokenize_query(query, partition_id, scratch);
+	result.clear();
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
+	BM25Partition& IP = index_partitions[partition_id];
+
+	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+
+
+	uint16_t num_low_df_terms = 0;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		num_low_df_terms += low_df_term_idxs[col_idx].size();
+	}
+	if (num_low_df_terms == 0) {
+		// Nothing to read. Bloom path takes candidates from bloom entry top-k docs.
+		scratch.terms_ready = true;
+		return _query_partition_bloom(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+	}
+	if (k == 0) return;
+
+	float bloom_bound = _init_bloom_terms(scratch, partition_id, boost_factors);
+
+	// Partial scores are lower bounds only while no term lowers a score.
+	bool has_negative_weight = false;
+	for (const BloomTerm& bloom_term : scratch.bloom_terms) {
+		has_negative_weight |= (bloom_term.weight < 0.0f);
+	}
+
+	std::vector<ImpactTerm>& terms = scratch.impact_terms;
+	terms.clear();
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		const ImpactIndex& index = IP.II[col_idx].impacts;
+		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
+			ImpactTerm term;
+			term.index 			 = &index;
+			term.segment_idx 	 = index.segment_offsets[term_idx];
+			term.end_segment_idx = index.segment_offsets[term_idx + 1];
+			term.weight 		 = _compute_idf(partition_id, col_idx, term_idx) * boost_factors[col_idx];
+			term.bound 			 = impact_segment_bound(term);
+			terms.push_back(term);
+
+			has_negative_weight |= (term.weight < 0.0f);
+		}
+	}
+	if (has_negative_weight) {
+		++scratch.impact_fallbacks;
+		scratch.terms_ready = true;
+		return _query_partition_pruned(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+	}
+
+	ScoreAccumulator& doc_scores = scratch.doc_scores;
+	accumulator_init(
+			doc_scores,
+			IP.num_docs,
+			expected_candidates(IP, low_df_term_idxs, high_df_term_idxs, UINT32_MAX)
+			);
+
+	float    threshold  = -FLT_MAX;
+	float    unread 	= bloom_bound;
+	uint64_t num_read   = 0;
+	uint64_t next_check = k;
+	bool     exact 		= true;
+	while (true) {
+		// Few terms. Linear scan for the highest bound.
+		int32_t best = -1;
+		unread = bloom_bound;
+		for (uint32_t i = 0; i < terms.size(); ++i) {
+			unread += terms[i].bound;
+			if (terms[i].bound > 0.0f && (best < 0 || terms[i].bound > terms[best].bound)) {
+				best = (int32_t)i;
+			}
+		}
+		if (best < 0) break;
+
+		// Amortized O(1) per posting read.
+		if (num_read >= next_check) {
+			threshold = std::max(
+					kth_largest_score(doc_scores, k, scratch.impact_scores),
+					shared_threshold_get(scratch.shared_threshold)
+					);
+			if (unread <= threshold) break;
+			next_check = num_read + std::max((uint64_t)k, accumulator_size(doc_scores));
+		}
+		if (impact_budget > 0 && num_read >= impact_budget) {
+			exact = false;
+			break;
+		}
+
+		ImpactTerm& term = terms[best];
+		const ImpactSegment& segment = term.index->segments[term.segment_idx];
+		for (uint32_t i = segment.offset; i < segment.offset + segment.num_docs; ++i) {
+			uint64_t doc_id = term.index->doc_ids[i];
+			accumulator_add(
+					doc_scores, 
+					doc_id, 
+					_compute_bm25(doc_id, (float)term.index->term_freqs[i], term.weight, partition_id)
+					);
+		}
+		num_read += segment.num_docs;
+
+		++term.segment_idx;
+		term.bound = impact_segment_bound(term);
+	}
+
+	// Seen docs which can still reach the k-th partial score, in doc order.
+	// Inclusive since the k-th doc itself has no unread bound once all
+	// segments are read.
+	threshold = std::max(threshold, kth_largest_score(doc_scores, k, scratch.impact_scores));
+
+	std::vector<std::pair<uint64_t, float>>& candidates = scratch.impact_candidates;
+	candidates.clear();
+	accumulator_for_each(doc_scores, [&](uint64_t doc_id, float& score) {
+		if (!exact || score + unread >= threshold) {
+			candidates.push_back({doc_id, score});
+		}
+	});
+	std::sort(candidates.begin(), candidates.end());
+
+	std::vector<PostingCursor>& cursors = scratch.cursors;
+	if (exact) {
+		cursors.resize(num_low_df_terms);
+
+		uint16_t cursor_idx = 0;
+		for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+			for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
+				cursor_init(
+						cursors[cursor_idx],
+						IP.II[col_idx],
+						term_idx,
+						terms[cursor_idx].weight,
+						IP.doc_norms,
+						norm_table
+						);
+				++cursor_idx;
+			}
+		}
+	}
+
+	std::vector<BM25Result>& heap = scratch.top_k_heap;
+	float local_threshold = -FLT_MAX;
+	threshold = -FLT_MAX;
+
+	for (const auto& [doc_id, partial_score] : candidates) {
+		sync_threshold(scratch, local_threshold, threshold);
 
-					BloomEntry& bloom_entry = bloom_entries[col_idx][idx];
-					float df = IP.II[col_idx].doc_freqs[term_idx];
-					float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-					for (auto& [doc_id, score] : doc_scores) {
-						for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
-							if (bloom_query(bf, doc_id)) {
-								score += _compute_bm25(
-										doc_id, 
-										(float)tf,
-										idf, 
-										partition_id
-										) * boost_factors[col_idx];
-							}
-						}
-					}
-				}
-			}
-		} else {
+		float score = partial_score;
+		if (exact) {
+			if (partial_score + unread <= threshold) continue;
 
-			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-				for (uint16_t idx = 0; idx < high_df_term_idxs[col_idx].size(); ++idx) {
-					const uint64_t& term_idx = high_df_term_idxs[col_idx][idx];
-					BloomEntry& bloom_entry  = bloom_entries[col_idx][idx];
-
-					float df = IP.II[col_idx].doc_freqs[term_idx];
-					float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-					for (auto& [doc_id, score] : doc_scores) {
-						for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
-							if (bloom_query(bf, doc_id)) {
-								score += _compute_bm25(
-										doc_id, 
-										(float)tf,
-										idf, 
-										partition_id
-										) * boost_factors[col_idx];
-							}
-						}
-					}
+			score = 0.0f;
+			for (PostingCursor& cursor : cursors) {
+				cursor_next_geq(cursor, doc_id);
+				if (cursor_doc(cursor) == doc_id) {
+					score += _compute_bm25(doc_id, (float)cursor_tf(cursor), cursor.weight, partition_id);
 				}
 			}
 		}
+		score = _score_bloom_terms(scratch, doc_id, score, threshold, local_threshold, bloom_bound, partition_id);
+
+		if (score > threshold) {
+			push_top_k(heap, k, doc_id, score, partition_id, local_threshold);
+		}
 	}
+	shared_threshold_raise(scratch.shared_threshold, local_threshold);
 
 	if (DEBUG) {
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
-		std::cout << "Number of docs: " << doc_scores.size() << "   GATHER TIME: ";
-		std::cout << elapsed_ms.count() << "ms" << std::endl;
+		std::cout << "Postings read: " << num_read << "   Candidates: " << candidates.size();
+		std::cout << "   GATHER TIME: " << elapsed_ms.count() << "ms" << std::endl;
 		fflush(stdout);
 	}
-	
-	if (doc_scores.size() == 0) {
-		return std::vector<BM25Result>();
+
+	pop_top_k(heap, doc_offset, result);
+}
+
+static float block_selectivity(const InvertedIndex& II, uint64_t term_idx, uint32_t k, std::vector<float>& block_maxes) {
+	// Share of the blocks of a term whose max score reaches its k-th largest
+	// block max. A single term query scores at least that much for k docs,
+	// so Block-Max WAND skips the other blocks. 1 for lists without blocks.
+	uint32_t begin = II.block_offsets[term_idx];
+	uint32_t end   = II.block_offsets[term_idx + 1];
+	uint32_t num_blocks = end - begin;
+	if (k == 0 || num_blocks <= k) return 1.0f;
+
+	block_maxes.clear();
+	for (uint32_t block_idx = begin; block_idx < end; ++block_idx) {
+		block_maxes.push_back(II.blocks[block_idx].max_score);
+	}
+	std::nth_element(block_maxes.begin(), block_maxes.begin() + (k - 1), block_maxes.end(), std::greater<float>());
+	float kth_max = block_maxes[k - 1];
+
+	uint32_t num_reached = 0;
+	for (float block_max : block_maxes) {
+		num_reached += (block_max >= kth_max);
 	}
+	return (float)num_reached / (float)num_blocks;
+}
 
-	start = std::chrono::high_resolution_clock::now();
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+QueryPlan _BM25::_plan_partition(
+		std::string& query,
+		uint32_t top_k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		QueryScratch& scratch
+		) {
+	// Only reads doc freqs, block selectivities and bloom entry sizes.
+	// The split terms are left in scratch for the chosen mode.
+	_tokenize_query(query, partition_id, scratch);
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
+	BM25Partition& IP = index_partitions[partition_id];
 
-	for (const auto& pair : doc_scores) {
-		BM25Result result {
-			.doc_id = pair.first,
-			.score  = pair.second,
-			.partition_id = partition_id
-		};
-		top_k_docs.push(result);
-		if (top_k_docs.size() > k) {
-			top_k_docs.pop();
+
+	PlanInputs inputs;
+	inputs.num_bloom_terms  = 0;
+	inputs.bloom_candidates = 0;
+	inputs.max_df_filtered  = false;
+
+	std::vector<uint32_t>& dfs = scratch.plan_dfs;
+	std::vector<float>& selectivities = scratch.plan_block_selectivities;
+	dfs.clear();
+	selectivities.clear();
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
+			uint32_t df = IP.II[col_idx].doc_freqs[term_idx];
+			if (df > query_max_df) {
+				inputs.max_df_filtered = true;
+				continue;
+			}
+			dfs.push_back(df);
+			selectivities.push_back(block_selectivity(IP.II[col_idx], term_idx, top_k, scratch.plan_block_maxes));
 		}
+		for (const BloomEntry* bloom_entry : bloom_entries[col_idx]) {
+			inputs.bloom_candidates = std::max(inputs.bloom_candidates, (uint64_t)bloom_entry->topk_doc_ids.size());
+		}
+		inputs.num_bloom_terms += bloom_entries[col_idx].size();
 	}
+	inputs.term_dfs  = dfs.data();
+	inputs.term_block_selectivities = selectivities.data();
+	inputs.num_terms = dfs.size();
+	inputs.num_docs  = IP.num_docs;
+	inputs.k 		 = top_k;
+	// A budget makes impact results approximate. Auto only picks exact modes.
+	inputs.impact_available = impact_index_built && (impact_budget == 0);
 
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+	return plan_query(inputs);
+}
+
+void _BM25::_query_partition_mode(
+		std::string& query, 
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
+		) {
+	scratch.mode = query_mode;
+	if (query_mode == QUERY_AUTO) {
+		scratch.mode = _plan_partition(query, k, query_max_df, partition_id, scratch).mode;
+		scratch.terms_ready = true;
+	}
+
+	switch (scratch.mode) {
+		case QUERY_STREAMING:
+			return _query_partition_streaming(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+		case QUERY_MAXSCORE:
+		case QUERY_BLOCK_MAX_WAND:
+			return _query_partition_pruned(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+		case QUERY_IMPACT:
+			return _query_partition_impact(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+		case QUERY_TAAT:
+			return _query_partition(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+		default:
+			return _query_partition_bloom(query, k, query_max_df, partition_id, boost_factors, scratch, result);
 	}
+}
 
-	return result;
+std::vector<QueryPlan> _BM25::explain(
+		std::string& query,
+		uint32_t top_k,
+		uint32_t query_max_df
+		) {
+	// Plan of each partition as QUERY_AUTO would choose it. Runs on the caller
+	// thread so it can be called while queries are running.
+	QueryScratch scratch;
+
+	std::vector<QueryPlan> plans;
+	plans.reserve(num_partitions);
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		plans.push_back(_plan_partition(query, top_k, query_max_df, partition_id, scratch));
+	}
+	return plans;
 }
 
 
-static inline uint64_t get_doc_id(
-		StandardEntry& IIE,
-		uint32_t& current_idx,
-		uint64_t& prev_doc_id
+static bool stream_init(
+		PostingStream& stream, 
+		const PostingList& list, 
+		PostingFormat format,
+		float weight
 		) {
-	uint64_t doc_id;
+	stream.list 		 = list;
+	stream.format 		 = format;
+	stream.byte_idx 	 = 0;
+	stream.prev_doc_id 	 = 0;
+	stream.num_remaining = posting_list_df(list);
+	stream.pos 			 = 0;
+	stream.num_buffered  = 0;
+	stream.rle_idx 		 = 0;
+	stream.rle_consumed  = 0;
+	stream.weight 		 = weight;
+
+	// Bloom term postings are cleared after their filters are built.
+	return list.num_doc_id_bytes > 0 && stream.num_remaining > 0;
+}
 
-	current_idx += decompress_uint64_differential_single_bytes(
-			&(IIE.doc_ids[current_idx]),
-			doc_id,
-			prev_doc_id
-			);
+static inline bool stream_next(PostingStream& stream, uint64_t& doc_id, uint8_t& tf) {
+	const PostingList& list = stream.list;
 
-	prev_doc_id = doc_id;
+	if (stream.pos == stream.num_buffered) {
+		if (stream.num_remaining == 0) return false;
 
-	return doc_id;
+		stream.num_buffered = (uint32_t)std::min((uint64_t)PACKED_BLOCK_SIZE, stream.num_remaining);
+		stream.byte_idx = decode_doc_id_block(
+				list,
+				stream.format,
+				stream.byte_idx,
+				stream.prev_doc_id,
+				stream.num_buffered,
+				stream.doc_ids
+				);
+		stream.prev_doc_id    = stream.doc_ids[stream.num_buffered - 1];
+		stream.num_remaining -= stream.num_buffered;
+		stream.pos = 0;
+	}
+	doc_id = stream.doc_ids[stream.pos++];
+
+	// Walk RLE runs in step with the doc ids.
+	tf = list.term_freqs[stream.rle_idx].value;
+	if (++stream.rle_consumed == list.term_freqs[stream.rle_idx].num_repeats) {
+		++stream.rle_idx;
+		stream.rle_consumed = 0;
+	}
+	return true;
 }
 
-static inline std::pair<uint64_t, uint16_t> pop_replace_minheap(
-		std::priority_queue<
-			std::pair<uint64_t, uint16_t>,
-			std::vector<std::pair<uint64_t, uint16_t>>,
-			_compare_64_16>& min_heap,
-		robin_hood::unordered_flat_map<uint16_t, StandardEntry*>& II_streams,
-		std::vector<uint32_t>& stream_idxs,
-		std::vector<uint64_t>& prev_doc_ids
+static inline StreamHead pop_replace_minheap(
+		std::vector<StreamHead>& min_heap,
+		std::vector<PostingStream>& streams
 		) {
+	// Pops the smallest doc id and refills the heap from the same stream.
+	std::pop_heap(min_heap.begin(), min_heap.end(), _compare_stream_head());
+	StreamHead min = min_heap.back(); min_heap.pop_back();
 
-	std::pair<uint64_t, uint16_t> min = min_heap.top(); min_heap.pop();
-	uint16_t min_idx = min.second;
-
-	uint64_t doc_id = get_doc_id(*II_streams[min_idx], stream_idxs[min_idx], prev_doc_ids[min_idx]);
-	if (stream_idxs[min_idx] < II_streams[min_idx]->doc_ids.size() - 1) {
-		min_heap.push(std::make_pair(doc_id, min_idx));
+	StreamHead next;
+	next.stream_idx = min.stream_idx;
+	if (stream_next(streams[min.stream_idx], next.doc_id, next.tf)) {
+		min_heap.push_back(next);
+		std::push_heap(min_heap.begin(), min_heap.end(), _compare_stream_head());
 	}
 
-	return std::make_pair(min.first, min_idx);
+	return min;
 }
 
 
-
-std::vector<BM25Result> _BM25::_query_partition_streaming(
+void _BM25::_query_partition_streaming(
 		std::string& query, 
 		uint32_t k,
 		uint32_t query_max_df,
 		uint16_t partition_id,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
 		) {
-	printf("NOT IMPLEMENTED\n");
-	return std::vector<BM25Result>();
+	// Document-at-a-time merge over the compressed posting streams of the
+	// low df terms. Only one posting per term is decoded at a time.
+	auto start = std::chrono::high_resolution_clock::now();
 
-	std::vector<std::vector<uint64_t>> term_idxs(search_cols.size());
+	_tokenize_query(query, partition_id, scratch);
+	result.clear();
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
 	BM25Partition& IP = index_partitions[partition_id];
 
 	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
 
-	std::string substr = "";
-	for (const char& c : query) {
-		if (c != ' ') {
-			substr += toupper(c); 
-			continue;
-		}
-
-		add_query_term(substr, term_idxs, partition_id);	
-	}
-	if (!substr.empty()) {
-		add_query_term(substr, term_idxs, partition_id);
-	}
-
-	uint32_t total_terms = 0;
-	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		total_terms += term_idxs[col_idx].size();
-	}
-	if (total_terms == 0) return std::vector<BM25Result>();
-
-	robin_hood::unordered_flat_map<uint16_t, StandardEntry*> II_streams;
-	robin_hood::unordered_flat_map<uint16_t, BloomEntry*> bloom_entries;
 
-	std::vector<uint64_t> doc_freqs(total_terms, 0);
-	std::vector<float> idfs(total_terms, 0);
-	uint32_t cntr = 0;
+	std::vector<PostingStream>& streams = scratch.streams;
+	streams.clear();
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		for (const uint64_t& term_idx : term_idxs[col_idx]) {
-			doc_freqs[cntr] = IP.II[col_idx].doc_freqs[term_idx];
-			idfs[cntr] = log((IP.num_docs - doc_freqs[cntr] + 0.5) / (doc_freqs[cntr] + 0.5));
-
-			auto it = IP.II[col_idx].bloom_filters.find(term_idx);
-			if (it != IP.II[col_idx].bloom_filters.end()) {
-				bloom_entries[cntr] = &it->second;
+		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
+			float df = IP.II[col_idx].doc_freqs[term_idx];
+			if (df == 0 || df > query_max_df) {
 				continue;
 			}
-
-			II_streams[cntr++] = &IP.II[col_idx].inverted_index_compressed[term_idx];
+			float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+			streams.emplace_back();
+			if (!stream_init(
+					streams.back(), 
+					get_posting_list(IP.II[col_idx], term_idx), 
+					IP.II[col_idx].format,
+					idf * boost_factors[col_idx]
+					)) {
+				streams.pop_back();
+			}
 		}
 	}
 
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+	if (streams.empty()) {
+		// No streams to merge. Bloom path takes candidates from bloom entry top-k docs.
+		scratch.terms_ready = true;
+		return _query_partition_bloom(query, k, query_max_df, partition_id, boost_factors, scratch, result);
+	}
+	if (k == 0) return;
 
-	// Define minheap of size total_terms to keep track of current smallest doc_id and its index
-	std::priority_queue<
-		std::pair<uint64_t, uint16_t>,
-		std::vector<std::pair<uint64_t, uint16_t>>,
-		_compare_64_16> min_heap;
+	float bloom_bound = _init_bloom_terms(scratch, partition_id, boost_factors);
 
-	std::vector<uint64_t> prev_doc_ids(total_terms, 0);
-	std::vector<uint32_t> stream_idxs(total_terms, 0);
-	std::vector<std::pair<uint16_t, uint32_t>> tf_counters(total_terms, std::make_pair(0, 0));
-	std::vector<uint32_t> tf_idxs(total_terms, 0);
+	// Min heap holding the current posting of every stream.
+	std::vector<StreamHead>& min_heap = scratch.stream_heap;
+	min_heap.clear();
 
-	// Initialize min_heap with first doc_id from each term
-	for (uint32_t i = 0; i < total_terms; ++i) {
-		if (doc_freqs[i] == 0 || doc_freqs[i] > query_max_df) {
-			continue;
+	for (uint16_t i = 0; i < streams.size(); ++i) {
+		StreamHead head;
+		head.stream_idx = i;
+		if (stream_next(streams[i], head.doc_id, head.tf)) {
+			min_heap.push_back(head);
 		}
-
-		uint64_t doc_id = get_doc_id(*II_streams[i], stream_idxs[i], prev_doc_ids[i]);
-		min_heap.push(std::make_pair(doc_id, i));
-
-		// Initialize tf_counters
-		tf_counters[i].first  = II_streams[i]->term_freqs[0].value;
-		tf_counters[i].second = II_streams[i]->term_freqs[0].num_repeats;
-		tf_idxs[i] = 1;
 	}
+	std::make_heap(min_heap.begin(), min_heap.end(), _compare_stream_head());
 
-	BM25Result current_doc;
-
-	uint64_t global_prev_doc_id = 0;
-	while (1) {
-		std::pair<uint64_t, uint16_t> doc_id_idx_pair = pop_replace_minheap(
-				min_heap, 
-				II_streams, 
-				stream_idxs, 
-				prev_doc_ids
-				);
+	// threshold is the higher of the local k-th score and the shared one.
+	std::vector<BM25Result>& heap = scratch.top_k_heap;
+	float local_threshold = -FLT_MAX;
+	float threshold 	  = -FLT_MAX;
+	uint64_t num_docs_scored = 0;
 
-		if (min_heap.size() == 0) {
-			break;
+	auto finish_doc = [&](uint64_t doc_id, float score) {
+		++num_docs_scored;
+		sync_threshold(scratch, local_threshold, threshold);
+		if (score + bloom_bound <= threshold) {
+			if (score + bloom_bound > local_threshold) ++scratch.threshold_stats.docs_skipped;
+			return;
 		}
 
-		uint64_t doc_id  = doc_id_idx_pair.first;
-		uint16_t min_idx = doc_id_idx_pair.second;
-		uint16_t col_idx = min_idx / search_cols.size();
-
-		float idf = idfs[min_idx];
-		float tf  = tf_counters[min_idx].first;
-
-		// TODO: Add handling for when StandardEntries are empty.
-
-		// Score
-		if (doc_id != global_prev_doc_id) {
-			// New doc_id.
-			// Add previous doc_id to top_k_docs
-			if (current_doc.doc_id != 0) {
-				// Score with bloom filters
-				for (const auto& [i, bloom_entry] : bloom_entries) {
-					// TODO: Fix or remove.
-					if (bloom_query(bloom_entries[i]->bloom_filters[0], current_doc.doc_id)) {
-						current_doc.score += _compute_bm25(
-								current_doc.doc_id, 
-								1.0f,
-								idfs[i], 
-								partition_id
-								) * boost_factors[i / search_cols.size()];
-					}
-				}
+		score = _score_bloom_terms(scratch, doc_id, score, threshold, local_threshold, bloom_bound, partition_id);
+		if (score > threshold) {
+			push_top_k(heap, k, doc_id, score, partition_id, local_threshold);
+		}
+	};
 
+	uint64_t current_doc_id = POSTING_END;
+	float    current_score  = 0.0f;
+	while (!min_heap.empty()) {
+		StreamHead head = pop_replace_minheap(min_heap, streams);
 
-				top_k_docs.push(current_doc);
-				if (top_k_docs.size() > k) {
-					top_k_docs.pop();
-				}
+		if (head.doc_id != current_doc_id) {
+			if (current_doc_id != POSTING_END) {
+				finish_doc(current_doc_id, current_score);
 			}
-
-			current_doc.doc_id = doc_id + doc_offset;
-			current_doc.score = _compute_bm25(doc_id, tf, idf, partition_id) * boost_factors[col_idx];
-			current_doc.partition_id = partition_id;
-		} else {
-			// Same doc_id.
-			current_doc.score += _compute_bm25(doc_id, tf, idf, partition_id) * boost_factors[col_idx];
+			current_doc_id = head.doc_id;
+			current_score  = 0.0f;
 		}
 
-		--tf_counters[min_idx].second;
-		if (tf_counters[min_idx].second == 0) {
-			// Get next RLE pair.
-			if (tf_idxs[min_idx] < doc_freqs[min_idx]) {
-				++tf_idxs[min_idx];
-				tf_counters[min_idx].first  = II_streams[min_idx]->term_freqs[tf_idxs[min_idx]].value;
-				tf_counters[min_idx].second = II_streams[min_idx]->term_freqs[tf_idxs[min_idx]].num_repeats;
-			}
-		}
+		current_score += _compute_bm25(
+				head.doc_id, 
+				(float)head.tf, 
+				streams[head.stream_idx].weight, 
+				partition_id
+				);
+	}
+	if (current_doc_id != POSTING_END) {
+		finish_doc(current_doc_id, current_score);
+	}
+	shared_threshold_raise(scratch.shared_threshold, local_threshold);
 
-		global_prev_doc_id = doc_id;
+	if (DEBUG) {
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
+		std::cout << "Number of docs: " << num_docs_scored << "   GATHER TIME: ";
+		std::cout << elapsed_ms.count() << "ms" << std::endl;
+		fflush(stdout);
 	}
 
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+	pop_top_k(heap, doc_offset, result);
+}
+
+
+// Results of one (query, partition) task. They live in the arena of the
+// worker which ran the task.
+typedef struct {
+	const BM25Result* results;
+	uint32_t num_results;
+} ResultSlot;
+
+// Per call buffers of query(), query_batch() and query_multi(), kept per
+// calling thread. Every pool worker copies its partition results into its
+// own arena, so slots are filled without a lock. Workers see their own
+// thread_local instances and must reach these through the caller.
+typedef struct {
+	ScratchArena arena;							// Slots and per query state.
+	std::vector<ScratchArena> worker_arenas;	// Indexed by worker_idx.
+} CallBuffers;
+
+static thread_local CallBuffers call_buffers;
+
+static CallBuffers& reset_call_buffers(uint16_t num_workers) {
+	CallBuffers& buffers = call_buffers;
+	arena_reset(buffers.arena);
+	buffers.worker_arenas.resize(num_workers);
+	for (ScratchArena& arena : buffers.worker_arenas) {
+		arena_reset(arena);
+	}
+	return buffers;
+}
+
+static inline void store_result_slot(
+		ScratchArena& worker_arena,
+		ResultSlot& slot,
+		const std::vector<BM25Result>& result
+		) {
+	// Sized by the results found, not by k.
+	BM25Result* results = arena_alloc<BM25Result>(worker_arena, result.size());
+	if (!result.empty()) {
+		memcpy(results, result.data(), result.size() * sizeof(BM25Result));
 	}
+	slot.results 	 = results;
+	slot.num_results = result.size();
+}
 
-	return result;
+// Results kept by merging num_slots slots.
+static uint64_t count_merged_results(const ResultSlot* slots, uint16_t num_slots, uint32_t k) {
+	uint64_t num_results = 0;
+	for (uint16_t i = 0; i < num_slots; ++i) {
+		num_results += slots[i].num_results;
+	}
+	return std::min(num_results, (uint64_t)k);
 }
 
+// Top k of num_slots slots, left in heap sorted descending by score.
+static void merge_result_slots(
+		const ResultSlot* slots,
+		uint16_t num_slots,
+		uint32_t k,
+		std::vector<BM25Result>& heap
+		) {
+	// Min heap of size k on score over all partition results.
+	heap.clear();
+	for (uint16_t i = 0; i < num_slots; ++i) {
+		for (uint32_t j = 0; j < slots[i].num_results; ++j) {
+			heap.push_back(slots[i].results[j]);
+			std::push_heap(heap.begin(), heap.end(), _compare_bm25_result());
+			if (heap.size() > k) {
+				std::pop_heap(heap.begin(), heap.end(), _compare_bm25_result());
+				heap.pop_back();
+			}
+		}
+	}
+	std::sort_heap(heap.begin(), heap.end(), _compare_bm25_result());
+}
 
 std::vector<BM25Result> _BM25::query(
 		std::string& query, 
 		uint32_t k,
 		uint32_t query_max_df,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors
+		) {
+	std::vector<BM25Result> result;
+	_BM25::query(query, k, query_max_df, boost_factors, result);
+	return result;
+}
+
+void _BM25::query(
+		std::string& query, 
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors,
+		std::vector<BM25Result>& result
 		) {
 	auto start = std::chrono::high_resolution_clock::now();
 
-	if (boost_factors.size() == 0) {
-		boost_factors.resize(search_cols.size());
-		memset(
-				&boost_factors[0],
-				1.0f,
-				search_cols.size() * sizeof(float)
-			  );
-	}
+	const std::vector<float>& boosts = _resolve_boost_factors(boost_factors);
 
-	if (boost_factors.size() != search_cols.size()) {
-		std::cout << "Error: Boost factors must be the same size as the number of search fields." << std::endl;
-		std::cout << "Number of search fields: " << search_cols.size() << std::endl;
-		std::cout << "Number of boost factors: " << boost_factors.size() << std::endl;
-		std::exit(1);
-	}
+	// Nothing is allocated once warmed up if the caller reuses result.
+	CallBuffers& buffers = reset_call_buffers(query_pool->size());
+	ResultSlot* slots = arena_alloc<ResultSlot>(buffers.arena, num_partitions);
 
-	std::vector<std::thread> threads;
-	std::vector<std::vector<BM25Result>> results(num_partitions);
+	// Partitions publish their k-th score here so the others prune below it.
+	SharedThreshold shared_threshold;
+	shared_threshold_init(shared_threshold);
 
-	// _query_partition on each thread
-	for (uint16_t i = 0; i < num_partitions; ++i) {
-		threads.push_back(std::thread(
-			[this, &query, k, query_max_df, i, &results, boost_factors] {
-				// results[i] = _query_partition(query, k, query_max_df, i, boost_factors);
-				// results[i] = _query_partition_streaming(query, k, query_max_df, i, boost_factors);
-				results[i] = _query_partition_bloom(query, k, query_max_df, i, boost_factors);
-			}
-		));
-	}
+	// _query_partition on each pool worker
+	auto task = [this, &query, k, query_max_df, &boosts, &buffers, slots, &shared_threshold](uint32_t i, uint16_t worker_idx) {
+		QueryScratch& scratch = query_scratch[worker_idx];
+		scratch.shared_threshold = &shared_threshold;
+		_query_partition_mode(query, k, query_max_df, i, boosts, scratch, scratch.partition_result);
+		scratch.shared_threshold = nullptr;
 
-	for (auto& thread : threads) {
-		thread.join();
-	}
+		store_result_slot(buffers.worker_arenas[worker_idx], slots[i], scratch.partition_result);
+	};
+	// std::ref keeps the closure out of std::function heap storage.
+	query_pool->run(num_partitions, std::ref(task));
+
+	merge_result_slots(slots, num_partitions, k, result);
+
+	if (DEBUG) {
+		uint64_t total_matching_docs = 0;
+		for (uint16_t i = 0; i < num_partitions; ++i) {
+			total_matching_docs += slots[i].num_results;
+		}
 
-	if (results.size() == 0) {
-		return std::vector<BM25Result>();
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
+		std::cout << "QUERY: " << query << std::endl;
+		std::cout << "Total matching docs: " << total_matching_docs << "    ";
+		std::cout << elapsed_ms.count() << "ms" << std::endl;
+		fflush(stdout);
 	}
 
-	uint64_t total_matching_docs = 0;
+}
+
+BM25BatchResult _BM25::query_batch(
+		std::vector<std::string>& queries,
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors
+		) {
+	auto start = std::chrono::high_resolution_clock::now();
 
-	// Join results. Keep global max heap of size k
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+	const std::vector<float>& boosts = _resolve_boost_factors(boost_factors);
 
-	for (const auto& partition_results : results) {
-		total_matching_docs += partition_results.size();
-		for (const auto& pair : partition_results) {
-			top_k_docs.push(pair);
-			if (top_k_docs.size() > k) {
-				top_k_docs.pop();
-			}
-		}
+	uint64_t num_queries = queries.size();
+
+	BM25BatchResult batch;
+	batch.offsets.resize(num_queries + 1, 0);
+	if (num_queries == 0) return batch;
+
+	// One work item per (query, partition) pair so that small batches still
+	// use all partitions and large batches keep every worker busy.
+	uint64_t num_tasks = num_queries * num_partitions;
+	CallBuffers& buffers = reset_call_buffers(query_pool->size());
+	ResultSlot* slots = arena_alloc<ResultSlot>(buffers.arena, num_tasks);
+
+	// One shared top-k threshold per query.
+	SharedThreshold* shared_thresholds = arena_alloc<SharedThreshold>(buffers.arena, num_queries);
+	for (uint64_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		new (&shared_thresholds[query_idx]) SharedThreshold;
+		shared_threshold_init(shared_thresholds[query_idx]);
 	}
-	
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+
+	auto task = [this, &queries, k, query_max_df, &boosts, &buffers, slots, shared_thresholds](uint32_t task_idx, uint16_t worker_idx) {
+		uint32_t query_idx    = task_idx / num_partitions;
+		uint16_t partition_id = task_idx % num_partitions;
+
+		QueryScratch& scratch = query_scratch[worker_idx];
+		scratch.shared_threshold = &shared_thresholds[query_idx];
+		_query_partition_mode(
+				queries[query_idx], k, query_max_df, partition_id, boosts, scratch, scratch.partition_result
+				);
+		scratch.shared_threshold = nullptr;
+
+		store_result_slot(buffers.worker_arenas[worker_idx], slots[task_idx], scratch.partition_result);
+	};
+	query_pool->run(num_tasks, std::ref(task));
+
+	// Offsets of the merged results of every query, so each is merged
+	// straight to its place.
+	for (uint64_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		batch.offsets[query_idx + 1] = batch.offsets[query_idx] + count_merged_results(
+				&slots[query_idx * num_partitions],
+				num_partitions,
+				k
+				);
 	}
+	uint64_t total_results = batch.offsets[num_queries];
+	batch.doc_ids.resize(total_results);
+	batch.scores.resize(total_results);
+	batch.partition_ids.resize(total_results);
+
+	auto merge_task = [this, k, slots, &batch](uint32_t query_idx, uint16_t worker_idx) {
+		std::vector<BM25Result>& heap = query_scratch[worker_idx].top_k_heap;
+		merge_result_slots(&slots[(uint64_t)query_idx * num_partitions], num_partitions, k, heap);
+
+		uint64_t offset = batch.offsets[query_idx];
+		for (uint64_t i = 0; i < heap.size(); ++i) {
+			batch.doc_ids[offset + i] 		= heap[i].doc_id;
+			batch.scores[offset + i] 		= heap[i].score;
+			batch.partition_ids[offset + i] = heap[i].partition_id;
+		}
+	};
+	query_pool->run(num_queries, std::ref(merge_task));
 
 	if (DEBUG) {
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
-		std::cout << "QUERY: " << query << std::endl;
-		std::cout << "Total matching docs: " << total_matching_docs << "    ";
+		std::cout << "BATCH QUERIES: " << num_queries << "    ";
+		std::cout << "Total results: " << total_results << "    ";
 		std::cout << elapsed_ms.count() << "ms" << std::endl;
 		fflush(stdout);
 	}
 
-	return result;
+	return batch;
+}
+
+ThresholdStats _BM25::get_threshold_stats() {
+	// Summed over workers. Only consistent while no query is running.
+	ThresholdStats stats = {0, 0, 0, 0};
+	for (const QueryScratch& scratch : query_scratch) {
+		stats.docs_skipped 		   += scratch.threshold_stats.docs_skipped;
+		stats.bloom_probes_skipped += scratch.threshold_stats.bloom_probes_skipped;
+		stats.candidates_skipped   += scratch.threshold_stats.candidates_skipped;
+		stats.threshold_raises 	   += scratch.threshold_stats.threshold_raises;
+	}
+	return stats;
+}
+
+void _BM25::reset_threshold_stats() {
+	for (QueryScratch& scratch : query_scratch) {
+		scratch.threshold_stats = {0, 0, 0, 0};
+	}
+}
+
+uint64_t _BM25::get_impact_fallbacks() {
+	// Summed over workers. Only consistent while no query is running.
+	uint64_t impact_fallbacks = 0;
+	for (const QueryScratch& scratch : query_scratch) {
+		impact_fallbacks += scratch.impact_fallbacks;
+	}
+	return impact_fallbacks;
+}
+
+void _BM25::reset_impact_fallbacks() {
+	for (QueryScratch& scratch : query_scratch) {
+		scratch.impact_fallbacks = 0;
+	}
 }
 
 std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_internal(
 		std::string& _query,
 		uint32_t top_k,
 		uint32_t query_max_df,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors
 		) {
 
 	std::vector<std::vector<std::pair<std::string, std::string>>> result;
@@ -2957,18 +4321,22 @@ std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_in
 	return result;
 }
 
-std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
+void _BM25::_query_partition_bloom_multi(
 		std::vector<std::string>& query,
 		uint32_t k,
 		uint32_t query_max_df,
 		uint16_t partition_id,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors,
+		QueryScratch& scratch,
+		std::vector<BM25Result>& result
 		) {
 	auto start = std::chrono::high_resolution_clock::now();
 
-	std::vector<std::vector<uint64_t>> low_df_term_idxs(search_cols.size());
-	std::vector<std::vector<uint64_t>> high_df_term_idxs(search_cols.size());
-	std::vector<std::vector<BloomEntry>> bloom_entries(search_cols.size());
+	reset_query_scratch(scratch, search_cols.size());
+	result.clear();
+	std::vector<std::vector<uint64_t>>& low_df_term_idxs  = scratch.low_df_term_idxs;
+	std::vector<std::vector<uint64_t>>& high_df_term_idxs = scratch.high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>>& bloom_entries = scratch.bloom_entries;
 
 	BM25Partition& IP = index_partitions[partition_id];
 
@@ -2976,7 +4344,8 @@ std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
 
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 		std::string& q = query[col_idx];
-		std::string substr = "";
+		std::string& substr = scratch.substr;
+		substr.clear();
 
 		for (const char& c : q) {
 			if (c != ' ') {
@@ -3011,10 +4380,15 @@ std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
 		num_low_df_terms  += low_df_term_idxs[col_idx].size();
 		num_high_df_terms += high_df_term_idxs[col_idx].size();
 	}
-	if (num_low_df_terms + num_high_df_terms == 0) return std::vector<BM25Result>();
+	if (num_low_df_terms + num_high_df_terms == 0) return;
 
 	// Score low_df terms first.
-	robin_hood::unordered_map<uint64_t, float> doc_scores;
+	ScoreAccumulator& doc_scores = scratch.doc_scores;
+	accumulator_init(
+			doc_scores,
+			IP.num_docs,
+			expected_candidates(IP, low_df_term_idxs, high_df_term_idxs, query_max_df)
+			);
 
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 		for (const uint64_t& term_idx : low_df_term_idxs[col_idx]) {
@@ -3026,117 +4400,83 @@ std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
 				continue;
 			}
 
-			float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-			IIRow row = get_II_row(&IP.II[col_idx], term_idx);
-			for (uint64_t i = 0; i < df; ++i) {
-
-				uint64_t doc_id  = row.doc_ids[i];
-				float tf 		 = row.term_freqs[i];
-				float bm25_score = _compute_bm25(doc_id, tf, idf, partition_id) * boost_factor;
-
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
-			}
+			float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+			IIRow& row = scratch.row;
+			get_II_row(&IP.II[col_idx], term_idx, row);
+			accumulate_postings(
+					doc_scores,
+					row.doc_ids.data(),
+					row.term_freqs.data(),
+					df,
+					IP.doc_norms.data(),
+					norm_table,
+					idf * boost_factor
+					);
 		}
 	}
 
 	// Now score high_df terms
 	if (num_high_df_terms > 0) {
-		if (doc_scores.size() == 0) {
+		if (accumulator_size(doc_scores) == 0 && all_bitmap_entries(bloom_entries)) {
+			_score_bitmap_union(scratch, partition_id, boost_factors);
+		} else if (accumulator_size(doc_scores) == 0) {
 			// Sort high_df_term_idxs by df.
 			// Get top-k docs for lowest df term. Then use bloom scoring for the rest.
-			std::vector<uint32_t> df_values;
 			uint32_t min_df = UINT32_MAX;
-			uint16_t min_df_col_idx;
-			uint16_t min_df_term_idx;
+			uint16_t min_df_col_idx = 0;
+			uint16_t min_df_idx 	= 0;	// Index into high_df_term_idxs[min_df_col_idx].
 
 			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-				uint16_t cntr = 0;
-				for (const uint64_t& term_idx : high_df_term_idxs[col_idx]) {
+				for (uint16_t idx = 0; idx < high_df_term_idxs[col_idx].size(); ++idx) {
+					const uint64_t& term_idx = high_df_term_idxs[col_idx][idx];
 					uint32_t df = IP.II[col_idx].doc_freqs[term_idx];
 					if (df < min_df) {
 						min_df_col_idx = col_idx;
-						min_df_term_idx = cntr++;
-						min_df = df;
+						min_df_idx 	   = idx;
+						min_df 		   = df;
 					}
-					df_values.push_back(
-								IP.II[col_idx].doc_freqs[term_idx]
-								);
 				}
 			}
 
 			// First score the term with the lowest df.
-			float idf = log((IP.num_docs - min_df + 0.5) / (min_df + 0.5));
-			BloomEntry& bloom_entry = bloom_entries[min_df_col_idx][min_df_term_idx];
+			float idf = _compute_idf(partition_id, min_df_col_idx, high_df_term_idxs[min_df_col_idx][min_df_idx]);
+			const BloomEntry& bloom_entry = *bloom_entries[min_df_col_idx][min_df_idx];
 			for (uint64_t i = 0; i < bloom_entry.topk_doc_ids.size(); ++i) {
 				uint64_t doc_id  = bloom_entry.topk_doc_ids[i];
 				float tf 		 = bloom_entry.topk_term_freqs[i];
 				float bm25_score = _compute_bm25(doc_id, tf, idf, partition_id) * boost_factors[min_df_col_idx];
 
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
+				accumulator_add(doc_scores, doc_id, bm25_score);
 			}
 
 			// Now score the rest using bloom filters.
+			gather_bloom_candidates(scratch);
 			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 				for (uint16_t idx = 0; idx < high_df_term_idxs[col_idx].size(); ++idx) {
 					const uint64_t& term_idx = high_df_term_idxs[col_idx][idx];
 
-					if (col_idx == min_df_col_idx && term_idx == min_df_term_idx) {
+					if (col_idx == min_df_col_idx && idx == min_df_idx) {
 						continue;
 					}
 
-					BloomEntry& bloom_entry = bloom_entries[col_idx][idx];
-					float df = IP.II[col_idx].doc_freqs[term_idx];
-					float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-					for (auto& [doc_id, score] : doc_scores) {
-						for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
-							if (bloom_query(bf, doc_id)) {
-								score += _compute_bm25(
-										doc_id, 
-										(float)tf,
-										idf, 
-										partition_id
-										) * boost_factors[col_idx];
-							}
-						}
-					}
+					const BloomEntry& bloom_entry = *bloom_entries[col_idx][idx];
+					float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+					_score_bloom_entry(scratch, bloom_entry, idf, boost_factors[col_idx], partition_id);
 				}
 			}
 		} else {
+			gather_bloom_candidates(scratch);
 
 			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 				for (uint16_t idx = 0; idx < high_df_term_idxs[col_idx].size(); ++idx) {
 					const uint64_t& term_idx = high_df_term_idxs[col_idx][idx];
-					BloomEntry& bloom_entry  = bloom_entries[col_idx][idx];
-
-					float df = IP.II[col_idx].doc_freqs[term_idx];
-					float idf = log((IP.num_docs - df + 0.5) / (df + 0.5));
-
-					for (auto& [doc_id, score] : doc_scores) {
-						for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
-							if (bloom_query(bf, doc_id)) {
-								score += _compute_bm25(
-										doc_id, 
-										(float)tf,
-										idf, 
-										partition_id
-										) * boost_factors[col_idx];
-							}
-						}
-					}
+					const BloomEntry& bloom_entry = *bloom_entries[col_idx][idx];
+
+					float idf = _compute_idf(partition_id, col_idx, term_idx);
+
+					_score_bloom_entry(scratch, bloom_entry, idf, boost_factors[col_idx], partition_id);
 				}
 			}
 		}
@@ -3145,42 +4485,16 @@ std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
 	if (DEBUG) {
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
-		std::cout << "Number of docs: " << doc_scores.size() << "   GATHER TIME: ";
+		std::cout << "Number of docs: " << accumulator_size(doc_scores) << "   GATHER TIME: ";
 		std::cout << elapsed_ms.count() << "ms" << std::endl;
 		fflush(stdout);
 	}
 	
-	if (doc_scores.size() == 0) {
-		return std::vector<BM25Result>();
-	}
-
-	start = std::chrono::high_resolution_clock::now();
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
-
-	for (const auto& pair : doc_scores) {
-		BM25Result result {
-			.doc_id = pair.first,
-			.score  = pair.second,
-			.partition_id = partition_id
-		};
-		top_k_docs.push(result);
-		if (top_k_docs.size() > k) {
-			top_k_docs.pop();
-		}
-	}
-
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+	if (accumulator_size(doc_scores) == 0) {
+		return;
 	}
 
-	return result;
+	get_topk_doc_scores(doc_scores, k, partition_id, doc_offset, scratch.top_k_heap, result);
 }
 
 
@@ -3188,73 +4502,32 @@ std::vector<BM25Result> _BM25::query_multi(
 		std::vector<std::string>& query,
 		uint32_t k,
 		uint32_t query_max_df,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors
 		) {
 	auto start = std::chrono::high_resolution_clock::now();
 
-	if (boost_factors.size() == 0) {
-		boost_factors.resize(search_cols.size());
-		memset(
-				&boost_factors[0],
-				1.0f,
-				search_cols.size() * sizeof(float)
-			  );
-	}
-
-	if (boost_factors.size() != search_cols.size()) {
-		std::cout << "Error: Boost factors must be the same size as the number of search fields." << std::endl;
-		std::cout << "Number of search fields: " << search_cols.size() << std::endl;
-		std::cout << "Number of boost factors: " << boost_factors.size() << std::endl;
-		std::exit(1);
-	}
-
-	std::vector<std::thread> threads;
-	std::vector<std::vector<BM25Result>> results(num_partitions);
-
-	// _query_partition on each thread
-	for (uint16_t i = 0; i < num_partitions; ++i) {
-		threads.push_back(std::thread(
-			[this, &query, k, query_max_df, i, &results, boost_factors] {
-				results[i] = _query_partition_bloom_multi(query, k, query_max_df, i, boost_factors);
-			}
-		));
-	}
-
-	for (auto& thread : threads) {
-		thread.join();
-	}
+	const std::vector<float>& boosts = _resolve_boost_factors(boost_factors);
 
-	if (results.size() == 0) {
-		return std::vector<BM25Result>();
-	}
+	CallBuffers& buffers = reset_call_buffers(query_pool->size());
+	ResultSlot* slots = arena_alloc<ResultSlot>(buffers.arena, num_partitions);
 
-	uint64_t total_matching_docs = 0;
+	// _query_partition on each pool worker
+	auto task = [this, &query, k, query_max_df, &boosts, &buffers, slots](uint32_t i, uint16_t worker_idx) {
+		QueryScratch& scratch = query_scratch[worker_idx];
+		_query_partition_bloom_multi(query, k, query_max_df, i, boosts, scratch, scratch.partition_result);
+		store_result_slot(buffers.worker_arenas[worker_idx], slots[i], scratch.partition_result);
+	};
+	query_pool->run(num_partitions, std::ref(task));
 
-	// Join results. Keep global max heap of size k
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+	std::vector<BM25Result> result;
+	merge_result_slots(slots, num_partitions, k, result);
 
-	for (const auto& partition_results : results) {
-		total_matching_docs += partition_results.size();
-		for (const auto& pair : partition_results) {
-			top_k_docs.push(pair);
-			if (top_k_docs.size() > k) {
-				top_k_docs.pop();
-			}
+	if (DEBUG) {
+		uint64_t total_matching_docs = 0;
+		for (uint16_t i = 0; i < num_partitions; ++i) {
+			total_matching_docs += slots[i].num_results;
 		}
-	}
-	
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
-	}
 
-	if (DEBUG) {
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
 		for (const auto& q : query) {
@@ -3274,7 +4547,7 @@ std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_in
 		std::vector<std::string>& _query,
 		uint32_t top_k,
 		uint32_t query_max_df,
-		std::vector<float> boost_factors
+		const std::vector<float>& boost_factors
 		) {
 
 	std::vector<std::vector<std::pair<std::string, std::string>>> result;
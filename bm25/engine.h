@@ -1,19 +1,42 @@
 #pragma once
 
+#include <sys/mman.h>
+
 #include <iostream>
 #include <vector>
 #include <string>
 #include <cstdint>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <cfloat>
+#include <algorithm>
 
 #include "robin_hood.h"
 #include "bloom.h"
+#include "xor_filter.h"
+#include "bitmap.h"
+#include "norms.h"
+#include "thread_pool.h"
+#include "accumulator.h"
+#include "vbyte_encoding.h"
+#include "tokenizer.h"
+#include "term_dictionary.h"
 
 
 #define DEBUG 0
 
 #define SEED 42
 
+// Start of metadata.bin. The version is bumped whenever the saved layout changes.
+#define INDEX_FORMAT_MAGIC "BLOOM25I"
+#define INDEX_FORMAT_MAGIC_BYTES 8
+#define INDEX_FORMAT_VERSION 1
+
+// Postings per block of block-max skip data.
+#define POSTING_BLOCK_SIZE 128
+#define POSTING_END UINT64_MAX
+
 
 enum SupportedFileTypes {
 	CSV,
@@ -21,6 +44,49 @@ enum SupportedFileTypes {
 	IN_MEMORY
 };
 
+enum PostingFormat {
+	// Differential vbyte. Decoded one byte at a time.
+	POSTINGS_VBYTE,
+	// Bit packed blocks of PACKED_BLOCK_SIZE doc ids. See vbyte_encoding.h.
+	POSTINGS_BLOCK_PACKED
+};
+
+enum PostingBuild {
+	// Postings are appended to their lists as docs are read.
+	BUILD_APPEND,
+	// Docs are read twice. The first pass counts the size of every list,
+	// the second fills lists allocated once at their exact size.
+	BUILD_TWO_PASS
+};
+
+// Pass of a partition being read. See _BM25::read_partition.
+enum BuildPass {
+	PASS_APPEND,
+	PASS_COUNT,
+	PASS_FILL
+};
+
+enum QueryMode {
+	// Score every posting of low df terms. Probe bloom filters of high df terms.
+	QUERY_BLOOM,
+	// Exact top-k of postings, as _query_partition. Merges compressed postings document-at-a-time.
+	QUERY_STREAMING,
+	// Document-at-a-time with dynamic pruning. Exact top-k over low df terms.
+	QUERY_MAXSCORE,
+	QUERY_BLOCK_MAX_WAND,
+	// Score-at-a-time over impact ordered postings. Exact top-k unless
+	// impact_budget is set. See _query_partition_impact.
+	QUERY_IMPACT,
+	// Term-at-a-time over low df terms only. Runs QUERY_BLOOM when the query has high df terms.
+	QUERY_TAAT,
+	// Planner picks one of the modes above per partition. See plan_query.
+	QUERY_AUTO
+};
+
+// Modes the planner chooses between. All modes before QUERY_AUTO.
+#define NUM_QUERY_STRATEGIES 6
+static_assert(QUERY_AUTO == NUM_QUERY_STRATEGIES, "Strategies must precede QUERY_AUTO.");
+
 
 struct _compare {
 	inline bool operator()(const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
@@ -34,11 +100,6 @@ struct _compare_64 {
 	}
 };
 
-struct _compare_64_16 {
-	inline bool operator()(const std::pair<uint64_t, uint16_t>& a, const std::pair<uint64_t, uint16_t>& b) {
-		return a.second > b.second;
-	}
-};
 
 
 
@@ -79,36 +140,464 @@ typedef struct BloomEntry {
 	robin_hood::unordered_flat_map<uint16_t, BloomFilter> bloom_filters;
 	std::vector<uint64_t> topk_doc_ids;
 	std::vector<float> topk_term_freqs;
+
+	// Used instead of bloom_filters when built with BLOOM_XOR_TF.
+	XorFilter tf_filter = {0, 0, 0, nullptr};
+
+	// Exact postings used instead of any filter when no larger than them.
+	std::shared_ptr<const BitmapEntry> bitmap;
 } BloomEntry;
 
 BloomEntry init_bloom_entry(
 		double fpr, 
-		robin_hood::unordered_flat_map<uint16_t, uint64_t>& tf_map 
+		robin_hood::unordered_flat_map<uint16_t, uint64_t>& tf_map,
+		BloomFilterType type
 		);
+// Only for entries built by write_bloom_filters. Filters of a loaded
+// index point into its mapping.
+void free_bloom_entry(BloomEntry& bloom_entry);
 
+// Postings of one term while docs are appended. Moved into the posting
+// arena once the partition is read. See _BM25::seal_postings.
 typedef struct {
 	std::vector<uint8_t> doc_ids;
 	std::vector<RLEElement_u8> term_freqs;
 } StandardEntry;
 
+// Lists with at most this many doc id bytes and tf runs are stored in their
+// PostingEntry instead of the arena. Holds nearly every list of df <= 2.
+#define POSTING_INLINE_BYTES 8
+#define POSTING_INLINE_RUNS  2
+
+// Posting list of one term. Doc id bytes followed by tf runs.
+typedef struct {
+	union {
+		uint64_t offset;	// Into InvertedIndex::posting_bytes. Aligned for RLEElement_u8.
+		uint8_t  inline_doc_ids[POSTING_INLINE_BYTES];
+	};
+	RLEElement_u8 inline_term_freqs[POSTING_INLINE_RUNS];
+	uint32_t num_doc_id_bytes;
+	uint32_t num_runs;
+} PostingEntry;
+
+// Read only view of a posting list. Valid while its InvertedIndex is not modified.
+typedef struct {
+	const uint8_t* 		 doc_ids;
+	const RLEElement_u8* term_freqs;
+	uint32_t num_doc_id_bytes;
+	uint32_t num_runs;
+} PostingList;
+
+inline bool posting_is_inline(uint64_t num_doc_id_bytes, uint64_t num_runs) {
+	return num_doc_id_bytes <= POSTING_INLINE_BYTES && num_runs <= POSTING_INLINE_RUNS;
+}
+
+// Offset of the runs of an arena list. Doc id bytes are padded so the runs are aligned.
+inline uint64_t posting_runs_offset(uint64_t num_doc_id_bytes) {
+	const uint64_t align = alignof(RLEElement_u8);
+	return (num_doc_id_bytes + align - 1) / align * align;
+}
+
+// Arena bytes taken by a list.
+inline uint64_t posting_arena_size(uint64_t num_doc_id_bytes, uint64_t num_runs) {
+	if (posting_is_inline(num_doc_id_bytes, num_runs)) return 0;
+	return posting_runs_offset(num_doc_id_bytes) + num_runs * sizeof(RLEElement_u8);
+}
+
+// Skip data for one block of POSTING_BLOCK_SIZE postings of a PostingList.
+typedef struct {
+	uint64_t prev_doc_id;	// Delta base of first posting.
+	uint64_t last_doc_id;
+	uint32_t byte_offset;	// Into PostingList::doc_ids.
+	uint32_t rle_idx;		// Into PostingList::term_freqs.
+	uint16_t rle_offset;	// Repeats of term_freqs[rle_idx] belonging to earlier blocks.
+	uint16_t num_docs;
+	float    max_score;		// Max of tf / (tf + norm_table[doc_norm]).
+} PostingBlock;
+
+// Quantized tf norm of a posting, floor(tf / (tf + norm_table[doc_norm]) * IMPACT_LEVELS).
+#define IMPACT_LEVELS 256
+
+// Postings of a term sharing one impact.
+typedef struct {
+	uint32_t offset;	// Into ImpactIndex::doc_ids and term_freqs.
+	uint32_t num_docs;
+	uint8_t  impact;
+} ImpactSegment;
+
+// Postings reordered by decreasing impact. Doc ids ascend within a segment.
+// Segments of term t are [segment_offsets[t], segment_offsets[t + 1]).
+typedef struct {
+	std::vector<ImpactSegment> segments;
+	std::vector<uint32_t> segment_offsets;
+	std::vector<uint32_t> doc_ids;
+	std::vector<uint8_t>  term_freqs;
+} ImpactIndex;
+
+inline uint8_t quantize_impact(float tf_norm) {
+	return (uint8_t)std::min((float)(IMPACT_LEVELS - 1), tf_norm * IMPACT_LEVELS);
+}
+
+// Size of a posting list counted by the first pass of BUILD_TWO_PASS.
+typedef struct {
+	uint64_t num_bytes;		// Of StandardEntry::doc_ids.
+	uint32_t num_runs;		// Of StandardEntry::term_freqs.
+	uint16_t run_length;	// Of the last run.
+	uint8_t  last_tf;
+} PostingSize;
+
 typedef struct {
 	std::vector<uint64_t> prev_doc_ids;
 	std::vector<uint32_t> doc_freqs;
-	std::vector<StandardEntry> inverted_index_compressed;
+	std::vector<uint32_t> global_doc_freqs;		// df over all partitions. Indexed like doc_freqs.
+
+	// List of term t is postings[t]. Lists which are not inline are stored
+	// back to back in posting_bytes, one arena per column.
+	std::vector<PostingEntry> postings;
+	std::vector<uint8_t> 	  posting_bytes;
+
+	// Only while a partition is read. See BuildPass.
+	std::vector<StandardEntry> appended_postings;	// PASS_APPEND.
+	std::vector<PostingSize>   posting_sizes;		// PASS_COUNT, then fill positions during PASS_FILL.
+
+	// Not modified once built. Queries hold pointers to its entries.
 	robin_hood::unordered_flat_map<uint64_t, BloomEntry> bloom_filters;
+
+	// Encoding of doc ids of every list.
+	PostingFormat format = POSTINGS_VBYTE;
+
+	// Blocks of term t are [block_offsets[t], block_offsets[t + 1]).
+	// Lists with at most POSTING_BLOCK_SIZE postings have none.
+	std::vector<PostingBlock> blocks;
+	std::vector<uint32_t> block_offsets;
+
+	// Only built for QUERY_IMPACT. See _BM25::build_impact_index.
+	// An uncompressed copy of the postings, 5 bytes per posting plus
+	// 12 bytes per distinct impact of a term.
+	ImpactIndex impacts;
 } InvertedIndex;
 
-inline IIRow get_II_row(InvertedIndex* II, uint64_t term_idx);
+inline PostingList get_posting_list(const InvertedIndex& II, uint64_t term_idx) {
+	const PostingEntry& entry = II.postings[term_idx];
+
+	PostingList list;
+	list.num_doc_id_bytes = entry.num_doc_id_bytes;
+	list.num_runs 		  = entry.num_runs;
+	if (posting_is_inline(entry.num_doc_id_bytes, entry.num_runs)) {
+		list.doc_ids 	= entry.inline_doc_ids;
+		list.term_freqs = entry.inline_term_freqs;
+	} else {
+		list.doc_ids 	= II.posting_bytes.data() + entry.offset;
+		list.term_freqs = (const RLEElement_u8*)(list.doc_ids + posting_runs_offset(entry.num_doc_id_bytes));
+	}
+	return list;
+}
+
+inline uint64_t posting_list_df(const PostingList& list) {
+	uint64_t df = 0;
+	for (uint32_t i = 0; i < list.num_runs; ++i) {
+		df += list.term_freqs[i].num_repeats;
+	}
+	return df;
+}
+
+// Appends the list of the next term id. Inline if it fits, else at the end of the arena.
+void append_posting_list(
+		InvertedIndex& II,
+		const uint8_t* doc_ids,
+		uint64_t num_doc_id_bytes,
+		const RLEElement_u8* term_freqs,
+		uint64_t num_runs
+		);
+
+// Sizes the arena for lists of the counted sizes, to be filled in place.
+// Fill positions are left zeroed in II.posting_sizes.
+void layout_posting_lists(InvertedIndex& II);
+
+// Copies live lists into an arena of exact size, re-encoding doc ids to format.
+void pack_posting_lists(InvertedIndex& II, PostingFormat format);
+
+// Decodes the postings of term_idx into row. Reuses the buffers of row.
+inline void get_II_row(InvertedIndex* II, uint64_t term_idx, IIRow& row);
+
+// Packed blocks line up with skip data blocks so a skip lands on a block header.
+static_assert(POSTING_BLOCK_SIZE == PACKED_BLOCK_SIZE, "Posting and packed block sizes must match.");
+
+// Decodes num_docs absolute doc ids starting at byte_offset. num_docs must be
+// PACKED_BLOCK_SIZE unless the block is the last of the list.
+// Returns the byte offset following the decoded docs.
+uint32_t decode_doc_id_block(
+		const PostingList& list,
+		PostingFormat format,
+		uint32_t byte_offset,
+		uint64_t prev_doc_id,
+		uint32_t num_docs,
+		uint64_t* doc_ids
+		);
+
+// length_norm is k1 * (1 - b + b * doc_size / avg_doc_size). See init_norm_table.
+inline float bm25_tf_norm(float tf, float length_norm) {
+	return tf / (tf + length_norm);
+}
+
+void build_posting_blocks(
+		InvertedIndex& II,
+		const std::vector<uint8_t>& doc_norms,
+		const float* norm_table
+		);
+
+// Fills II.impacts from the doc ordered postings. Bloom terms have none.
+void build_impact_postings(
+		InvertedIndex& II,
+		const std::vector<uint8_t>& doc_norms,
+		const float* norm_table
+		);
+
+// Iterates a PostingList one decoded block at a time.
+typedef struct {
+	PostingList list;
+	const PostingBlock*  blocks;	// nullptr for short lists. See single_block.
+	uint32_t num_blocks;
+	PostingFormat format;
+
+	uint32_t block_idx;		// Decoded block.
+	uint32_t shallow_idx;	// Block used for block-max bounds. Never behind block_idx.
+	uint32_t pos;
+	uint32_t block_size;
+
+	uint64_t doc_ids[POSTING_BLOCK_SIZE];
+	uint8_t  term_freqs[POSTING_BLOCK_SIZE];
+
+	PostingBlock single_block;
+
+	float    weight;		// idf * boost factor.
+	float    max_score;		// Upper bound of any score of this term.
+	uint16_t col_idx;
+} PostingCursor;
+
+void cursor_init(
+		PostingCursor& cursor,
+		const InvertedIndex& II,
+		uint64_t term_idx,
+		float weight,
+		const std::vector<uint8_t>& doc_norms,
+		const float* norm_table
+		);
+void cursor_next(PostingCursor& cursor);
+void cursor_next_geq(PostingCursor& cursor, uint64_t target);
+
+// Block which would contain target without decoding it.
+// Target must not be less than a previous target.
+const PostingBlock* cursor_shallow_block(PostingCursor& cursor, uint64_t target);
+
+inline uint64_t cursor_doc(const PostingCursor& cursor) {
+	return (cursor.pos < cursor.block_size) ? cursor.doc_ids[cursor.pos] : POSTING_END;
+}
+
+inline uint8_t cursor_tf(const PostingCursor& cursor) {
+	return cursor.term_freqs[cursor.pos];
+}
+
+// Sequential decoder over one PostingList. Doc ids are decoded one
+// block at a time into a fixed buffer.
+typedef struct {
+	PostingList list;
+	PostingFormat format;
+	uint32_t byte_idx;
+	uint64_t prev_doc_id;
+	uint64_t num_remaining;	// Postings not yet buffered.
+	uint32_t pos;
+	uint32_t num_buffered;
+	uint32_t rle_idx;
+	uint16_t rle_consumed;	// Repeats of term_freqs[rle_idx] already decoded.
+	float    weight;		// idf * boost factor.
+
+	uint64_t doc_ids[PACKED_BLOCK_SIZE];
+} PostingStream;
+
+// Current posting of a stream during a document-at-a-time merge.
+typedef struct {
+	uint64_t doc_id;
+	uint16_t stream_idx;
+	uint8_t  tf;
+} StreamHead;
+
+struct _compare_stream_head {
+	inline bool operator()(const StreamHead& a, const StreamHead& b) {
+		return a.doc_id > b.doc_id;
+	}
+};
+
+// Next unread impact segment of a term during score-at-a-time evaluation.
+typedef struct {
+	const ImpactIndex* index;
+	uint32_t segment_idx;
+	uint32_t end_segment_idx;
+	float    weight;		// idf * boost factor.
+	float    bound;			// Upper bound of any score in segment_idx. 0 once exhausted.
+} ImpactTerm;
+
+// A standard or blocked bloom filter of a term and the tf it holds.
+typedef struct {
+	const BloomFilter* filter;
+	uint16_t tf;
+} BloomTfFilter;
+
+// High df term scored by probing its bloom filters.
+typedef struct {
+	const BloomEntry* entry;
+	float    weight;
+	float    max_score;
+	uint16_t col_idx;
+	uint32_t filters_begin;		// Range of QueryScratch::bloom_tf_filters, largest tf first.
+	uint32_t filters_end;
+} BloomTerm;
+
+// k-th best score published by the partitions of one query. Scores use
+// global term statistics, so a doc scoring at most this in any partition
+// cannot enter the merged top-k.
+typedef struct {
+	std::atomic<float> value;
+} SharedThreshold;
+
+inline void shared_threshold_init(SharedThreshold& threshold) {
+	threshold.value.store(-FLT_MAX, std::memory_order_relaxed);
+}
+
+inline float shared_threshold_get(const SharedThreshold* threshold) {
+	if (threshold == nullptr) return -FLT_MAX;
+	return threshold->value.load(std::memory_order_relaxed);
+}
+
+inline void shared_threshold_raise(SharedThreshold* threshold, float score) {
+	if (threshold == nullptr) return;
+	float current = threshold->value.load(std::memory_order_relaxed);
+	while (score > current && !threshold->value.compare_exchange_weak(current, score, std::memory_order_relaxed));
+}
+
+// Work skipped because another partition had raised the shared threshold
+// above the local one.
+typedef struct {
+	uint64_t docs_skipped;			// Docs dropped before being fully scored.
+	uint64_t bloom_probes_skipped;	// Bloom terms not probed for a doc.
+	uint64_t candidates_skipped;	// Bloom path candidates not probed at all.
+	uint64_t threshold_raises;		// Times a shared threshold was adopted.
+} ThresholdStats;
+
+// What the planner knows about the query terms of one partition.
+typedef struct {
+	const uint32_t* term_dfs;		// Low df terms within query_max_df.
+	const float*    term_block_selectivities;	// See _BM25::_plan_partition.
+	uint32_t num_terms;
+	uint32_t num_bloom_terms;
+	uint64_t bloom_candidates;		// Top-k docs of bloom entries. Candidates when num_terms is 0.
+	uint64_t num_docs;
+	uint32_t k;
+	bool     max_df_filtered;		// query_max_df dropped a low df term.
+	bool     impact_available;
+} PlanInputs;
+
+// Chosen strategy for one partition. Costs are in units of one posting
+// scored by QUERY_BLOOM.
+typedef struct {
+	QueryMode mode;
+	float     cost;
+	float     costs[NUM_QUERY_STRATEGIES];	// FLT_MAX where a mode is not eligible.
+	uint64_t  num_postings;
+	uint64_t  num_candidates;				// Estimated docs matching any low df term.
+	uint32_t  num_terms;
+	uint32_t  num_bloom_terms;
+	float     block_selectivity;			// Share of blocks Block-Max WAND is expected to decode.
+} QueryPlan;
+
+QueryPlan plan_query(const PlanInputs& inputs);
+
+// Per-worker buffers reused across queries so the hot path does not
+// reallocate them for every (query, partition) pair.
+typedef struct {
+	std::vector<std::vector<uint64_t>> low_df_term_idxs;
+	std::vector<std::vector<uint64_t>> high_df_term_idxs;
+	std::vector<std::vector<const BloomEntry*>> bloom_entries;	// Point into the index.
+	ScoreAccumulator doc_scores;
+	std::vector<BM25Result> top_k_heap;
+	std::vector<BM25Result> partition_result;	// Copied to the caller's result slot.
+	std::string substr;
+	IIRow row;
+
+	// Document-at-a-time state.
+	std::vector<PostingStream>  streams;
+	std::vector<StreamHead>     stream_heap;
+	std::vector<PostingCursor>  cursors;
+	std::vector<PostingCursor*> ordered_cursors;
+	std::vector<float>          cursor_bounds;
+	std::vector<BloomTerm>      bloom_terms;
+	std::vector<BloomTfFilter>  bloom_tf_filters;
+
+	// Candidates of the bloom path probed with bloom_query_batch.
+	std::vector<uint64_t> bloom_keys;
+	std::vector<float*>   bloom_scores;
+	std::vector<uint8_t>  bloom_hits;
+	std::vector<uint64_t> bitmap_words;
+
+	// Document-at-a-time candidates waiting for their bloom terms.
+	// Probed BLOOM_BATCH_SIZE at a time by _score_bloom_batch.
+	std::vector<uint64_t> batch_doc_ids;
+	std::vector<float>    batch_scores;
+	std::vector<uint16_t> batch_tfs;
+	std::vector<uint32_t> batch_pending;	// Indices not yet hit by a tf filter.
+	std::vector<uint64_t> batch_keys;
+
+	// Score-at-a-time state.
+	std::vector<ImpactTerm> impact_terms;
+	std::vector<float>      impact_scores;
+	std::vector<std::pair<uint64_t, float>> impact_candidates;
+
+	// Mode run by the current partition. Chosen by the planner under QUERY_AUTO.
+	QueryMode mode = QUERY_BLOOM;
+	std::vector<uint32_t> plan_dfs;
+	std::vector<float>    plan_block_selectivities;
+	std::vector<float>    plan_block_maxes;
+
+	// Set when the terms of the query are already split for this partition,
+	// by the planner or by a mode handing the query to another.
+	// The next _tokenize_query keeps them.
+	bool terms_ready = false;
+
+	// Set only while the worker runs a partition of a query.
+	SharedThreshold* shared_threshold = nullptr;
+	ThresholdStats threshold_stats = {0, 0, 0, 0};
+
+	// Impact mode partitions run as QUERY_BLOCK_MAX_WAND instead
+	// because a term had a negative weight.
+	uint64_t impact_fallbacks = 0;
+} QueryScratch;
+
+void reset_query_scratch(QueryScratch& scratch, uint16_t num_cols, bool keep_terms = false);
+
+// Results of a batch of queries stored back to back.
+// Results of query i are in [offsets[i], offsets[i + 1]).
+typedef struct {
+	std::vector<uint64_t> doc_ids;
+	std::vector<float>    scores;
+	std::vector<uint16_t> partition_ids;
+	std::vector<uint64_t> offsets;
+} BM25BatchResult;
 
 typedef struct {
 	std::vector<InvertedIndex> II;
-	std::vector<robin_hood::unordered_flat_map<std::string, uint32_t>> unique_term_mapping;
-	std::vector<uint16_t> doc_sizes;
+	std::vector<TermDictionary> unique_term_mapping;
+	std::vector<uint16_t> doc_sizes;	// Only while indexing. Encoded into doc_norms.
+	std::vector<uint8_t>  doc_norms;
 	std::vector<uint64_t> line_offsets;
 
 	uint64_t num_docs;
 	float    avg_doc_size;
 
+	BuildPass build_pass = PASS_APPEND;
+
+	// Read only file mappings backing the bloom filter bits of a loaded index.
+	std::vector<std::pair<uint8_t*, size_t>> bloom_mappings;
+
 	// Debug reverse term mapping
 	std::vector<robin_hood::unordered_flat_map<uint32_t, std::string>> reverse_term_mapping;
 } BM25Partition;
@@ -120,6 +609,8 @@ class _BM25 {
 		robin_hood::unordered_flat_set<std::string> stop_words;
 
 		uint64_t num_docs;
+		float    avg_doc_size;		// Over all partitions. Used for scoring.
+		float    norm_table[NORM_TABLE_SIZE];
 		float    bloom_df_threshold;
 		double   bloom_fpr;
 		float    k1;
@@ -138,6 +629,23 @@ class _BM25 {
 
 		std::vector<FILE*> reference_file_handles;
 
+		// Long-lived workers which execute per-partition query tasks.
+		std::unique_ptr<ThreadPool> query_pool;
+		std::vector<QueryScratch> query_scratch;
+
+		QueryMode query_mode = QUERY_BLOOM;
+		PostingFormat posting_format = POSTINGS_VBYTE;
+		BloomFilterType bloom_filter_type = BLOOM_STANDARD;
+		PostingBuild posting_build = BUILD_APPEND;
+
+		// Boost of 1 for every search column. Used when a query passes none.
+		std::vector<float> unit_boost_factors;
+
+		// Postings read per partition by QUERY_IMPACT before it returns
+		// approximate scores. 0 reads until the top-k is exact.
+		uint64_t impact_budget = 0;
+		bool     impact_index_built = false;
+
 		std::vector<std::string> progress_bars;
 		std::mutex progress_mutex;
 		int init_cursor_row;
@@ -152,7 +660,10 @@ class _BM25 {
 				float  k1,
 				float  b,
 				uint16_t num_partitions,
-				const std::vector<std::string>& _stop_words = {}
+				const std::vector<std::string>& _stop_words = {},
+				PostingFormat posting_format = POSTINGS_VBYTE,
+				BloomFilterType bloom_filter_type = BLOOM_STANDARD,
+				PostingBuild posting_build = BUILD_APPEND
 				);
 
 		_BM25(std::string db_dir) {
@@ -183,6 +694,8 @@ class _BM25 {
 				exit(1);
 			}
 
+			init_query_pool(num_partitions, false);
+
 			if (file_type == IN_MEMORY) {
 				return;
 			}
@@ -204,17 +717,34 @@ class _BM25 {
 				float  k1,
 				float  b,
 				uint16_t num_partitions,
-				const std::vector<std::string>& _stop_words = {}
+				const std::vector<std::string>& _stop_words = {},
+				PostingFormat posting_format = POSTINGS_VBYTE,
+				BloomFilterType bloom_filter_type = BLOOM_STANDARD,
+				PostingBuild posting_build = BUILD_APPEND
 				);
 
 		~_BM25() {
-			for (uint16_t i = 0; i < num_partitions; i++) {
-				if (reference_file_handles[i] != nullptr) {
-					fclose(reference_file_handles[i]);
+			// No handles are opened for in memory indexes.
+			for (FILE* f : reference_file_handles) {
+				if (f != nullptr) {
+					fclose(f);
+				}
+			}
+			for (BM25Partition& IP : index_partitions) {
+				if (IP.bloom_mappings.empty()) {
+					for (InvertedIndex& II : IP.II) {
+						for (auto& [term_idx, bloom_entry] : II.bloom_filters) {
+							free_bloom_entry(bloom_entry);
+						}
+					}
+				}
+				for (const auto& [mapping, mapping_size] : IP.bloom_mappings) {
+					munmap(mapping, mapping_size);
 				}
 			}
 		}
 		void init_terminal();
+		void init_query_pool(uint16_t num_threads, bool pin_threads);
 		void proccess_csv_header();
 
 		void save_index_partition(std::string db_dir, uint16_t partition_id);
@@ -222,37 +752,30 @@ class _BM25 {
 		void save_to_disk(const std::string& db_dir);
 		void load_from_disk(const std::string& db_dir);
 
-		uint32_t process_doc_partition(
-				const char* doc,
-				const char terminator,
+		template <FieldFormat FORMAT, char TERMINATOR>
+		uint64_t process_doc_partition(
+				const char* field,
+				const char* end,
 				uint64_t doc_id,
 				uint32_t& unique_terms_found,
 				uint16_t partition_id,
 				uint16_t col_idx
 				);
-		uint32_t process_doc_partition_rfc_4180(
-				const char* doc,
-				const char terminator,
-				uint64_t doc_id,
-				uint32_t& unique_terms_found,
-				uint16_t partition_id,
-				uint16_t col_idx
-				);
-		void process_doc_partition_rfc_4180_mmap(
-				const char* file_data,
-				const char terminator,
-				uint64_t doc_id,
-				uint32_t& unique_terms_found,
-				uint16_t partition_id,
-				uint16_t col_idx,
-				uint64_t& byte_offset
-				);
+
+		template <typename Read>
+		void read_partition(uint16_t partition_id, Read&& read);
+		void reserve_postings(uint16_t partition_id);
+		void seal_postings(uint16_t partition_id);
 
 		void determine_partition_boundaries_csv();
 		void determine_partition_boundaries_csv_rfc_4180();
 		void determine_partition_boundaries_json();
 
 		void write_bloom_filters(uint16_t partition_id);
+		void encode_postings(uint16_t partition_id);
+		void build_block_max_index(uint16_t partition_id);
+		void compute_global_stats();
+		void build_impact_index();
 		void read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition_id);
 		void read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t partition_id);
 		void read_csv_rfc_4180_mmap(uint64_t start_byte, uint64_t end_byte, uint16_t partition_id);
@@ -279,81 +802,190 @@ class _BM25 {
 				uint16_t partition_id
 				);
 
-		void add_query_term(
-				std::string& substr,
-				std::vector<std::vector<uint64_t>>& term_idxs,
-				uint16_t partition_id
+		float _compute_idf(
+				uint16_t partition_id,
+				uint16_t col_idx,
+				uint64_t term_idx
 				);
+
+		const std::vector<float>& _resolve_boost_factors(const std::vector<float>& boost_factors);
+
 		void add_query_term_bloom(
 				std::string& substr,
 				std::vector<std::vector<uint64_t>>& low_df_term_idxs,
 				std::vector<std::vector<uint64_t>>& high_df_term_idxs,
-				std::vector<std::vector<BloomEntry>>& bloom_entries,
+				std::vector<std::vector<const BloomEntry*>>& bloom_entries,
 				uint16_t partition_id
 				);
 		void add_query_term_bloom(
 				std::string& substr,
 				std::vector<std::vector<uint64_t>>& low_df_term_idxs,
 				std::vector<std::vector<uint64_t>>& high_df_term_idxs,
-				std::vector<std::vector<BloomEntry>>& bloom_entries,
+				std::vector<std::vector<const BloomEntry*>>& bloom_entries,
 				uint16_t partition_id,
 				uint16_t col_idx
 				);
-		std::vector<BM25Result> _query_partition(
+		void _tokenize_query(
+				std::string& query,
+				uint16_t partition_id,
+				QueryScratch& scratch
+				);
+		void _query_partition(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
+				);
+		void _query_partition_bloom(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
+				);
+		void _score_bloom_entry(
+				QueryScratch& scratch,
+				const BloomEntry& bloom_entry,
+				float idf,
+				float boost_factor,
+				uint16_t partition_id
+				);
+		void _score_bitmap_union(
+				QueryScratch& scratch,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors
+				);
+		float _init_bloom_terms(
+				QueryScratch& scratch,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors
+				);
+		float _score_bloom_terms(
+				QueryScratch& scratch,
+				uint64_t doc_id,
+				float score,
+				float threshold,
+				float local_threshold,
+				float bloom_bound,
+				uint16_t partition_id
+				);
+		void _score_bloom_batch(
+				QueryScratch& scratch,
+				uint32_t k,
+				float& threshold,
+				float& local_threshold,
+				float bloom_bound,
+				uint16_t partition_id
+				);
+		void _query_partition_pruned(
 				std::string& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
 				uint16_t partition_id,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
 				);
-		std::vector<BM25Result> _query_partition_bloom(
+		void _query_partition_impact(
 				std::string& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
 				uint16_t partition_id,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
 				);
-		std::vector<BM25Result> _query_partition_streaming(
+		QueryPlan _plan_partition(
 				std::string& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
 				uint16_t partition_id,
-				std::vector<float> boost_factors
+				QueryScratch& scratch
+				);
+		std::vector<QueryPlan> explain(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df
+				);
+		void _query_partition_mode(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
+				);
+		void _query_partition_streaming(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
 				);
 		std::vector<BM25Result> query(
 				std::string& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors
+				);
+		// Overwrites result. Reusing it across queries avoids its allocation.
+		void query(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				const std::vector<float>& boost_factors,
+				std::vector<BM25Result>& result
+				);
+		BM25BatchResult query_batch(
+				std::vector<std::string>& queries,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				const std::vector<float>& boost_factors
 				);
 
 		std::vector<std::vector<std::pair<std::string, std::string>>> get_topk_internal(
 				std::string& _query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors
 				);
 
-		std::vector<BM25Result> _query_partition_bloom_multi(
+		void _query_partition_bloom_multi(
 				std::vector<std::string>& query,
 				uint32_t k,
 				uint32_t query_max_df,
 				uint16_t partition_id,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors,
+				QueryScratch& scratch,
+				std::vector<BM25Result>& result
 				);
 		std::vector<BM25Result> query_multi(
 				std::vector<std::string>& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors
 				);
 		std::vector<std::vector<std::pair<std::string, std::string>>> get_topk_internal_multi(
 				std::vector<std::string>& _query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				const std::vector<float>& boost_factors
 				);
 
+		ThresholdStats get_threshold_stats();
+		void reset_threshold_stats();
+
+		uint64_t get_impact_fallbacks();
+		void reset_impact_fallbacks();
+
 		void update_progress(int line_num, int num_lines, uint16_t partition_id);
 		void finalize_progress_bar();
 };
@@ -0,0 +1,78 @@
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "engine.h"
+
+
+typedef struct {
+	uint32_t doc_id;
+	uint8_t  term_freq;
+	uint8_t  impact;
+} ImpactPosting;
+
+
+void build_impact_postings(
+		InvertedIndex& II,
+		const std::vector<uint8_t>& doc_norms,
+		const float* norm_table
+		) {
+	uint64_t num_terms = II.postings.size();
+
+	ImpactIndex& index = II.impacts;
+	index.segments.clear();
+	index.segment_offsets.clear();
+	index.doc_ids.clear();
+	index.term_freqs.clear();
+	index.segment_offsets.reserve(num_terms + 1);
+
+	PostingCursor cursor;
+	std::vector<ImpactPosting> postings;
+
+	for (uint64_t term_idx = 0; term_idx < num_terms; ++term_idx) {
+		index.segment_offsets.push_back((uint32_t)index.segments.size());
+
+		postings.clear();
+		cursor_init(cursor, II, term_idx, 1.0f, doc_norms, norm_table);
+		while (cursor_doc(cursor) != POSTING_END) {
+			uint64_t doc_id = cursor_doc(cursor);
+			uint8_t  tf 	= cursor_tf(cursor);
+
+			ImpactPosting posting;
+			posting.doc_id 	  = (uint32_t)doc_id;
+			posting.term_freq = tf;
+			posting.impact 	  = quantize_impact(bm25_tf_norm((float)tf, norm_table[doc_norms[doc_id]]));
+			postings.push_back(posting);
+
+			cursor_next(cursor);
+		}
+
+		// Stable so doc ids stay ascending within a segment.
+		std::stable_sort(
+				postings.begin(),
+				postings.end(),
+				[](const ImpactPosting& a, const ImpactPosting& b) {
+					return a.impact > b.impact;
+				}
+				);
+
+		for (uint64_t i = 0; i < postings.size(); ++i) {
+			if (i == 0 || postings[i].impact != postings[i - 1].impact) {
+				ImpactSegment segment;
+				segment.offset 	 = (uint32_t)index.doc_ids.size();
+				segment.num_docs = 0;
+				segment.impact 	 = postings[i].impact;
+				index.segments.push_back(segment);
+			}
+			index.doc_ids.push_back(postings[i].doc_id);
+			index.term_freqs.push_back(postings[i].term_freq);
+			++index.segments.back().num_docs;
+		}
+	}
+	index.segment_offsets.push_back((uint32_t)index.segments.size());
+
+	index.segments.shrink_to_fit();
+	index.doc_ids.shrink_to_fit();
+	index.term_freqs.shrink_to_fit();
+}
@@ -0,0 +1,46 @@
+#include <stdint.h>
+
+#include <vector>
+
+#include "norms.h"
+
+
+// 3 mantissa bits with an implicit leading one and 5 exponent bits.
+static inline uint32_t long_to_int4(uint32_t value) {
+	uint32_t num_bits = 32 - __builtin_clz(value | 1);
+	if (num_bits < 4) return value;
+
+	uint32_t shift = num_bits - 4;
+	return ((value >> shift) & 0x07) | ((shift + 1) << 3);
+}
+
+static inline uint32_t int4_to_long(uint32_t encoded) {
+	uint32_t bits = encoded & 0x07;
+	uint32_t exponent = encoded >> 3;
+	if (exponent == 0) return bits;
+	return (bits | 0x08) << (exponent - 1);
+}
+
+uint8_t encode_doc_norm(uint32_t doc_size) {
+	if (doc_size < NORM_NUM_EXACT) return (uint8_t)doc_size;
+	return (uint8_t)(NORM_NUM_EXACT + long_to_int4(doc_size - NORM_NUM_EXACT));
+}
+
+uint32_t decode_doc_norm(uint8_t norm) {
+	if (norm < NORM_NUM_EXACT) return norm;
+	return NORM_NUM_EXACT + int4_to_long(norm - NORM_NUM_EXACT);
+}
+
+void encode_doc_norms(std::vector<uint16_t>& doc_sizes, std::vector<uint8_t>& doc_norms) {
+	doc_norms.resize(doc_sizes.size());
+	for (uint64_t doc_id = 0; doc_id < doc_sizes.size(); ++doc_id) {
+		doc_norms[doc_id] = encode_doc_norm(doc_sizes[doc_id]);
+	}
+	std::vector<uint16_t>().swap(doc_sizes);
+}
+
+void init_norm_table(float* table, float avg_doc_size, float k1, float b) {
+	for (uint32_t norm = 0; norm < NORM_TABLE_SIZE; ++norm) {
+		table[norm] = k1 * (1 - b + b * (float)decode_doc_norm((uint8_t)norm) / avg_doc_size);
+	}
+}
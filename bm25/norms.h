@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+
+// Doc lengths stored in one byte as Lucene does (SmallFloat.intToByte4).
+// Lengths below NORM_NUM_EXACT are exact. Longer lengths keep their
+// 4 most significant bits and decode to the smallest length of their bucket.
+#define NORM_NUM_EXACT 24
+#define NORM_TABLE_SIZE 256
+
+uint8_t  encode_doc_norm(uint32_t doc_size);
+uint32_t decode_doc_norm(uint8_t norm);
+
+// Encodes doc_sizes into doc_norms and releases doc_sizes.
+void encode_doc_norms(std::vector<uint16_t>& doc_sizes, std::vector<uint8_t>& doc_norms);
+
+// table[norm] = k1 * (1 - b + b * decode_doc_norm(norm) / avg_doc_size).
+// The BM25 tf component of a doc is then tf / (tf + table[norm]).
+void init_norm_table(float* table, float avg_doc_size, float k1, float b);
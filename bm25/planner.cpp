@@ -0,0 +1,123 @@
+#include <stdint.h>
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "engine.h"
+
+
+// Relative cost of the work units of each mode. One posting scored by
+// QUERY_BLOOM costs 1. Calibrated against measured query times on a 300k
+// doc Zipfian corpus with 4 partitions, for 1 to 8 terms and k of 10 and 1000.
+#define PLAN_COST_TAAT_POSTING 	 1.0f	// Decode, score and accumulate.
+#define PLAN_COST_CANDIDATE 	 0.5f	// Top-k selection over the accumulator.
+#define PLAN_COST_DAAT_POSTING 	 1.2f	// Cursor advance and merge.
+#define PLAN_COST_BLOOM_PROBE 	 2.0f	// One bloom filter probe.
+#define PLAN_COST_RESCORE 		 10.0f	// One cursor seek when rescoring a candidate.
+#define PLAN_COST_IMPACT_POSTING 1.6f	// Accumulating one impact ordered posting.
+#define PLAN_COST_BLOOM_TERM 	 40.0f	// Bloom path setup per query term, which QUERY_TAAT skips.
+
+// Block-Max WAND cost per posting MaxScore would read, relative to MaxScore.
+// Walking past a skipped block still costs PLAN_BMW_SKIP, a decoded one
+// PLAN_BMW_SKIP + PLAN_BMW_DECODE. Sorting cursors and summing block bounds
+// at every pivot adds PLAN_BMW_PIVOT per term after the first.
+#define PLAN_BMW_SKIP 	0.75f
+#define PLAN_BMW_DECODE 0.4f
+#define PLAN_BMW_PIVOT 	0.3f
+
+// Fraction of work left once a pruned mode has a threshold is taken as
+// PLAN_PRUNE_FACTOR * k / candidates, at most 1.
+#define PLAN_PRUNE_FACTOR 8.0f
+
+
+QueryPlan plan_query(const PlanInputs& inputs) {
+	QueryPlan plan;
+	plan.num_terms 		 = inputs.num_terms;
+	plan.num_bloom_terms = inputs.num_bloom_terms;
+	plan.num_postings 	 = 0;
+	plan.block_selectivity = 1.0f;
+	for (QueryMode mode = QUERY_BLOOM; mode < QUERY_AUTO; mode = (QueryMode)(mode + 1)) {
+		plan.costs[mode] = FLT_MAX;
+	}
+
+	uint64_t max_df = 0;
+	double   miss_prob = 1.0;
+	// Postings weighted by the block selectivity of their list.
+	float    selective_postings = 0.0f;
+	for (uint32_t i = 0; i < inputs.num_terms; ++i) {
+		plan.num_postings += inputs.term_dfs[i];
+		max_df = std::max(max_df, (uint64_t)inputs.term_dfs[i]);
+		miss_prob *= 1.0 - (double)inputs.term_dfs[i] / (double)std::max(inputs.num_docs, (uint64_t)1);
+		selective_postings += (float)inputs.term_dfs[i] * inputs.term_block_selectivities[i];
+	}
+	// Terms taken as independent.
+	plan.num_candidates = (uint64_t)std::ceil((1.0 - miss_prob) * (double)inputs.num_docs);
+
+	float B = (float)inputs.num_bloom_terms;
+
+	if (inputs.num_terms == 0) {
+		// Every mode takes candidates from the top-k docs of the bloom entries.
+		plan.num_candidates   = inputs.bloom_candidates;
+		plan.mode 			  = QUERY_BLOOM;
+		plan.costs[QUERY_BLOOM] = (float)inputs.bloom_candidates * (PLAN_COST_CANDIDATE + B * PLAN_COST_BLOOM_PROBE);
+		plan.cost 			  = plan.costs[QUERY_BLOOM];
+		return plan;
+	}
+
+	plan.block_selectivity = selective_postings / (float)std::max(plan.num_postings, (uint64_t)1);
+
+	float P 	 = (float)plan.num_postings;
+	float P_max  = (float)max_df;
+	float C 	 = (float)std::max(plan.num_candidates, (uint64_t)1);
+	float probes = C * B * PLAN_COST_BLOOM_PROBE;
+
+	// Share of candidates (and of the most frequent list) still scored once
+	// the k-th score is known.
+	float survivors = std::min(1.0f, PLAN_PRUNE_FACTOR * (float)inputs.k / C);
+
+	float T = (float)(inputs.num_terms + inputs.num_bloom_terms);
+
+	plan.costs[QUERY_BLOOM] 	= P * PLAN_COST_TAAT_POSTING + C * PLAN_COST_CANDIDATE + probes + T * PLAN_COST_BLOOM_TERM;
+	plan.costs[QUERY_STREAMING] = P * PLAN_COST_DAAT_POSTING + probes * survivors;
+	if (inputs.num_bloom_terms == 0) {
+		// QUERY_BLOOM without its bloom path setup.
+		plan.costs[QUERY_TAAT] = P * PLAN_COST_TAAT_POSTING + C * PLAN_COST_CANDIDATE;
+	}
+
+	// Pruned and impact modes ignore query_max_df, so they may only run
+	// when it removed nothing.
+	if (!inputs.max_df_filtered) {
+		// MaxScore reads the rarer lists in full and skips through the most
+		// frequent one. A single list cannot be skipped.
+		float postings_read = (inputs.num_terms > 1) ? (P - P_max) + P_max * survivors : P;
+
+		plan.costs[QUERY_MAXSCORE] = postings_read * PLAN_COST_DAAT_POSTING + probes * survivors;
+
+		// Block-Max WAND decodes every block until the threshold is known.
+		// Then only blocks whose max score can reach it.
+		float decoded = survivors + (1.0f - survivors) * plan.block_selectivity;
+		float bmw_factor = (PLAN_BMW_SKIP + PLAN_BMW_DECODE * decoded)
+						 * (1.0f + PLAN_BMW_PIVOT * (float)(inputs.num_terms - 1));
+		plan.costs[QUERY_BLOCK_MAX_WAND] = postings_read * PLAN_COST_DAAT_POSTING * bmw_factor + probes * survivors;
+
+		if (inputs.impact_available) {
+			// Reading stops once the unread bounds of all terms sum below the
+			// k-th score. With more than one term nearly every segment is read.
+			float impact_read = (inputs.num_terms > 1) ? 1.0f : survivors;
+			float rescored 	  = std::min(C, PLAN_PRUNE_FACTOR * (float)inputs.k);
+			plan.costs[QUERY_IMPACT] = P * impact_read * PLAN_COST_IMPACT_POSTING
+									 + rescored * (float)inputs.num_terms * PLAN_COST_RESCORE
+									 + probes * survivors;
+		}
+	}
+
+	plan.mode = QUERY_BLOOM;
+	for (QueryMode mode = QUERY_BLOOM; mode < QUERY_AUTO; mode = (QueryMode)(mode + 1)) {
+		if (plan.costs[mode] < plan.costs[plan.mode]) {
+			plan.mode = mode;
+		}
+	}
+	plan.cost = plan.costs[plan.mode];
+	return plan;
+}
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "engine.h"
+#include "vbyte_encoding.h"
+
+
+static PostingEntry place_posting_list(
+		InvertedIndex& II,
+		uint64_t num_doc_id_bytes,
+		uint64_t num_runs
+		) {
+	PostingEntry entry = {};
+	entry.num_doc_id_bytes = (uint32_t)num_doc_id_bytes;
+	entry.num_runs 		   = (uint32_t)num_runs;
+	if (!posting_is_inline(num_doc_id_bytes, num_runs)) {
+		// Every list size is a multiple of the alignment, so offsets stay aligned.
+		entry.offset = II.posting_bytes.size();
+		II.posting_bytes.resize(entry.offset + posting_arena_size(num_doc_id_bytes, num_runs));
+	}
+	return entry;
+}
+
+void append_posting_list(
+		InvertedIndex& II,
+		const uint8_t* doc_ids,
+		uint64_t num_doc_id_bytes,
+		const RLEElement_u8* term_freqs,
+		uint64_t num_runs
+		) {
+	II.postings.push_back(place_posting_list(II, num_doc_id_bytes, num_runs));
+
+	PostingList list = get_posting_list(II, II.postings.size() - 1);
+	if (num_doc_id_bytes > 0) {
+		memcpy((uint8_t*)list.doc_ids, doc_ids, num_doc_id_bytes);
+	}
+	if (num_runs > 0) {
+		memcpy((RLEElement_u8*)list.term_freqs, term_freqs, num_runs * sizeof(RLEElement_u8));
+	}
+}
+
+void layout_posting_lists(InvertedIndex& II) {
+	uint64_t num_bytes = 0;
+	for (const PostingSize& size : II.posting_sizes) {
+		num_bytes += posting_arena_size(size.num_bytes, size.num_runs);
+	}
+
+	II.postings.clear();
+	II.postings.reserve(II.posting_sizes.size());
+	II.posting_bytes.clear();
+	II.posting_bytes.reserve(num_bytes);
+
+	for (PostingSize& size : II.posting_sizes) {
+		II.postings.push_back(place_posting_list(II, size.num_bytes, size.num_runs));
+		size = {0, 0, 0, 0};
+	}
+}
+
+void pack_posting_lists(InvertedIndex& II, PostingFormat format) {
+	bool reencode = (format != II.format);
+
+	uint64_t live_bytes = 0;
+	for (const PostingEntry& entry : II.postings) {
+		live_bytes += posting_arena_size(entry.num_doc_id_bytes, entry.num_runs);
+	}
+	// Nothing to drop or re-encode.
+	if (!reencode && live_bytes == II.posting_bytes.size()) return;
+
+	InvertedIndex packed;
+	packed.postings.reserve(II.postings.size());
+	packed.posting_bytes.reserve(live_bytes);
+
+	std::vector<uint64_t> doc_ids;
+	std::vector<uint8_t>  encoded;
+	for (uint64_t term_idx = 0; term_idx < II.postings.size(); ++term_idx) {
+		PostingList list = get_posting_list(II, term_idx);
+
+		if (!reencode || list.num_doc_id_bytes == 0) {
+			append_posting_list(packed, list.doc_ids, list.num_doc_id_bytes, list.term_freqs, list.num_runs);
+			continue;
+		}
+
+		doc_ids.resize(posting_list_df(list));
+		decompress_uint64_differential_masked(
+				list.doc_ids,
+				list.doc_ids + list.num_doc_id_bytes,
+				0,
+				doc_ids.size(),
+				doc_ids.data()
+				);
+		encoded.clear();
+		compress_uint64_block_packed(doc_ids, encoded);
+		append_posting_list(packed, encoded.data(), encoded.size(), list.term_freqs, list.num_runs);
+	}
+	// Re-encoded lists may not have matched live_bytes.
+	packed.posting_bytes.shrink_to_fit();
+
+	II.postings.swap(packed.postings);
+	II.posting_bytes.swap(packed.posting_bytes);
+	II.format = format;
+}
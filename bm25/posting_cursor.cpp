@@ -0,0 +1,247 @@
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "engine.h"
+#include "vbyte_encoding.h"
+
+
+// Block max scores are compared against scores computed in a different
+// order of operations. Inflate them slightly so rounding never prunes a match.
+#define BLOCK_MAX_SLACK 1.0001f
+
+
+uint32_t decode_doc_id_block(
+		const PostingList& list,
+		PostingFormat format,
+		uint32_t byte_offset,
+		uint64_t prev_doc_id,
+		uint32_t num_docs,
+		uint64_t* doc_ids
+		) {
+	if (format == POSTINGS_BLOCK_PACKED && num_docs == PACKED_BLOCK_SIZE) {
+		return byte_offset + unpack_block_differential(list.doc_ids + byte_offset, prev_doc_id, doc_ids);
+	}
+
+	// Vbyte list or the vbyte tail of a packed list.
+	return byte_offset + decompress_uint64_differential_masked(
+			list.doc_ids + byte_offset,
+			list.doc_ids + list.num_doc_id_bytes,
+			prev_doc_id,
+			num_docs,
+			doc_ids
+			);
+}
+
+void build_posting_blocks(
+		InvertedIndex& II,
+		const std::vector<uint8_t>& doc_norms,
+		const float* norm_table
+		) {
+	uint64_t num_terms = II.postings.size();
+
+	II.blocks.clear();
+	II.block_offsets.clear();
+	II.block_offsets.reserve(num_terms + 1);
+
+	uint64_t doc_ids[POSTING_BLOCK_SIZE];
+
+	for (uint64_t term_idx = 0; term_idx < num_terms; ++term_idx) {
+		II.block_offsets.push_back((uint32_t)II.blocks.size());
+
+		PostingList list = get_posting_list(II, term_idx);
+		uint64_t df = posting_list_df(list);
+
+		// Bloom terms have no postings. Short lists are decoded whole by cursor_init.
+		if (df <= POSTING_BLOCK_SIZE) continue;
+
+		uint32_t byte_offset = 0;
+		uint64_t prev_doc_id = 0;
+		uint32_t rle_idx 	 = 0;
+		uint16_t rle_offset  = 0;
+
+		for (uint64_t i = 0; i < df; i += POSTING_BLOCK_SIZE) {
+			PostingBlock block;
+			block.prev_doc_id = prev_doc_id;
+			block.byte_offset = byte_offset;
+			block.rle_idx 	  = rle_idx;
+			block.rle_offset  = rle_offset;
+			block.num_docs 	  = (uint16_t)std::min((uint64_t)POSTING_BLOCK_SIZE, df - i);
+			block.max_score   = 0.0f;
+
+			byte_offset = decode_doc_id_block(
+					list, 
+					II.format, 
+					byte_offset, 
+					prev_doc_id, 
+					block.num_docs, 
+					doc_ids
+					);
+
+			for (uint16_t j = 0; j < block.num_docs; ++j) {
+				float tf = (float)list.term_freqs[rle_idx].value;
+				if (++rle_offset == list.term_freqs[rle_idx].num_repeats) {
+					++rle_idx;
+					rle_offset = 0;
+				}
+
+				block.max_score = std::max(
+						block.max_score,
+						bm25_tf_norm(tf, norm_table[doc_norms[doc_ids[j]]]) * BLOCK_MAX_SLACK
+						);
+			}
+			block.last_doc_id = doc_ids[block.num_docs - 1];
+			prev_doc_id = block.last_doc_id;
+
+			II.blocks.push_back(block);
+		}
+	}
+	II.block_offsets.push_back((uint32_t)II.blocks.size());
+	II.blocks.shrink_to_fit();
+}
+
+
+static inline const PostingBlock& get_block(const PostingCursor& cursor, uint32_t block_idx) {
+	return (cursor.blocks == nullptr) ? cursor.single_block : cursor.blocks[block_idx];
+}
+
+static void decode_block(PostingCursor& cursor, uint32_t block_idx) {
+	cursor.block_idx = block_idx;
+	cursor.pos 		 = 0;
+
+	if (block_idx >= cursor.num_blocks) {
+		cursor.block_size = 0;
+		return;
+	}
+
+	const PostingBlock& block = get_block(cursor, block_idx);
+	const PostingList&  list  = cursor.list;
+
+	decode_doc_id_block(
+			list, 
+			cursor.format, 
+			block.byte_offset, 
+			block.prev_doc_id, 
+			block.num_docs, 
+			cursor.doc_ids
+			);
+
+	uint32_t rle_idx 	= block.rle_idx;
+	uint16_t rle_offset = block.rle_offset;
+	for (uint16_t i = 0; i < block.num_docs; ++i) {
+		cursor.term_freqs[i] = list.term_freqs[rle_idx].value;
+		if (++rle_offset == list.term_freqs[rle_idx].num_repeats) {
+			++rle_idx;
+			rle_offset = 0;
+		}
+	}
+	cursor.block_size = block.num_docs;
+
+	if (cursor.shallow_idx < block_idx) {
+		cursor.shallow_idx = block_idx;
+	}
+}
+
+void cursor_init(
+		PostingCursor& cursor,
+		const InvertedIndex& II,
+		uint64_t term_idx,
+		float weight,
+		const std::vector<uint8_t>& doc_norms,
+		const float* norm_table
+		) {
+	cursor.list 	   = get_posting_list(II, term_idx);
+	cursor.format 	   = II.format;
+	cursor.weight 	   = weight;
+	cursor.shallow_idx = 0;
+
+	uint32_t first_block = II.block_offsets[term_idx];
+	uint32_t last_block  = II.block_offsets[term_idx + 1];
+
+	float max_norm = 0.0f;
+	if (first_block != last_block) {
+		cursor.blocks 	  = &II.blocks[first_block];
+		cursor.num_blocks = last_block - first_block;
+
+		for (uint32_t i = 0; i < cursor.num_blocks; ++i) {
+			max_norm = std::max(max_norm, cursor.blocks[i].max_score);
+		}
+		decode_block(cursor, 0);
+	} else {
+		// Short list. Synthesize a single block spanning it.
+		uint64_t df = posting_list_df(cursor.list);
+
+		cursor.blocks 	  = nullptr;
+		cursor.num_blocks = (df > 0) ? 1 : 0;
+
+		PostingBlock& block = cursor.single_block;
+		block.prev_doc_id = 0;
+		block.byte_offset = 0;
+		block.rle_idx 	  = 0;
+		block.rle_offset  = 0;
+		block.num_docs 	  = (uint16_t)df;
+		block.last_doc_id = 0;
+		block.max_score   = 0.0f;
+
+		decode_block(cursor, 0);
+
+		for (uint32_t i = 0; i < cursor.block_size; ++i) {
+			block.max_score = std::max(
+					block.max_score,
+					bm25_tf_norm(
+						(float)cursor.term_freqs[i],
+						norm_table[doc_norms[cursor.doc_ids[i]]]
+						) * BLOCK_MAX_SLACK
+					);
+		}
+		if (cursor.block_size > 0) {
+			block.last_doc_id = cursor.doc_ids[cursor.block_size - 1];
+		}
+		max_norm = block.max_score;
+	}
+
+	// Terms with negative idf never raise a score.
+	cursor.max_score = std::max(0.0f, weight * max_norm);
+}
+
+void cursor_next(PostingCursor& cursor) {
+	if (++cursor.pos < cursor.block_size) return;
+
+	if (cursor.block_size > 0) {
+		decode_block(cursor, cursor.block_idx + 1);
+	}
+}
+
+void cursor_next_geq(PostingCursor& cursor, uint64_t target) {
+	if (cursor_doc(cursor) >= target) return;
+
+	if (get_block(cursor, cursor.block_idx).last_doc_id < target) {
+		uint32_t block_idx = std::max(cursor.block_idx + 1, cursor.shallow_idx);
+		while (block_idx < cursor.num_blocks && get_block(cursor, block_idx).last_doc_id < target) {
+			++block_idx;
+		}
+		decode_block(cursor, block_idx);
+		if (cursor.block_size == 0) return;
+	}
+
+	// Target is within the decoded block.
+	const uint64_t* it = std::lower_bound(
+			cursor.doc_ids + cursor.pos,
+			cursor.doc_ids + cursor.block_size,
+			target
+			);
+	cursor.pos = (uint32_t)(it - cursor.doc_ids);
+}
+
+const PostingBlock* cursor_shallow_block(PostingCursor& cursor, uint64_t target) {
+	if (cursor.shallow_idx < cursor.block_idx) {
+		cursor.shallow_idx = cursor.block_idx;
+	}
+	while (cursor.shallow_idx < cursor.num_blocks && get_block(cursor, cursor.shallow_idx).last_doc_id < target) {
+		++cursor.shallow_idx;
+	}
+	if (cursor.shallow_idx >= cursor.num_blocks) return nullptr;
+
+	return &get_block(cursor, cursor.shallow_idx);
+}
@@ -0,0 +1,198 @@
+#include <stdint.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "score_kernel.h"
+
+
+// Dense accumulator slots are prefetched this many postings ahead of the scatter.
+#define SCORE_PREFETCH_DISTANCE 16
+
+
+static void score_postings_scalar(
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight,
+		float* scores
+		) {
+	for (uint64_t i = 0; i < num_postings; ++i) {
+		float tf  = (float)term_freqs[i];
+		scores[i] = weight * tf / (tf + norm_table[doc_norms[doc_ids[i]]]);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Norm bytes are loaded one at a time. A 32 bit hardware gather at
+// doc_norms + doc_id would read past the end of the norm array.
+// The 256 entry norm table is gathered in registers.
+__attribute__((target("avx2")))
+static void score_postings_avx2(
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight,
+		float* scores
+		) {
+	const __m256 weights = _mm256_set1_ps(weight);
+	uint8_t norms[8];
+
+	uint64_t i = 0;
+	for (; i + 8 <= num_postings; i += 8) {
+		for (uint32_t j = 0; j < 8; ++j) {
+			norms[j] = doc_norms[doc_ids[i + j]];
+		}
+		__m256i norm_idxs = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)norms));
+		__m256  lengths   = _mm256_i32gather_ps(norm_table, norm_idxs, 4);
+
+		__m256 tfs = _mm256_cvtepi32_ps(
+				_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(term_freqs + i)))
+				);
+		_mm256_storeu_ps(
+				scores + i,
+				_mm256_div_ps(_mm256_mul_ps(weights, tfs), _mm256_add_ps(tfs, lengths))
+				);
+	}
+	score_postings_scalar(
+			doc_ids + i,
+			term_freqs + i,
+			num_postings - i,
+			doc_norms,
+			norm_table,
+			weight,
+			scores + i
+			);
+}
+
+__attribute__((target("avx512f")))
+static void score_postings_avx512(
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight,
+		float* scores
+		) {
+	// Zero masked forms of the widening loads, conversion and gather. GCC's
+	// unmasked ones pass an undefined source vector, which it then warns
+	// may be used uninitialized.
+	const __mmask16 all = 0xFFFF;
+	const __m512 weights = _mm512_set1_ps(weight);
+	uint8_t norms[16];
+
+	uint64_t i = 0;
+	for (; i + 16 <= num_postings; i += 16) {
+		for (uint32_t j = 0; j < 16; ++j) {
+			norms[j] = doc_norms[doc_ids[i + j]];
+		}
+		__m512i norm_idxs = _mm512_maskz_cvtepu8_epi32(all, _mm_loadu_si128((const __m128i*)norms));
+		__m512  lengths   = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), all, norm_idxs, norm_table, 4);
+
+		__m512 tfs = _mm512_maskz_cvtepi32_ps(
+				all,
+				_mm512_maskz_cvtepu16_epi32(all, _mm256_loadu_si256((const __m256i*)(term_freqs + i)))
+				);
+		_mm512_storeu_ps(
+				scores + i,
+				_mm512_div_ps(_mm512_mul_ps(weights, tfs), _mm512_add_ps(tfs, lengths))
+				);
+	}
+	score_postings_avx2(
+			doc_ids + i,
+			term_freqs + i,
+			num_postings - i,
+			doc_norms,
+			norm_table,
+			weight,
+			scores + i
+			);
+}
+#endif
+
+typedef void (*ScorePostings)(
+		const uint64_t*,
+		const uint16_t*,
+		uint64_t,
+		const uint8_t*,
+		const float*,
+		float,
+		float*
+		);
+
+static ScorePostings select_score_postings() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return score_postings_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return score_postings_avx2;
+	}
+#endif
+	return score_postings_scalar;
+}
+
+static const ScorePostings score_postings_impl = select_score_postings();
+
+
+void score_postings(
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight,
+		float* scores
+		) {
+	score_postings_impl(doc_ids, term_freqs, num_postings, doc_norms, norm_table, weight, scores);
+}
+
+void accumulate_postings(
+		ScoreAccumulator& acc,
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight
+		) {
+	float scores[SCORE_BLOCK_SIZE];
+
+	for (uint64_t base = 0; base < num_postings; base += SCORE_BLOCK_SIZE) {
+		uint64_t block_size = std::min((uint64_t)SCORE_BLOCK_SIZE, num_postings - base);
+		const uint64_t* block_doc_ids = doc_ids + base;
+
+		score_postings_impl(
+				block_doc_ids,
+				term_freqs + base,
+				block_size,
+				doc_norms,
+				norm_table,
+				weight,
+				scores
+				);
+
+		if (acc.mode == ACCUMULATOR_DENSE) {
+			for (uint64_t i = 0; i < block_size; ++i) {
+				if (i + SCORE_PREFETCH_DISTANCE < block_size) {
+					__builtin_prefetch(&acc.dense_scores[block_doc_ids[i + SCORE_PREFETCH_DISTANCE]], 1);
+				}
+				accumulator_add(acc, block_doc_ids[i], scores[i]);
+			}
+			continue;
+		}
+
+		for (uint64_t i = 0; i < block_size; ++i) {
+			accumulator_add(acc, block_doc_ids[i], scores[i]);
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "accumulator.h"
+
+
+// Postings scored per call of score_postings. Scores live on the stack.
+#define SCORE_BLOCK_SIZE 128
+
+// scores[i] = weight * tf / (tf + norm_table[doc_norms[doc_ids[i]]]) with tf = term_freqs[i].
+// 16 lanes with AVX-512, 8 with AVX2, scalar otherwise. Picked at load time.
+void score_postings(
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight,
+		float* scores
+		);
+
+// Adds all postings of a decoded row to acc, SCORE_BLOCK_SIZE at a time.
+void accumulate_postings(
+		ScoreAccumulator& acc,
+		const uint64_t* doc_ids,
+		const uint16_t* term_freqs,
+		uint64_t num_postings,
+		const uint8_t* doc_norms,
+		const float* norm_table,
+		float weight
+		);
@@ -1,7 +1,14 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
 #include <iostream>
 #include <vector>
 #include <string>
 #include <fstream>
+#include <memory>
 
 
 #include "serialize.h"
@@ -125,27 +132,33 @@ void serialize_inverted_index(
         return;
     }
 
-    size_t outer_size = II.inverted_index_compressed.size();
+    // Encoding of doc_ids. Offsets and sizes below are in bytes either way.
+    uint8_t format = (uint8_t)II.format;
+    out_file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+
+    size_t outer_size = II.postings.size();
     out_file.write(reinterpret_cast<const char*>(&outer_size), sizeof(outer_size));
 
     for (uint64_t idx = 0; idx < outer_size; ++idx) {
-        size_t inner_size_doc_ids = II.inverted_index_compressed[idx].doc_ids.size();
+        PostingList list = get_posting_list(II, idx);
+
+        size_t inner_size_doc_ids = list.num_doc_id_bytes;
         out_file.write(reinterpret_cast<const char*>(&inner_size_doc_ids), sizeof(inner_size_doc_ids));
         
-        if (!II.inverted_index_compressed[idx].doc_ids.empty()) {
+        if (inner_size_doc_ids > 0) {
             out_file.write(
-                reinterpret_cast<const char*>(II.inverted_index_compressed[idx].doc_ids.data()),
-                II.inverted_index_compressed[idx].doc_ids.size() * sizeof(uint8_t)
+                reinterpret_cast<const char*>(list.doc_ids),
+                inner_size_doc_ids * sizeof(uint8_t)
             );
         }
 
-        size_t inner_size_term_freqs = II.inverted_index_compressed[idx].term_freqs.size();
+        size_t inner_size_term_freqs = list.num_runs;
         out_file.write(reinterpret_cast<const char*>(&inner_size_term_freqs), sizeof(inner_size_term_freqs));
 
-        if (!II.inverted_index_compressed[idx].term_freqs.empty()) {
+        if (inner_size_term_freqs > 0) {
             out_file.write(
-                reinterpret_cast<const char*>(II.inverted_index_compressed[idx].term_freqs.data()),
-                II.inverted_index_compressed[idx].term_freqs.size() * sizeof(RLEElement_u8)
+                reinterpret_cast<const char*>(list.term_freqs),
+                inner_size_term_freqs * sizeof(RLEElement_u8)
             );
         }
     }
@@ -163,32 +176,60 @@ void deserialize_inverted_index(
         return;
     }
 
+    uint8_t format;
+    in_file.read(reinterpret_cast<char*>(&format), sizeof(format));
+    II.format = static_cast<PostingFormat>(format);
+
     size_t outer_size;
     in_file.read(reinterpret_cast<char*>(&outer_size), sizeof(outer_size));
-    II.inverted_index_compressed.resize(outer_size);
 
+    // Sizes are read first so the arena is allocated once.
+    std::streampos lists_start = in_file.tellg();
+    uint64_t num_bytes = 0;
+    for (uint64_t idx = 0; idx < outer_size; ++idx) {
+        size_t inner_size_doc_ids;
+        in_file.read(reinterpret_cast<char*>(&inner_size_doc_ids), sizeof(inner_size_doc_ids));
+        in_file.seekg(inner_size_doc_ids * sizeof(uint8_t), std::ios::cur);
+
+        size_t inner_size_term_freqs;
+        in_file.read(reinterpret_cast<char*>(&inner_size_term_freqs), sizeof(inner_size_term_freqs));
+        in_file.seekg(inner_size_term_freqs * sizeof(RLEElement_u8), std::ios::cur);
+
+        num_bytes += posting_arena_size(inner_size_doc_ids, inner_size_term_freqs);
+    }
+    in_file.seekg(lists_start);
+
+    II.postings.clear();
+    II.postings.reserve(outer_size);
+    II.posting_bytes.clear();
+    II.posting_bytes.reserve(num_bytes);
+
+    std::vector<uint8_t> doc_ids;
+    std::vector<RLEElement_u8> term_freqs;
     for (uint64_t idx = 0; idx < outer_size; ++idx) {
         size_t inner_size_doc_ids;
         in_file.read(reinterpret_cast<char*>(&inner_size_doc_ids), sizeof(inner_size_doc_ids));
-        II.inverted_index_compressed[idx].doc_ids.resize(inner_size_doc_ids);
+        doc_ids.resize(inner_size_doc_ids);
 
         if (inner_size_doc_ids > 0) {
             in_file.read(
-                reinterpret_cast<char*>(II.inverted_index_compressed[idx].doc_ids.data()),
+                reinterpret_cast<char*>(doc_ids.data()),
                 inner_size_doc_ids * sizeof(uint8_t)
             );
         }
 
         size_t inner_size_term_freqs;
         in_file.read(reinterpret_cast<char*>(&inner_size_term_freqs), sizeof(inner_size_term_freqs));
-        II.inverted_index_compressed[idx].term_freqs.resize(inner_size_term_freqs);
+        term_freqs.resize(inner_size_term_freqs);
 
         if (inner_size_term_freqs > 0) {
             in_file.read(
-                reinterpret_cast<char*>(II.inverted_index_compressed[idx].term_freqs.data()),
+                reinterpret_cast<char*>(term_freqs.data()),
                 inner_size_term_freqs * sizeof(RLEElement_u8)
             );
         }
+
+        append_posting_list(II, doc_ids.data(), doc_ids.size(), term_freqs.data(), term_freqs.size());
     }
 
     in_file.close();
@@ -248,8 +289,8 @@ void serialize_vector_of_vectors_u64(
     out_file.close();
 }
 
-void serialize_robin_hood_flat_map_string_u32(
-		const robin_hood::unordered_flat_map<std::string, uint32_t>& map,
+void serialize_term_dictionary(
+		const TermDictionary& dict,
 		const std::string& filename
 		) {
 	std::ofstream out_file(filename, std::ios::binary);
@@ -258,16 +299,16 @@ void serialize_robin_hood_flat_map_string_u32(
         return;
     }
 
-    // Write the size of the map first
-    size_t map_size = map.size();
+    // Same layout as a string to u32 map. Stop words are not written.
+    size_t map_size = dict.num_terms;
     out_file.write(reinterpret_cast<const char*>(&map_size), sizeof(map_size));
 
-    for (const auto& [key, value] : map) {
+    term_dict_for_each(dict, [&](std::string_view key, uint64_t, uint32_t value) {
         size_t key_size = key.size();
         out_file.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
         out_file.write(key.data(), key_size);
         out_file.write(reinterpret_cast<const char*>(&value), sizeof(value));
-    }
+    });
 
     out_file.close();
 }
@@ -542,8 +583,8 @@ void deserialize_vector_of_vectors_u64(
     in_file.close();
 }
 
-void deserialize_robin_hood_flat_map_string_u32(
-		robin_hood::unordered_flat_map<std::string, uint32_t>& map,
+void deserialize_term_dictionary(
+		TermDictionary& dict,
 		const std::string& filename
 		) {
 	std::ifstream in_file(filename, std::ios::binary);
@@ -555,19 +596,20 @@ void deserialize_robin_hood_flat_map_string_u32(
 	// Read the size of the map
     size_t map_size;
     in_file.read(reinterpret_cast<char*>(&map_size), sizeof(map_size));
+    term_dict_reserve(dict, map_size, 0);
 
-    // Read each key-value pair and insert it into the map
+    std::string key;
     for (size_t i = 0; i < map_size; ++i) {
         size_t keySize;
         in_file.read(reinterpret_cast<char*>(&keySize), sizeof(keySize));
         
-        std::string key(keySize, '\0');
+        key.resize(keySize);
         in_file.read(&key[0], keySize);
 
         uint32_t value;
         in_file.read(reinterpret_cast<char*>(&value), sizeof(value));
 
-        map[key] = value;
+        term_dict_insert(dict, key, term_hash(key), value);
     }
 
     in_file.close();
@@ -663,3 +705,262 @@ void deserialize_vector_of_vectors_pair_u64_u16(
 
     in_file.close();
 }
+
+static void write_block_padding(std::ofstream& out_file) {
+	const char padding[BLOOM_BLOCK_BYTES] = {0};
+	uint64_t offset = (uint64_t)out_file.tellp();
+	out_file.write(padding, (BLOOM_BLOCK_BYTES - offset % BLOOM_BLOCK_BYTES) % BLOOM_BLOCK_BYTES);
+}
+
+static const uint8_t* skip_block_padding(const uint8_t* ptr, const uint8_t* base) {
+	uint64_t offset = (uint64_t)(ptr - base);
+	return ptr + (BLOOM_BLOCK_BYTES - offset % BLOOM_BLOCK_BYTES) % BLOOM_BLOCK_BYTES;
+}
+
+void serialize_bloom_filters(
+		const robin_hood::unordered_flat_map<uint64_t, BloomEntry>& bloom_filters,
+		const std::string& filename
+		) {
+	std::ofstream out_file(filename, std::ios::binary);
+    if (!out_file) {
+        std::cerr << "Error opening file when serializing bloom filters.\n";
+        return;
+    }
+
+	// Layout. No padding. Read back with memcpy.
+	// u64 num_entries
+	// per entry:  u64 term_idx, u32 num_topk, u32 num_filters,
+	//             u64 topk_doc_ids[num_topk], f32 topk_term_freqs[num_topk],
+	//             u32 xor_segment_length
+	// if xor:     u64 seed, u8 max_value, u32 slots[3 * xor_segment_length]
+	//             u64 bitmap_num_words
+	// if bitmap:  u16 max_tf, u64 num_ranks, u64 num_nibble_bytes, u64 num_overflow,
+	//             (u32 doc_id, u16 tf)[num_overflow], u64 bits[bitmap_num_words],
+	//             u32 ranks[num_ranks], u8 tf_nibbles[num_nibble_bytes]
+	// per filter: u16 term_freq, u16 num_seeds, u8 type, u64 num_bits,
+	//             u32 seeds[num_seeds], u8 bits[(num_bits + 7) / 8]
+	// Blocked filter bits, xor slots and bitmap bits are zero padded to start on a
+	// BLOOM_BLOCK_BYTES file offset so they stay cache line aligned when mapped.
+	uint64_t num_entries = bloom_filters.size();
+	out_file.write(reinterpret_cast<const char*>(&num_entries), sizeof(num_entries));
+
+	for (const auto& [term_idx, entry] : bloom_filters) {
+		uint32_t num_topk 	 = entry.topk_doc_ids.size();
+		uint32_t num_filters = entry.bloom_filters.size();
+
+		out_file.write(reinterpret_cast<const char*>(&term_idx), sizeof(term_idx));
+		out_file.write(reinterpret_cast<const char*>(&num_topk), sizeof(num_topk));
+		out_file.write(reinterpret_cast<const char*>(&num_filters), sizeof(num_filters));
+		out_file.write(
+				reinterpret_cast<const char*>(entry.topk_doc_ids.data()),
+				num_topk * sizeof(uint64_t)
+				);
+		out_file.write(
+				reinterpret_cast<const char*>(entry.topk_term_freqs.data()),
+				num_topk * sizeof(float)
+				);
+
+		const XorFilter& tf_filter = entry.tf_filter;
+		uint32_t xor_segment_length = (tf_filter.slots != nullptr) ? tf_filter.segment_length : 0;
+		out_file.write(reinterpret_cast<const char*>(&xor_segment_length), sizeof(xor_segment_length));
+		if (xor_segment_length > 0) {
+			out_file.write(reinterpret_cast<const char*>(&tf_filter.seed), sizeof(tf_filter.seed));
+			out_file.write(reinterpret_cast<const char*>(&tf_filter.max_value), sizeof(tf_filter.max_value));
+			write_block_padding(out_file);
+			out_file.write(
+					reinterpret_cast<const char*>(tf_filter.slots),
+					xor_filter_num_slots(tf_filter) * sizeof(uint32_t)
+					);
+		}
+
+		uint64_t bitmap_num_words = (entry.bitmap != nullptr) ? entry.bitmap->bits.size() : 0;
+		out_file.write(reinterpret_cast<const char*>(&bitmap_num_words), sizeof(bitmap_num_words));
+		if (bitmap_num_words > 0) {
+			const BitmapEntry& bitmap = *entry.bitmap;
+
+			uint64_t num_ranks 		  = bitmap.ranks.size();
+			uint64_t num_nibble_bytes = bitmap.tf_nibbles.size();
+			uint64_t num_overflow 	  = bitmap.tf_overflow.size();
+			out_file.write(reinterpret_cast<const char*>(&bitmap.max_tf), sizeof(bitmap.max_tf));
+			out_file.write(reinterpret_cast<const char*>(&num_ranks), sizeof(num_ranks));
+			out_file.write(reinterpret_cast<const char*>(&num_nibble_bytes), sizeof(num_nibble_bytes));
+			out_file.write(reinterpret_cast<const char*>(&num_overflow), sizeof(num_overflow));
+			for (const auto& [doc_id, tf] : bitmap.tf_overflow) {
+				out_file.write(reinterpret_cast<const char*>(&doc_id), sizeof(doc_id));
+				out_file.write(reinterpret_cast<const char*>(&tf), sizeof(tf));
+			}
+
+			write_block_padding(out_file);
+			out_file.write(
+					reinterpret_cast<const char*>(bitmap.bits.data()), 
+					bitmap_num_words * sizeof(uint64_t)
+					);
+			out_file.write(
+					reinterpret_cast<const char*>(bitmap.ranks.data()), 
+					num_ranks * sizeof(uint32_t)
+					);
+			out_file.write(
+					reinterpret_cast<const char*>(bitmap.tf_nibbles.data()), 
+					num_nibble_bytes
+					);
+		}
+
+		for (const auto& [term_freq, filter] : entry.bloom_filters) {
+			uint16_t num_seeds = filter.seeds.size();
+			uint64_t num_bits  = filter.num_bits;
+			uint8_t  type 	   = (uint8_t)filter.type;
+
+			out_file.write(reinterpret_cast<const char*>(&term_freq), sizeof(term_freq));
+			out_file.write(reinterpret_cast<const char*>(&num_seeds), sizeof(num_seeds));
+			out_file.write(reinterpret_cast<const char*>(&type), sizeof(type));
+			out_file.write(reinterpret_cast<const char*>(&num_bits), sizeof(num_bits));
+			out_file.write(
+					reinterpret_cast<const char*>(filter.seeds.data()),
+					num_seeds * sizeof(uint32_t)
+					);
+
+			if (filter.type == BLOOM_BLOCKED) {
+				write_block_padding(out_file);
+			}
+			out_file.write(
+					reinterpret_cast<const char*>(filter.bits),
+					(num_bits + 7) / 8
+					);
+		}
+	}
+
+    out_file.close();
+}
+
+void deserialize_bloom_filters(
+		robin_hood::unordered_flat_map<uint64_t, BloomEntry>& bloom_filters,
+		const std::string& filename,
+		uint8_t*& mapping,
+		size_t& mapping_size
+		) {
+	mapping 	 = nullptr;
+	mapping_size = 0;
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1) {
+        std::cerr << "Error opening file when deserializing bloom filters.\n";
+        return;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(uint64_t)) {
+        std::cerr << "Error reading bloom filter file size.\n";
+		close(fd);
+        return;
+	}
+
+	// Bit arrays are used in place. Pages are faulted in on first query.
+	uint8_t* data = (uint8_t*)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		std::cerr << "Error mapping bloom filter file to memory." << std::endl;
+		std::exit(1);
+	}
+
+	const uint8_t* ptr = data;
+
+	uint64_t num_entries;
+	memcpy(&num_entries, ptr, sizeof(num_entries)); ptr += sizeof(num_entries);
+
+	bloom_filters.clear();
+	bloom_filters.reserve(num_entries);
+
+	for (uint64_t i = 0; i < num_entries; ++i) {
+		uint64_t term_idx;
+		uint32_t num_topk, num_filters;
+		memcpy(&term_idx, ptr, sizeof(term_idx)); 		ptr += sizeof(term_idx);
+		memcpy(&num_topk, ptr, sizeof(num_topk)); 		ptr += sizeof(num_topk);
+		memcpy(&num_filters, ptr, sizeof(num_filters)); ptr += sizeof(num_filters);
+
+		BloomEntry entry;
+		entry.topk_doc_ids.resize(num_topk);
+		entry.topk_term_freqs.resize(num_topk);
+		memcpy(entry.topk_doc_ids.data(), ptr, num_topk * sizeof(uint64_t));
+		ptr += num_topk * sizeof(uint64_t);
+		memcpy(entry.topk_term_freqs.data(), ptr, num_topk * sizeof(float));
+		ptr += num_topk * sizeof(float);
+
+		uint32_t xor_segment_length;
+		memcpy(&xor_segment_length, ptr, sizeof(xor_segment_length)); ptr += sizeof(xor_segment_length);
+		if (xor_segment_length > 0) {
+			XorFilter& tf_filter = entry.tf_filter;
+			tf_filter.segment_length = xor_segment_length;
+			memcpy(&tf_filter.seed, ptr, sizeof(tf_filter.seed)); 			ptr += sizeof(tf_filter.seed);
+			memcpy(&tf_filter.max_value, ptr, sizeof(tf_filter.max_value)); ptr += sizeof(tf_filter.max_value);
+			ptr = skip_block_padding(ptr, data);
+
+			// Read only mapping. See below.
+			tf_filter.slots = reinterpret_cast<uint32_t*>(const_cast<uint8_t*>(ptr));
+			ptr += xor_filter_num_slots(tf_filter) * sizeof(uint32_t);
+		}
+
+		uint64_t bitmap_num_words;
+		memcpy(&bitmap_num_words, ptr, sizeof(bitmap_num_words)); ptr += sizeof(bitmap_num_words);
+		if (bitmap_num_words > 0) {
+			std::shared_ptr<BitmapEntry> bitmap = std::make_shared<BitmapEntry>();
+
+			uint64_t num_ranks, num_nibble_bytes, num_overflow;
+			memcpy(&bitmap->max_tf, ptr, sizeof(bitmap->max_tf)); 		ptr += sizeof(bitmap->max_tf);
+			memcpy(&num_ranks, ptr, sizeof(num_ranks)); 				ptr += sizeof(num_ranks);
+			memcpy(&num_nibble_bytes, ptr, sizeof(num_nibble_bytes)); 	ptr += sizeof(num_nibble_bytes);
+			memcpy(&num_overflow, ptr, sizeof(num_overflow)); 			ptr += sizeof(num_overflow);
+			for (uint64_t j = 0; j < num_overflow; ++j) {
+				uint32_t doc_id;
+				uint16_t tf;
+				memcpy(&doc_id, ptr, sizeof(doc_id)); ptr += sizeof(doc_id);
+				memcpy(&tf, ptr, sizeof(tf)); 		  ptr += sizeof(tf);
+				bitmap->tf_overflow.insert({doc_id, tf});
+			}
+			ptr = skip_block_padding(ptr, data);
+
+			// Copied out. Bitmaps are small next to the filters they replace.
+			bitmap->bits.resize(bitmap_num_words);
+			memcpy(bitmap->bits.data(), ptr, bitmap_num_words * sizeof(uint64_t));
+			ptr += bitmap_num_words * sizeof(uint64_t);
+			bitmap->ranks.resize(num_ranks);
+			memcpy(bitmap->ranks.data(), ptr, num_ranks * sizeof(uint32_t));
+			ptr += num_ranks * sizeof(uint32_t);
+			bitmap->tf_nibbles.resize(num_nibble_bytes);
+			memcpy(bitmap->tf_nibbles.data(), ptr, num_nibble_bytes);
+			ptr += num_nibble_bytes;
+
+			entry.bitmap = bitmap;
+		}
+
+		for (uint32_t j = 0; j < num_filters; ++j) {
+			uint16_t term_freq, num_seeds;
+			uint8_t  type;
+			uint64_t num_bits;
+			memcpy(&term_freq, ptr, sizeof(term_freq)); ptr += sizeof(term_freq);
+			memcpy(&num_seeds, ptr, sizeof(num_seeds)); ptr += sizeof(num_seeds);
+			memcpy(&type, ptr, sizeof(type)); 			ptr += sizeof(type);
+			memcpy(&num_bits, ptr, sizeof(num_bits)); 	ptr += sizeof(num_bits);
+
+			BloomFilter filter;
+			filter.type = static_cast<BloomFilterType>(type);
+			filter.seeds.resize(num_seeds);
+			memcpy(filter.seeds.data(), ptr, num_seeds * sizeof(uint32_t));
+			ptr += num_seeds * sizeof(uint32_t);
+
+			if (filter.type == BLOOM_BLOCKED) {
+				ptr = skip_block_padding(ptr, data);
+			}
+
+			// Read only mapping. Loaded filters must not be written to.
+			filter.bits 	= const_cast<uint8_t*>(ptr);
+			filter.num_bits = num_bits;
+			ptr += (num_bits + 7) / 8;
+
+			entry.bloom_filters.insert({term_freq, filter});
+		}
+		bloom_filters.insert({term_idx, std::move(entry)});
+	}
+
+	mapping 	 = data;
+	mapping_size = sb.st_size;
+}
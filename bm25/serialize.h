@@ -19,8 +19,8 @@ void serialize_vector_of_vectors_u64(
 		const std::vector<std::vector<uint64_t>>& vec, 
 		const std::string& filename
 		);
-void serialize_robin_hood_flat_map_string_u32(
-		const robin_hood::unordered_flat_map<std::string, uint32_t>& map,
+void serialize_term_dictionary(
+		const TermDictionary& dict,
 		const std::string& filename
 		);
 void serialize_robin_hood_flat_map_string_u64(
@@ -35,6 +35,10 @@ void serialize_vector_of_vectors_pair_u64_u16(
 		const std::vector<std::vector<std::pair<uint64_t, uint16_t>>>& vec, 
 		const std::string& filename
 		);
+void serialize_bloom_filters(
+		const robin_hood::unordered_flat_map<uint64_t, BloomEntry>& bloom_filters,
+		const std::string& filename
+		);
 void serialize_vector_of_vectors_u8(
 		const std::vector<std::vector<uint8_t>>& vec, 
 		const std::string& filename
@@ -54,8 +58,8 @@ void deserialize_vector_of_vectors_u64(
 		std::vector<std::vector<uint64_t>>& vec, 
 		const std::string& filename
 		);
-void deserialize_robin_hood_flat_map_string_u32(
-		robin_hood::unordered_flat_map<std::string, uint32_t>& map,
+void deserialize_term_dictionary(
+		TermDictionary& dict,
 		const std::string& filename
 		);
 void deserialize_robin_hood_flat_map_string_u64(
@@ -74,3 +78,11 @@ void deserialize_vector_of_vector_u8(
 		std::vector<std::vector<uint8_t>>& vec, 
 		const std::string& filename
 		);
+// Bit arrays of the filters point into the returned read only mapping.
+// Caller owns the mapping and must munmap it after the filters are dropped.
+void deserialize_bloom_filters(
+		robin_hood::unordered_flat_map<uint64_t, BloomEntry>& bloom_filters,
+		const std::string& filename,
+		uint8_t*& mapping,
+		size_t& mapping_size
+		);
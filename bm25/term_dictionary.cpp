@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include "term_dictionary.h"
+
+
+static void place_entry(TermDictionary& dict, uint32_t entry) {
+	uint64_t hash = dict.hashes[entry];
+	uint64_t mask = dict.slots.size() - 1;
+
+	uint64_t idx = hash & mask;
+	while (dict.slots[idx].key != 0) {
+		idx = (idx + 1) & mask;
+	}
+	// Keys are never empty, so none packs to 0.
+	uint64_t length = dict.offsets[entry + 1] - dict.offsets[entry];
+	dict.slots[idx].tag   = (uint32_t)(hash >> 32);
+	dict.slots[idx].value = dict.values[entry];
+	dict.slots[idx].key   = (dict.offsets[entry] << TERM_DICT_LENGTH_BITS) | length;
+}
+
+static void resize_slots(TermDictionary& dict, uint64_t num_slots) {
+	// Stored hashes are reused. Keys are not hashed again.
+	dict.slots.assign(num_slots, {0, 0, 0});
+	for (uint32_t entry = 0; entry < dict.values.size(); ++entry) {
+		place_entry(dict, entry);
+	}
+}
+
+void term_dict_reserve(TermDictionary& dict, uint64_t num_entries, uint64_t num_bytes) {
+	dict.bytes.reserve(num_bytes);
+	dict.offsets.reserve(num_entries + 1);
+	dict.hashes.reserve(num_entries);
+	dict.values.reserve(num_entries);
+
+	uint64_t num_slots = 16;
+	while ((double)num_entries > TERM_DICT_MAX_LOAD * (double)num_slots) {
+		num_slots *= 2;
+	}
+	if (num_slots > dict.slots.size()) {
+		resize_slots(dict, num_slots);
+	}
+}
+
+void term_dict_insert(TermDictionary& dict, std::string_view term, uint64_t hash, uint32_t value) {
+	uint64_t num_entries = dict.values.size() + 1;
+	if (dict.slots.empty() || (double)num_entries > TERM_DICT_MAX_LOAD * (double)dict.slots.size()) {
+		resize_slots(dict, std::max((uint64_t)16, 2 * (uint64_t)dict.slots.size()));
+	}
+
+	if (term.empty() || term.size() >= (1ULL << TERM_DICT_LENGTH_BITS)) {
+		std::cerr << "Invalid term length " << term.size() << "." << std::endl;
+		std::exit(1);
+	}
+
+	uint64_t offset = dict.bytes.size();
+	dict.bytes.resize(offset + term.size());
+	memcpy(dict.bytes.data() + offset, term.data(), term.size());
+
+	dict.offsets.push_back(dict.bytes.size());
+	dict.hashes.push_back(hash);
+	dict.values.push_back(value);
+	if (value != TERM_STOP_WORD) ++dict.num_terms;
+
+	place_entry(dict, num_entries - 1);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+#include <string_view>
+
+#include "robin_hood.h"
+
+
+// Value of terms which are never indexed. Stop words and tokens which
+// fail is_valid_token are interned with it so they resolve in one probe.
+#define TERM_STOP_WORD (UINT32_MAX - 1)
+#define TERM_NOT_FOUND UINT32_MAX
+
+// Slots are doubled once more than this fraction is used.
+#define TERM_DICT_MAX_LOAD 0.5
+
+// Keys are 1 to 2^TERM_DICT_LENGTH_BITS - 1 bytes. Longer than any
+// token of a field of TOKENIZER_MAX_FIELD_BYTES.
+#define TERM_DICT_LENGTH_BITS 24
+
+// A hit reads only the slot and the key bytes.
+typedef struct {
+	uint32_t tag;		// High 32 bits of the term hash.
+	uint32_t value;
+	uint64_t key;		// Arena offset << TERM_DICT_LENGTH_BITS | length. 0 if empty.
+} TermSlot;
+
+// Open addressing map from term bytes to a u32 value. Keys live back to
+// back in one string arena and are looked up as string_views with a hash
+// computed once by the caller. Entries are kept in insertion order.
+typedef struct {
+	std::vector<char>     bytes;		// String arena.
+	std::vector<uint64_t> offsets = {0};	// Key of entry i is bytes[offsets[i], offsets[i + 1]).
+	std::vector<uint64_t> hashes;
+	std::vector<uint32_t> values;
+	std::vector<TermSlot> slots;		// Linear probing. Size is a power of 2.
+	uint32_t num_terms = 0;				// Entries which are not TERM_STOP_WORD.
+} TermDictionary;
+
+
+inline uint64_t term_hash(std::string_view term) {
+	return robin_hood::hash_bytes(term.data(), term.size());
+}
+
+inline std::string_view term_dict_key(const TermDictionary& dict, uint32_t entry) {
+	return std::string_view(
+			dict.bytes.data() + dict.offsets[entry],
+			dict.offsets[entry + 1] - dict.offsets[entry]
+			);
+}
+
+// Value of term, or TERM_NOT_FOUND.
+inline uint32_t term_dict_find(const TermDictionary& dict, std::string_view term, uint64_t hash) {
+	if (dict.slots.empty()) return TERM_NOT_FOUND;
+
+	uint64_t mask = dict.slots.size() - 1;
+	uint32_t tag  = (uint32_t)(hash >> 32);
+	for (uint64_t idx = hash & mask;; idx = (idx + 1) & mask) {
+		const TermSlot& slot = dict.slots[idx];
+		if (slot.key == 0) return TERM_NOT_FOUND;
+
+		uint64_t length = slot.key & ((1ULL << TERM_DICT_LENGTH_BITS) - 1);
+		if (slot.tag == tag && length == term.size()) {
+			const char* key = dict.bytes.data() + (slot.key >> TERM_DICT_LENGTH_BITS);
+			if (memcmp(key, term.data(), length) == 0) return slot.value;
+		}
+	}
+}
+
+// Adds term, which must not be present yet.
+void term_dict_insert(TermDictionary& dict, std::string_view term, uint64_t hash, uint32_t value);
+void term_dict_reserve(TermDictionary& dict, uint64_t num_entries, uint64_t num_bytes);
+
+// Calls f(term, hash, value) for every indexed term in insertion order.
+template <typename F>
+void term_dict_for_each(const TermDictionary& dict, F&& f) {
+	for (uint32_t entry = 0; entry < dict.values.size(); ++entry) {
+		if (dict.values[entry] == TERM_STOP_WORD) continue;
+		f(term_dict_key(dict, entry), dict.hashes[entry], dict.values[entry]);
+	}
+}
@@ -0,0 +1,106 @@
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "thread_pool.h"
+
+
+static void pin_thread_to_core(std::thread& thread, uint16_t core_idx) {
+#if defined(__linux__)
+	uint32_t num_cores = std::thread::hardware_concurrency();
+	if (num_cores == 0) return;
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(core_idx % num_cores, &cpuset);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+#else
+	// Thread affinity not supported on this platform. Ignore.
+	(void)thread;
+	(void)core_idx;
+#endif
+}
+
+ThreadPool::ThreadPool(uint16_t num_threads, bool pin_threads) : jobs_head(nullptr), jobs_tail(nullptr), stop(false) {
+	if (num_threads == 0) num_threads = 1;
+
+	workers.reserve(num_threads);
+	for (uint16_t i = 0; i < num_threads; ++i) {
+		workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+		if (pin_threads) {
+			pin_thread_to_core(workers.back(), i);
+		}
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	job_cv.notify_all();
+
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::worker_loop(uint16_t worker_idx) {
+	while (true) {
+		PoolJob* job;
+		uint32_t task_idx;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job_cv.wait(lock, [this] { return stop || jobs_head != nullptr; });
+
+			if (stop && jobs_head == nullptr) return;
+
+			// Claim next task. Retire job from queue once all tasks are claimed.
+			job = jobs_head;
+			task_idx = job->next_task++;
+			if (job->next_task == job->num_tasks) {
+				jobs_head = job->next;
+				if (jobs_head == nullptr) jobs_tail = nullptr;
+			}
+		}
+
+		(*job->fn)(task_idx, worker_idx);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (++job->num_finished == job->num_tasks) {
+				done_cv.notify_all();
+			}
+		}
+	}
+}
+
+void ThreadPool::run(uint32_t num_tasks, const PoolTask& fn) {
+	if (num_tasks == 0) return;
+
+	PoolJob job;
+	job.fn 			 = &fn;
+	job.num_tasks    = num_tasks;
+	job.next_task    = 0;
+	job.num_finished = 0;
+	job.next 		 = nullptr;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (jobs_tail == nullptr) {
+		jobs_head = &job;
+	} else {
+		jobs_tail->next = &job;
+	}
+	jobs_tail = &job;
+	job_cv.notify_all();
+
+	done_cv.wait(lock, [&job] { return job.num_finished == job.num_tasks; });
+}
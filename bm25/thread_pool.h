@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+typedef std::function<void(uint32_t task_idx, uint16_t worker_idx)> PoolTask;
+
+typedef struct PoolJob {
+	const PoolTask* fn;
+	uint32_t num_tasks;
+	uint32_t next_task;
+	uint32_t num_finished;
+	struct PoolJob* next;	// Next queued job. Jobs live on the stack of run().
+} PoolJob;
+
+
+class ThreadPool {
+	public:
+		ThreadPool(uint16_t num_threads, bool pin_threads);
+		~ThreadPool();
+
+		// Runs fn(task_idx, worker_idx) for every task_idx in [0, num_tasks)
+		// on the pool workers and blocks until all of them have finished.
+		// worker_idx is stable per thread and < size(), so callers can
+		// use it to index per-worker scratch space.
+		void run(uint32_t num_tasks, const PoolTask& fn);
+
+		uint16_t size() const { return (uint16_t)workers.size(); }
+
+	private:
+		std::vector<std::thread> workers;
+		// Intrusive FIFO of jobs with unclaimed tasks, so queueing a job
+		// never allocates.
+		PoolJob* jobs_head;
+		PoolJob* jobs_tail;
+
+		std::mutex mutex;
+		std::condition_variable job_cv;
+		std::condition_variable done_cv;
+		bool stop;
+
+		void worker_loop(uint16_t worker_idx);
+};
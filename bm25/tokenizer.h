@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stdint.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+// Bytes classified per step of tokenize_field.
+#define TOKENIZER_CHUNK_SIZE 32
+
+// Fields longer than this are taken as a missing terminator.
+#define TOKENIZER_MAX_FIELD_BYTES 1048576
+
+// How quotes, escapes and the end of a field are read.
+enum FieldFormat {
+	// JSON strings and in memory docs. \x is a literal x. A quote
+	// terminator is consumed with the field.
+	FIELD_ESCAPED,
+	// CSV read line by line. "" is dropped. Stops before the delimiter
+	// following a closing quote.
+	FIELD_RFC_4180,
+	// CSV in a mapped file. As FIELD_RFC_4180, but consumes the delimiter
+	// following a closing quote, and a newline only ends the last column.
+	FIELD_RFC_4180_MMAP
+};
+
+template <FieldFormat FORMAT, char TERMINATOR>
+struct FieldBytes {
+	static constexpr bool quote 	= (TERMINATOR == '"');
+	static constexpr bool comma 	= (TERMINATOR == ',');
+	static constexpr bool newline 	= (FORMAT != FIELD_RFC_4180_MMAP) || (TERMINATOR == '\n');
+	static constexpr bool backslash = (FORMAT == FIELD_ESCAPED);
+
+	static inline bool special(char c) {
+		return (c == ' ')
+			|| (quote && c == '"')
+			|| (comma && c == ',')
+			|| (newline && c == '\n')
+			|| (backslash && c == '\\');
+	}
+};
+
+// Uppercases TOKENIZER_CHUNK_SIZE bytes of src into dst. Bit i of the
+// result is set if src[i] ends a run of term bytes.
+template <FieldFormat FORMAT, char TERMINATOR>
+static inline uint32_t classify_chunk(const char* src, char* dst) {
+	typedef FieldBytes<FORMAT, TERMINATOR> Bytes;
+
+#if defined(__AVX2__)
+	__m256i bytes = _mm256_loadu_si256((const __m256i*)src);
+
+	__m256i special = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+	if (Bytes::quote) 	  special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')));
+	if (Bytes::comma) 	  special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(',')));
+	if (Bytes::newline)   special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+	if (Bytes::backslash) special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')));
+
+	// 'a' to 'z' map to 0 to 25. Subtracting 0x20 from those gives toupper in the C locale.
+	__m256i offset 	= _mm256_sub_epi8(bytes, _mm256_set1_epi8('a'));
+	__m256i lower 	= _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(25)), offset);
+	_mm256_storeu_si256(
+			(__m256i*)dst,
+			_mm256_sub_epi8(bytes, _mm256_and_si256(lower, _mm256_set1_epi8(0x20)))
+			);
+	return (uint32_t)_mm256_movemask_epi8(special);
+#elif defined(__SSE2__)
+	uint32_t mask = 0;
+	for (uint32_t half = 0; half < 2; ++half) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(src + 16 * half));
+
+		__m128i special = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+		if (Bytes::quote) 	  special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+		if (Bytes::comma) 	  special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(',')));
+		if (Bytes::newline)   special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+		if (Bytes::backslash) special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+
+		__m128i offset 	= _mm_sub_epi8(bytes, _mm_set1_epi8('a'));
+		__m128i lower 	= _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(25)), offset);
+		_mm_storeu_si128(
+				(__m128i*)(dst + 16 * half),
+				_mm_sub_epi8(bytes, _mm_and_si128(lower, _mm_set1_epi8(0x20)))
+				);
+		mask |= (uint32_t)_mm_movemask_epi8(special) << (16 * half);
+	}
+	return mask;
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < TOKENIZER_CHUNK_SIZE; ++i) {
+		dst[i] = toupper(src[i]);
+		mask  |= (uint32_t)Bytes::special(src[i]) << i;
+	}
+	return mask;
+#endif
+}
+
+// Splits the field starting at field on spaces and calls on_token with
+// each uppercased term. Bytes at or past end are never read. Runs of term
+// bytes are classified and uppercased TOKENIZER_CHUNK_SIZE at a time into
+// term_buf, which backs the views passed to on_token.
+// Returns one past the last byte consumed, or nullptr if the field is
+// longer than TOKENIZER_MAX_FIELD_BYTES.
+template <FieldFormat FORMAT, char TERMINATOR, typename OnToken>
+const char* tokenize_field(
+		const char* field,
+		const char* end,
+		std::string& term_buf,
+		OnToken&& on_token
+		) {
+	typedef FieldBytes<FORMAT, TERMINATOR> Bytes;
+
+	const char* p = field;
+	uint64_t term_len = 0;
+
+	// term_buf always has room for one more chunk.
+	auto reserve = [&]() {
+		if (term_len + 2 * TOKENIZER_CHUNK_SIZE > term_buf.size()) {
+			term_buf.resize(2 * term_buf.size() + 2 * TOKENIZER_CHUNK_SIZE);
+		}
+	};
+	auto flush = [&]() {
+		if (term_len > 0) {
+			on_token(std::string_view(term_buf.data(), term_len));
+			term_len = 0;
+		}
+	};
+	// A byte not read as a delimiter.
+	auto literal = [&](char c) {
+		if (c == ' ') {
+			flush();
+			return;
+		}
+		term_buf[term_len++] = toupper(c);
+	};
+	reserve();
+
+	while (true) {
+		if ((uint64_t)(p - field) > TOKENIZER_MAX_FIELD_BYTES) {
+			return nullptr;
+		}
+
+		if (p + TOKENIZER_CHUNK_SIZE <= end) {
+			uint32_t special = classify_chunk<FORMAT, TERMINATOR>(p, &term_buf[term_len]);
+			uint32_t run 	 = (special == 0) ? TOKENIZER_CHUNK_SIZE : __builtin_ctz(special);
+			term_len += run;
+			p 		 += run;
+			reserve();
+			if (run == TOKENIZER_CHUNK_SIZE) continue;
+		}
+		else {
+			if (p >= end) break;
+			if (!Bytes::special(*p)) {
+				term_buf[term_len++] = toupper(*p++);
+				continue;
+			}
+		}
+
+		// p is on a special byte.
+		char c = *p++;
+		if (c == ' ') {
+			flush();
+			continue;
+		}
+		if (Bytes::backslash && c == '\\') {
+			if (p >= end) break;
+			term_buf[term_len++] = toupper(*p++);
+			continue;
+		}
+		if (Bytes::quote && c == '"') {
+			// JSON escapes quotes in strings, so a bare quote closes the field.
+			if (FORMAT == FIELD_ESCAPED) break;
+			if (p >= end) break;
+			if (*p == ',' || (FORMAT != FIELD_ESCAPED && *p == '\n')) {
+				if (FORMAT == FIELD_RFC_4180_MMAP) ++p;
+				break;
+			}
+			if (*p == '"') {
+				if (FORMAT == FIELD_ESCAPED) term_buf[term_len++] = '"';
+				++p;
+				continue;
+			}
+			// Stray quote. Dropped and the byte after it read as a term byte.
+			literal(*p++);
+			continue;
+		}
+		// Terminator or newline. Consumed.
+		break;
+	}
+	flush();
+	return p;
+}
@@ -1,7 +1,12 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include <vector>
 
 #include "vbyte_encoding.h"
@@ -269,7 +274,7 @@ uint8_t compress_uint64_differential_single_bytes(
 }
 
 uint8_t decompress_uint64_differential_single_bytes(
-		uint8_t* data,
+		const uint8_t* data,
 		uint64_t& new_uncompressed_id,
 		uint64_t prev_id
 		) {
@@ -280,7 +285,7 @@ uint8_t decompress_uint64_differential_single_bytes(
 
 	do {
 		byte = *data++;
-		value |= (byte & 127) << shift;
+		value |= (uint64_t)(byte & 127) << shift;
 		shift += 7;
 		++num_bytes;
 	} while (byte & 128);
@@ -318,3 +323,382 @@ void decompress_uint64_differential(
 		&decompressed_size
 		);
 }
+
+
+uint32_t pack_block_differential(
+		const uint64_t* data,
+		uint64_t prev_id,
+		std::vector<uint8_t>& compressed_buffer
+		) {
+	uint32_t deltas[PACKED_BLOCK_SIZE];
+	uint32_t all_bits = 0;
+	for (uint32_t i = 0; i < PACKED_BLOCK_SIZE; ++i) {
+		uint64_t delta = data[i] - prev_id;
+		if (delta > UINT32_MAX) {
+			fprintf(stderr, "Doc id delta does not fit in a packed block.\n");
+			exit(1);
+		}
+		deltas[i] = (uint32_t)delta;
+		all_bits |= deltas[i];
+		prev_id = data[i];
+	}
+
+	uint8_t bit_width = 0;
+	while (bit_width < 32 && (all_bits >> bit_width) != 0) {
+		++bit_width;
+	}
+
+	// Lane j holds deltas j, j + 4, j + 8, ...
+	// Word w of lane j is stored at words[4 * w + j].
+	uint32_t words[PACKED_BLOCK_SIZE] = {0};
+	for (uint32_t lane = 0; lane < 4; ++lane) {
+		uint32_t bit = 0;
+		for (uint32_t row = 0; row < PACKED_BLOCK_SIZE / 4; ++row) {
+			uint32_t value  = deltas[4 * row + lane];
+			uint32_t word   = bit / 32;
+			uint32_t offset = bit % 32;
+
+			words[4 * word + lane] |= value << offset;
+			if (offset + bit_width > 32) {
+				words[4 * (word + 1) + lane] |= value >> (32 - offset);
+			}
+			bit += bit_width;
+		}
+	}
+
+	uint32_t num_bytes = 16 * bit_width;
+	compressed_buffer.push_back(bit_width);
+	compressed_buffer.insert(
+			compressed_buffer.end(),
+			(const uint8_t*)words,
+			(const uint8_t*)words + num_bytes
+			);
+
+	return num_bytes + 1;
+}
+
+static uint32_t unpack_block_differential_scalar(
+		const uint8_t* compressed_buffer,
+		uint64_t  prev_id,
+		uint64_t* data
+		) {
+	uint8_t bit_width = compressed_buffer[0];
+
+	uint32_t words[PACKED_BLOCK_SIZE];
+	memcpy(words, compressed_buffer + 1, 16 * bit_width);
+
+	uint64_t mask = (1ULL << bit_width) - 1;
+
+	uint32_t bit = 0;
+	for (uint32_t row = 0; row < PACKED_BLOCK_SIZE / 4; ++row) {
+		uint32_t word   = bit / 32;
+		uint32_t offset = bit % 32;
+
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			uint64_t value = words[4 * word + lane] >> offset;
+			if (offset + bit_width > 32) {
+				value |= (uint64_t)words[4 * (word + 1) + lane] << (32 - offset);
+			}
+			prev_id += value & mask;
+			data[4 * row + lane] = prev_id;
+		}
+		bit += bit_width;
+	}
+
+	return 16 * bit_width + 1;
+}
+
+#if defined(__SSE4_1__)
+// Largest bit width for which the sum of a block of deltas fits in 32 bits.
+#define PACKED_MAX_SIMD_BIT_WIDTH 25
+
+uint32_t unpack_block_differential(
+		const uint8_t* compressed_buffer,
+		uint64_t  prev_id,
+		uint64_t* data
+		) {
+	uint8_t bit_width = compressed_buffer[0];
+	if (bit_width > PACKED_MAX_SIMD_BIT_WIDTH) {
+		return unpack_block_differential_scalar(compressed_buffer, prev_id, data);
+	}
+
+	const __m128i* in = (const __m128i*)(compressed_buffer + 1);
+
+	const __m128i mask = _mm_set1_epi32((int)((1U << bit_width) - 1));
+
+	// Prefix sums are done in 32 bit lanes relative to prev_id and widened on store.
+	__m128i carry = _mm_setzero_si128();
+	__m128i word  = (bit_width > 0) ? _mm_loadu_si128(in++) : _mm_setzero_si128();
+	uint32_t shift = 0;
+
+	for (uint32_t row = 0; row < PACKED_BLOCK_SIZE / 4; ++row) {
+		__m128i values = _mm_srl_epi32(word, _mm_cvtsi32_si128(shift));
+
+		shift += bit_width;
+		if (shift >= 32) {
+			shift -= 32;
+			if (shift > 0 || row + 1 < PACKED_BLOCK_SIZE / 4) {
+				word = _mm_loadu_si128(in++);
+			}
+			if (shift > 0) {
+				values = _mm_or_si128(values, _mm_sll_epi32(word, _mm_cvtsi32_si128(bit_width - shift)));
+			}
+		}
+		values = _mm_and_si128(values, mask);
+
+		// Inclusive prefix sum of the 4 lanes plus running total.
+		values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+		values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+		values = _mm_add_epi32(values, carry);
+		carry  = _mm_shuffle_epi32(values, _MM_SHUFFLE(3, 3, 3, 3));
+
+#if defined(__AVX2__)
+		__m256i wide = _mm256_add_epi64(_mm256_cvtepu32_epi64(values), _mm256_set1_epi64x((int64_t)prev_id));
+		_mm256_storeu_si256((__m256i*)(data + 4 * row), wide);
+#else
+		__m128i base = _mm_set1_epi64x((int64_t)prev_id);
+		_mm_storeu_si128((__m128i*)(data + 4 * row), _mm_add_epi64(_mm_cvtepu32_epi64(values), base));
+		_mm_storeu_si128(
+				(__m128i*)(data + 4 * row + 2), 
+				_mm_add_epi64(_mm_cvtepu32_epi64(_mm_srli_si128(values, 8)), base)
+				);
+#endif
+	}
+
+	return 16 * bit_width + 1;
+}
+#else
+uint32_t unpack_block_differential(
+		const uint8_t* compressed_buffer,
+		uint64_t  prev_id,
+		uint64_t* data
+		) {
+	return unpack_block_differential_scalar(compressed_buffer, prev_id, data);
+}
+#endif
+
+void compress_uint64_block_packed(
+		const std::vector<uint64_t>& data,
+		std::vector<uint8_t>& compressed_buffer
+		) {
+	compressed_buffer.clear();
+
+	uint64_t prev_id = 0;
+	uint64_t idx = 0;
+	for (; idx + PACKED_BLOCK_SIZE <= data.size(); idx += PACKED_BLOCK_SIZE) {
+		pack_block_differential(&data[idx], prev_id, compressed_buffer);
+		prev_id = data[idx + PACKED_BLOCK_SIZE - 1];
+	}
+
+	for (; idx < data.size(); ++idx) {
+		compress_uint64_differential_single_bytes(compressed_buffer, data[idx], prev_id);
+		prev_id = data[idx];
+	}
+	compressed_buffer.shrink_to_fit();
+}
+
+void decompress_uint64_block_packed(
+		const std::vector<uint8_t>& compressed_buffer,
+		uint64_t num_values,
+		std::vector<uint64_t>& data
+		) {
+	decompress_uint64_block_packed(compressed_buffer.data(), num_values, data);
+}
+
+void decompress_uint64_block_packed(
+		const uint8_t* compressed_buffer,
+		uint64_t num_values,
+		std::vector<uint64_t>& data
+		) {
+	data.resize(num_values);
+
+	uint64_t prev_id = 0;
+	uint64_t byte_idx = 0;
+	uint64_t idx = 0;
+	for (; idx + PACKED_BLOCK_SIZE <= num_values; idx += PACKED_BLOCK_SIZE) {
+		byte_idx += unpack_block_differential(&compressed_buffer[byte_idx], prev_id, &data[idx]);
+		prev_id = data[idx + PACKED_BLOCK_SIZE - 1];
+	}
+
+	for (; idx < num_values; ++idx) {
+		byte_idx += decompress_uint64_differential_single_bytes(
+				&compressed_buffer[byte_idx], 
+				data[idx], 
+				prev_id
+				);
+		prev_id = data[idx];
+	}
+}
+
+
+static uint32_t decompress_uint64_differential_scalar(
+		const uint8_t* compressed_buffer,
+		const uint8_t* end,
+		uint64_t  prev_id,
+		uint32_t  num_values,
+		uint64_t* data
+		) {
+	const uint8_t* in = compressed_buffer;
+	for (uint32_t i = 0; i < num_values && in < end; ++i) {
+		in += decompress_uint64_differential_single_bytes(in, data[i], prev_id);
+		prev_id = data[i];
+	}
+	return (uint32_t)(in - compressed_buffer);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Masked VByte. The continuation bits of the next 12 bytes select a table entry
+// which gathers the bytes of the next few ints into 16 or 32 bit lanes with
+// one shuffle. Ints longer than 3 bytes are decoded with the scalar decoder.
+#define MASKED_VBYTE_WINDOW 12
+
+typedef struct {
+	uint8_t num_ints;		// 0 means decode one int with the scalar decoder.
+	uint8_t num_bytes;
+	uint8_t lane_bytes;		// 2 or 4.
+	uint8_t shuffle[16];
+} MaskedVbyteEntry;
+
+static MaskedVbyteEntry masked_vbyte_table[1 << MASKED_VBYTE_WINDOW];
+
+static void init_masked_vbyte_table() {
+	for (uint32_t mask = 0; mask < (1 << MASKED_VBYTE_WINDOW); ++mask) {
+		// Lengths of the ints which end within the window.
+		uint8_t lengths[MASKED_VBYTE_WINDOW];
+		uint8_t num_lengths = 0;
+		uint8_t length = 0;
+		for (uint32_t i = 0; i < MASKED_VBYTE_WINDOW; ++i) {
+			++length;
+			if (!(mask & (1 << i))) {
+				lengths[num_lengths++] = length;
+				length = 0;
+			}
+		}
+
+		uint8_t num_16 = 0;
+		while (num_16 < num_lengths && num_16 < 8 && lengths[num_16] <= 2) ++num_16;
+		uint8_t num_32 = 0;
+		while (num_32 < num_lengths && num_32 < 4 && lengths[num_32] <= 3) ++num_32;
+
+		MaskedVbyteEntry& entry = masked_vbyte_table[mask];
+		memset(entry.shuffle, 0x80, sizeof(entry.shuffle));
+
+		entry.lane_bytes = (num_16 >= num_32) ? 2 : 4;
+		entry.num_ints   = (num_16 >= num_32) ? num_16 : num_32;
+
+		uint8_t byte_idx = 0;
+		for (uint8_t i = 0; i < entry.num_ints; ++i) {
+			for (uint8_t j = 0; j < lengths[i]; ++j) {
+				entry.shuffle[i * entry.lane_bytes + j] = byte_idx++;
+			}
+		}
+		entry.num_bytes = byte_idx;
+	}
+}
+
+__attribute__((target("ssse3")))
+static uint32_t decompress_uint64_differential_ssse3(
+		const uint8_t* compressed_buffer,
+		const uint8_t* end,
+		uint64_t  prev_id,
+		uint32_t  num_values,
+		uint64_t* data
+		) {
+	const uint8_t* in = compressed_buffer;
+	uint32_t idx = 0;
+
+	const __m128i low_7  = _mm_set1_epi32(0x0000007F);
+	const __m128i mid_7  = _mm_set1_epi32(0x00007F00);
+	const __m128i high_7 = _mm_set1_epi32(0x007F0000);
+
+	alignas(16) uint32_t values[4];
+	alignas(16) uint16_t values_16[8];
+
+	while (idx < num_values && in + 16 <= end) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)in);
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(bytes) & ((1 << MASKED_VBYTE_WINDOW) - 1);
+
+		const MaskedVbyteEntry& entry = masked_vbyte_table[mask];
+		if (entry.num_ints == 0 || entry.num_ints > num_values - idx) {
+			in += decompress_uint64_differential_single_bytes(in, data[idx], prev_id);
+			prev_id = data[idx++];
+			continue;
+		}
+
+		__m128i gathered = _mm_shuffle_epi8(bytes, _mm_loadu_si128((const __m128i*)entry.shuffle));
+		if (entry.lane_bytes == 2) {
+			__m128i lo = _mm_and_si128(gathered, _mm_set1_epi16(0x007F));
+			__m128i hi = _mm_srli_epi16(_mm_and_si128(gathered, _mm_set1_epi16(0x7F00)), 1);
+			_mm_store_si128((__m128i*)values_16, _mm_or_si128(lo, hi));
+
+			for (uint8_t i = 0; i < entry.num_ints; ++i) {
+				prev_id += values_16[i];
+				data[idx++] = prev_id;
+			}
+		} else {
+			__m128i b0 = _mm_and_si128(gathered, low_7);
+			__m128i b1 = _mm_srli_epi32(_mm_and_si128(gathered, mid_7), 1);
+			__m128i b2 = _mm_srli_epi32(_mm_and_si128(gathered, high_7), 2);
+			_mm_store_si128((__m128i*)values, _mm_or_si128(b0, _mm_or_si128(b1, b2)));
+
+			for (uint8_t i = 0; i < entry.num_ints; ++i) {
+				prev_id += values[i];
+				data[idx++] = prev_id;
+			}
+		}
+		in += entry.num_bytes;
+	}
+
+	// Fewer than 16 bytes left.
+	in += decompress_uint64_differential_scalar(in, end, prev_id, num_values - idx, data + idx);
+	return (uint32_t)(in - compressed_buffer);
+}
+#endif
+
+typedef uint32_t (*DifferentialDecoder)(
+		const uint8_t*, 
+		const uint8_t*, 
+		uint64_t, 
+		uint32_t, 
+		uint64_t*
+		);
+
+static DifferentialDecoder select_differential_decoder() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		init_masked_vbyte_table();
+		return decompress_uint64_differential_ssse3;
+	}
+#endif
+	return decompress_uint64_differential_scalar;
+}
+
+static const DifferentialDecoder differential_decoder = select_differential_decoder();
+
+uint32_t decompress_uint64_differential_masked(
+		const uint8_t* compressed_buffer,
+		const uint8_t* end,
+		uint64_t  prev_id,
+		uint32_t  num_values,
+		uint64_t* data
+		) {
+	return differential_decoder(compressed_buffer, end, prev_id, num_values, data);
+}
+
+void decompress_uint64_differential_masked(
+		const std::vector<uint8_t>& compressed_buffer,
+		uint64_t num_values,
+		std::vector<uint64_t>& data
+		) {
+	data.resize(num_values);
+	if (num_values == 0) return;
+
+	differential_decoder(
+			compressed_buffer.data(), 
+			compressed_buffer.data() + compressed_buffer.size(),
+			0,
+			(uint32_t)num_values,
+			data.data()
+			);
+}
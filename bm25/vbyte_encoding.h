@@ -50,6 +50,16 @@ void compress_uint64_differential_single(
 	uint64_t prev_id
 	);
 
+// Bytes written by compress_uint64_differential_single for a delta.
+inline uint64_t vbyte_size_uint64(uint64_t diff) {
+	uint64_t num_bytes = 1;
+	while (diff >= 128) {
+		diff >>= 7;
+		++num_bytes;
+	}
+	return num_bytes;
+}
+
 uint8_t compress_uint64_differential_single_bytes(
 	std::vector<uint8_t>& data,
 	uint64_t new_uncompressed_id,
@@ -57,7 +67,7 @@ uint8_t compress_uint64_differential_single_bytes(
 	);
 
 uint8_t decompress_uint64_differential_single_bytes(
-	uint8_t* data,
+	const uint8_t* data,
 	uint64_t& new_uncompressed_id,
 	uint64_t prev_id
 	);
@@ -112,3 +122,59 @@ void decompress_uint64_partial(
 	std::vector<uint64_t>& data,
 	uint32_t k
 	);
+
+
+// Block packed postings. Full blocks of PACKED_BLOCK_SIZE ids are stored as
+// one bit width byte followed by the deltas bit packed in 4 interleaved
+// 32 bit lanes, so 4 deltas are unpacked per SIMD instruction.
+// The final partial block is stored as differential vbyte.
+#define PACKED_BLOCK_SIZE 128
+
+uint32_t pack_block_differential(
+	const uint64_t* data,
+	uint64_t prev_id,
+	std::vector<uint8_t>& compressed_buffer
+	);
+
+uint32_t unpack_block_differential(
+	const uint8_t* compressed_buffer,
+	uint64_t  prev_id,
+	uint64_t* data
+	);
+
+void compress_uint64_block_packed(
+	const std::vector<uint64_t>& data,
+	std::vector<uint8_t>& compressed_buffer
+	);
+
+void decompress_uint64_block_packed(
+	const std::vector<uint8_t>& compressed_buffer,
+	uint64_t num_values,
+	std::vector<uint64_t>& data
+	);
+
+void decompress_uint64_block_packed(
+	const uint8_t* compressed_buffer,
+	uint64_t num_values,
+	std::vector<uint64_t>& data
+	);
+
+
+// Decodes num_values differential vbyte ids written by
+// compress_uint64_differential_single_bytes into absolute ids.
+// Uses a Masked VByte style SSSE3 decoder when the CPU supports it,
+// chosen at runtime, and a scalar decoder otherwise.
+// Returns the number of bytes consumed. Never reads at or past end.
+uint32_t decompress_uint64_differential_masked(
+	const uint8_t* compressed_buffer,
+	const uint8_t* end,
+	uint64_t  prev_id,
+	uint32_t  num_values,
+	uint64_t* data
+	);
+
+void decompress_uint64_differential_masked(
+	const std::vector<uint8_t>& compressed_buffer,
+	uint64_t num_values,
+	std::vector<uint64_t>& data
+	);
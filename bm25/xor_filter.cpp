@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "xor_filter.h"
+
+
+#define XOR_MAX_ATTEMPTS 64
+#define XOR_INITIAL_SEED 0x9e3779b97f4a7c15ULL
+
+
+static inline uint64_t xor_hash(uint64_t key, uint64_t seed) {
+	uint64_t hash = key + seed;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static inline uint32_t reduce(uint32_t hash, uint32_t n) {
+	return (uint32_t)(((uint64_t)hash * n) >> 32);
+}
+
+static inline uint64_t rotl64(uint64_t n, uint32_t c) {
+	return (n << c) | (n >> (64 - c));
+}
+
+// One slot in each of the three segments.
+static inline void xor_positions(uint64_t hash, uint32_t segment_length, uint32_t* positions) {
+	positions[0] = reduce((uint32_t)hash, segment_length);
+	positions[1] = reduce((uint32_t)rotl64(hash, 21), segment_length) + segment_length;
+	positions[2] = reduce((uint32_t)rotl64(hash, 42), segment_length) + 2 * segment_length;
+}
+
+static inline uint32_t xor_fingerprint(uint64_t hash) {
+	return (uint32_t)(hash ^ (hash >> 32)) & ((1U << XOR_FINGERPRINT_BITS) - 1);
+}
+
+static inline uint8_t xor_decode(uint32_t slot_xor, uint64_t hash) {
+	if ((slot_xor >> XOR_VALUE_BITS) != xor_fingerprint(hash)) return 0;
+	return (uint8_t)(slot_xor & ((1U << XOR_VALUE_BITS) - 1));
+}
+
+
+XorFilter init_xor_filter(const uint64_t* keys, const uint8_t* values, uint64_t num_keys) {
+	XorFilter filter;
+	filter.seed 		  = XOR_INITIAL_SEED;
+	filter.segment_length = (uint32_t)(XOR_LOAD_FACTOR * num_keys / 3) + 11;
+	filter.max_value 	  = 0;
+
+	const uint64_t num_slots = xor_filter_num_slots(filter);
+
+	// Per slot number of keys hashing to it and xor of their indices.
+	// A slot with one key left names that key.
+	std::vector<uint8_t>  counts(num_slots);
+	std::vector<uint64_t> key_xor(num_slots);
+	std::vector<uint32_t> queue;
+	std::vector<std::pair<uint64_t, uint32_t>> stack;
+	queue.reserve(num_slots);
+	stack.reserve(num_keys);
+
+	uint32_t positions[3];
+
+	uint32_t attempt = 0;
+	for (; attempt < XOR_MAX_ATTEMPTS; ++attempt) {
+		std::fill(counts.begin(), counts.end(), 0);
+		std::fill(key_xor.begin(), key_xor.end(), 0);
+		queue.clear();
+		stack.clear();
+
+		for (uint64_t key_idx = 0; key_idx < num_keys; ++key_idx) {
+			xor_positions(xor_hash(keys[key_idx], filter.seed), filter.segment_length, positions);
+			for (uint32_t i = 0; i < 3; ++i) {
+				++counts[positions[i]];
+				key_xor[positions[i]] ^= key_idx;
+			}
+		}
+
+		for (uint32_t slot = 0; slot < num_slots; ++slot) {
+			if (counts[slot] == 1) queue.push_back(slot);
+		}
+
+		// Peel keys owning a slot alone until none are left.
+		while (!queue.empty()) {
+			uint32_t slot = queue.back();
+			queue.pop_back();
+			if (counts[slot] != 1) continue;
+
+			uint64_t key_idx = key_xor[slot];
+			stack.push_back({key_idx, slot});
+
+			xor_positions(xor_hash(keys[key_idx], filter.seed), filter.segment_length, positions);
+			for (uint32_t i = 0; i < 3; ++i) {
+				--counts[positions[i]];
+				key_xor[positions[i]] ^= key_idx;
+				if (counts[positions[i]] == 1) queue.push_back(positions[i]);
+			}
+		}
+
+		if (stack.size() == num_keys) break;
+		++filter.seed;
+	}
+
+	if (attempt == XOR_MAX_ATTEMPTS) {
+		std::cerr << "Error: could not construct xor filter over " << num_keys << " keys." << std::endl;
+		exit(1);
+	}
+
+	// Assign in reverse peeling order. The owned slot is the last of the
+	// three to be written, so it can absorb the xor of the other two.
+	filter.slots = (uint32_t*)calloc(num_slots, sizeof(uint32_t));
+	for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+		const auto& [key_idx, slot] = *it;
+
+		uint64_t hash = xor_hash(keys[key_idx], filter.seed);
+		xor_positions(hash, filter.segment_length, positions);
+
+		uint32_t encoded = (xor_fingerprint(hash) << XOR_VALUE_BITS) | values[key_idx];
+		filter.slots[slot] = encoded ^ filter.slots[positions[0]] ^ filter.slots[positions[1]] ^ filter.slots[positions[2]];
+
+		filter.max_value = std::max(filter.max_value, values[key_idx]);
+	}
+
+	return filter;
+}
+
+void xor_filter_free(XorFilter& filter) {
+	free(filter.slots);
+	filter.slots 		  = nullptr;
+	filter.segment_length = 0;
+}
+
+uint8_t xor_filter_get(const XorFilter& filter, uint64_t key) {
+	uint64_t hash = xor_hash(key, filter.seed);
+
+	uint32_t positions[3];
+	xor_positions(hash, filter.segment_length, positions);
+
+	return xor_decode(
+			filter.slots[positions[0]] ^ filter.slots[positions[1]] ^ filter.slots[positions[2]],
+			hash
+			);
+}
+
+void xor_filter_get_batch(
+		const XorFilter& filter,
+		const uint64_t* keys,
+		uint64_t num_keys,
+		uint8_t* out_values
+		) {
+	uint64_t hashes[XOR_BATCH_SIZE];
+	uint32_t positions[XOR_BATCH_SIZE][3];
+
+	for (uint64_t base = 0; base < num_keys; base += XOR_BATCH_SIZE) {
+		uint64_t batch_size = std::min((uint64_t)XOR_BATCH_SIZE, num_keys - base);
+
+		for (uint64_t j = 0; j < batch_size; ++j) {
+			hashes[j] = xor_hash(keys[base + j], filter.seed);
+			xor_positions(hashes[j], filter.segment_length, positions[j]);
+			for (uint32_t i = 0; i < 3; ++i) {
+				__builtin_prefetch(&filter.slots[positions[j][i]]);
+			}
+		}
+		for (uint64_t j = 0; j < batch_size; ++j) {
+			out_values[base + j] = xor_decode(
+					filter.slots[positions[j][0]] ^ filter.slots[positions[j][1]] ^ filter.slots[positions[j][2]],
+					hashes[j]
+					);
+		}
+	}
+}
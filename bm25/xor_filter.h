@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Static map from key to a small value. 3-wise xor filter (Graf & Lemire)
+// whose slots hold fingerprint ^ value. A lookup touches three slots and
+// returns the value of a stored key, or 0 for a key that was not stored
+// unless its fingerprint collides (rate 2^-XOR_FINGERPRINT_BITS).
+#define XOR_VALUE_BITS 8
+#define XOR_FINGERPRINT_BITS 24
+
+// Slots per key. Peeling succeeds with high probability above ~1.22.
+#define XOR_LOAD_FACTOR 1.23
+
+typedef struct {
+	uint64_t  seed;
+	uint32_t  segment_length;	// Slots are 3 * segment_length.
+	uint8_t   max_value;
+	uint32_t* slots;
+} XorFilter;
+
+// values must be nonzero and fit in XOR_VALUE_BITS. keys must be distinct.
+XorFilter init_xor_filter(const uint64_t* keys, const uint8_t* values, uint64_t num_keys);
+void xor_filter_free(XorFilter& filter);
+
+uint8_t xor_filter_get(const XorFilter& filter, uint64_t key);
+
+// out_values[i] = xor_filter_get(filter, keys[i]). Slots of
+// XOR_BATCH_SIZE keys are prefetched before any is read.
+#define XOR_BATCH_SIZE 32
+void xor_filter_get_batch(
+		const XorFilter& filter,
+		const uint64_t* keys,
+		uint64_t num_keys,
+		uint8_t* out_values
+		);
+
+inline uint64_t xor_filter_num_slots(const XorFilter& filter) {
+	return 3 * (uint64_t)filter.segment_length;
+}
+
+inline double xor_filter_fpr() {
+	return 1.0 / (double)(1ULL << XOR_FINGERPRINT_BITS);
+}
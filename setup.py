@@ -15,6 +15,10 @@ COMPILER_FLAGS = [
     "-ffast-math",
 ]
 
+## Count heap allocations. See bm25/alloc_counter.h.
+if os.environ.get("BLOOM25_COUNT_ALLOCS"):
+    COMPILER_FLAGS += ["-DCOUNT_ALLOCS"]
+
 '''
 COMPILER = "clang++"
 ## COMPILER = "g++"
@@ -45,7 +49,7 @@ LINK_ARGS = [
 extensions = [
     Extension(
         MODULE_NAME,
-        sources=["bm25/bm25.pyx", "bm25/engine.cpp", "bm25/vbyte_encoding.cpp", "bm25/serialize.cpp", "bm25/bloom.cpp"],
+        sources=["bm25/bm25.pyx", "bm25/engine.cpp", "bm25/vbyte_encoding.cpp", "bm25/serialize.cpp", "bm25/bloom.cpp", "bm25/xor_filter.cpp", "bm25/bitmap.cpp", "bm25/norms.cpp", "bm25/thread_pool.cpp", "bm25/accumulator.cpp", "bm25/alloc_counter.cpp", "bm25/arena.cpp", "bm25/score_kernel.cpp", "bm25/posting_cursor.cpp", "bm25/impact_index.cpp", "bm25/planner.cpp", "bm25/term_dictionary.cpp", "bm25/posting_arena.cpp"],
         extra_compile_args=COMPILER_FLAGS,
         language="c++",
         include_dirs=["bm25"],
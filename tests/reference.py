@@ -0,0 +1,78 @@
+import math
+from collections import Counter
+
+
+## Doc lengths are stored as one byte norms. Lengths below 24 are exact.
+def norm_encode(length: int) -> int:
+    if length < 24:
+        return length
+    value = length - 24
+    num_bits = value.bit_length()
+    if num_bits < 4:
+        return 24 + value
+    shift = num_bits - 4
+    return 24 + (((value >> shift) & 7) | ((shift + 1) << 3))
+
+
+def norm_decode(norm: int) -> int:
+    if norm < 24:
+        return norm
+    norm -= 24
+    exponent, bits = norm >> 3, norm & 7
+    if exponent == 0:
+        return 24 + bits
+    return 24 + ((bits | 8) << (exponent - 1))
+
+class ReferenceBM25:
+    ## Exhaustive BM25 over whitespace split, uppercased docs, with the
+    ## statistics of the whole collection, as in the engine.
+    def __init__(self, documents, k1: float = 1.2, b: float = 0.4):
+        self.k1 = k1
+        self.b  = b
+        self.docs = [Counter(doc.upper().split()) for doc in documents]
+        self.doc_lengths = [sum(tfs.values()) for tfs in self.docs]
+        ## avgdl is taken from the exact lengths, each doc's length from its norm.
+        self.norm_lengths = [norm_decode(norm_encode(length)) for length in self.doc_lengths]
+
+        self.doc_freqs = Counter()
+        for tfs in self.docs:
+            self.doc_freqs.update(tfs.keys())
+        self.avg_doc_len = sum(self.doc_lengths) / max(len(self.docs), 1)
+
+    def scores(self, query: str) -> dict:
+        terms = query.upper().split()
+        num_docs = len(self.docs)
+        scores = {}
+        for doc_id, tfs in enumerate(self.docs):
+            score = 0.0
+            hit = False
+            for term in terms:
+                tf = tfs.get(term, 0)
+                if tf == 0:
+                    continue
+                df  = self.doc_freqs[term]
+                idf = math.log((num_docs - df + 0.5) / (df + 0.5))
+                norm = self.k1 * (1 - self.b + self.b * self.norm_lengths[doc_id] / self.avg_doc_len)
+                score += idf * tf / (tf + norm)
+                hit = True
+            if hit:
+                scores[doc_id] = score
+        return scores
+
+    def topk_scores(self, query: str, k: int) -> list:
+        return sorted(self.scores(query).values(), reverse=True)[:k]
+
+
+def assert_matches_reference(reference, query, scores, indices, k, tol=1e-3):
+    ## Ties may be broken in any order, so every returned doc is checked
+    ## against its own reference score and the score lists are compared.
+    expected = reference.scores(query)
+    topk     = sorted(expected.values(), reverse=True)[:k]
+
+    assert len(scores) == len(topk), (query, k, len(scores), len(topk))
+    assert len(set(indices)) == len(indices), (query, "duplicate doc ids", indices)
+    for score, ref_score in zip(scores, topk):
+        assert abs(score - ref_score) < tol, (query, scores[:5], topk[:5])
+    for score, doc_id in zip(scores, indices):
+        assert doc_id in expected, (query, doc_id, "scored but has no query term")
+        assert abs(score - expected[doc_id]) < tol, (query, doc_id, score, expected[doc_id])
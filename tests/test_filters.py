@@ -0,0 +1,222 @@
+from bloom25 import BM25
+import csv
+import math
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+from reference import ReferenceBM25
+from test_query_modes import QUERY_MODES, make_zipf_docs, assert_same_results, check_modes_exact
+
+
+FILTER_TYPES = ["standard", "blocked", "xor"]
+SCORE_TOL    = 1e-4
+
+
+def write_csv(filename: str, documents):
+    with open(filename, "w", newline="") as f:
+        writer = csv.writer(f, lineterminator="\n")
+        writer.writerow(["id", "text"])
+        for idx, doc in enumerate(documents):
+            writer.writerow([idx, doc])
+
+
+def save_and_load(model, db_dir: str):
+    model.save(db_dir)
+    loaded = BM25()
+    loaded.load(db_dir)
+    return loaded
+
+
+def check_same_results(model, loaded, queries, context, k: int = 10):
+    for mode in QUERY_MODES:
+        model.set_query_mode(mode)
+        loaded.set_query_mode(mode)
+        for query in queries:
+            assert_same_results(
+                    loaded.get_topk_indices(query, k=k),
+                    model.get_topk_indices(query, k=k),
+                    (context, mode, query)
+                    )
+    model.set_query_mode("bloom")
+    loaded.set_query_mode("bloom")
+
+
+def assert_scores_close(scores, expected, context):
+    assert len(scores) == len(expected), (context, len(scores), len(expected))
+    for score, expected_score in zip(scores, expected):
+        assert abs(score - expected_score) < SCORE_TOL, (context, scores[:5], expected[:5])
+
+
+def test_filter_types():
+    ## Filter types differ only in their false positives, which are rare at
+    ## the default bloom_fpr and at the 2^-24 rate of xor filters, so every
+    ## type returns the same results.
+    documents, queries, frequent_queries = make_zipf_docs(seed=1)
+    queries = queries + frequent_queries
+
+    expected = {}
+    for filter_type in FILTER_TYPES:
+        model = BM25(num_partitions=4, bloom_filter_type=filter_type)
+        model.index_documents(documents)
+        for mode in QUERY_MODES:
+            model.set_query_mode(mode)
+            for query in queries:
+                scores, _ = model.get_topk_indices(query, k=10)
+                if (mode, query) not in expected:
+                    expected[(mode, query)] = scores
+                assert_scores_close(scores, expected[(mode, query)], (filter_type, mode, query))
+
+
+def test_bloom_doc_scores():
+    ## Bloom terms are only probed for the candidate docs, so a doc may be
+    ## missed, but every returned doc carries its exact score.
+    documents, queries, frequent_queries = make_zipf_docs(seed=7)
+    reference = ReferenceBM25(documents)
+
+    for filter_type in FILTER_TYPES:
+        model = BM25(num_partitions=4, bloom_filter_type=filter_type)
+        model.index_documents(documents)
+        for query in queries + frequent_queries:
+            expected = reference.scores(query)
+            scores, indices = model.get_topk_indices(query, k=100)
+            assert len(scores) > 0, (filter_type, query)
+            for score, doc_id in zip(scores, indices):
+                assert abs(score - expected.get(doc_id, 0.0)) < 1e-3, (filter_type, query, doc_id, score)
+
+
+def test_bloom_term_scores_one_tf():
+    ## At a high bloom_fpr a doc often hits several tf filters of a term. The
+    ## term still adds the score of one tf, so a doc never scores above the
+    ## bound the pruned modes skip docs with.
+    rng = random.Random(5)
+    documents = []
+    for _ in range(3000):
+        terms = [f"rare{rng.randrange(100)}" for _ in range(rng.randint(1, 3))]
+        if rng.random() < 0.3:
+            terms += ["common"] * rng.randint(1, 6)
+        terms += [f"filler{rng.randrange(2000)}" for _ in range(rng.randint(0, 8))]
+        rng.shuffle(terms)
+        documents.append(" ".join(terms))
+    reference = ReferenceBM25(documents)
+
+    num_docs = len(documents)
+    df  = reference.doc_freqs["COMMON"]
+    idf = math.log((num_docs - df + 0.5) / (df + 0.5))
+
+    for filter_type in ("standard", "blocked"):
+        model = BM25(
+                bloom_df_threshold=200,
+                bloom_fpr=0.5,
+                num_partitions=2,
+                bloom_filter_type=filter_type
+                )
+        model.index_documents(documents)
+        for mode in ("maxscore", "bmw"):
+            model.set_query_mode(mode)
+            for rare_idx in range(20):
+                rare_scores = reference.scores(f"rare{rare_idx}")
+                scores, indices = model.get_topk_indices(f"rare{rare_idx} common", k=50)
+                for score, doc_id in zip(scores, indices):
+                    norm = reference.k1 * (1 - reference.b + reference.b * reference.norm_lengths[doc_id] / reference.avg_doc_len)
+                    allowed = [rare_scores[doc_id]] + [
+                        rare_scores[doc_id] + idf * tf / (tf + norm) for tf in range(1, 7)
+                    ]
+                    assert min(abs(score - a) for a in allowed) < 1e-3, (filter_type, mode, rare_idx, doc_id, score, allowed)
+
+
+def test_bitmap_terms_exact():
+    ## The most frequent terms are stored as bitmaps, so queries made only of
+    ## them are scored exhaustively at the default threshold.
+    documents, _, frequent_queries = make_zipf_docs(seed=8)
+    reference = ReferenceBM25(documents)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        for filter_type in FILTER_TYPES:
+            model = BM25(num_partitions=2, bloom_filter_type=filter_type)
+            model.index_documents(documents)
+            check_modes_exact(model, reference, frequent_queries)
+
+            loaded = save_and_load(model, os.path.join(tmp_dir, f"db_{filter_type}"))
+            check_modes_exact(loaded, reference, frequent_queries, ks=(10,))
+
+
+def test_save_load_round_trip():
+    documents, queries, frequent_queries = make_zipf_docs(seed=3)
+    queries = queries + frequent_queries
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        for filter_type in FILTER_TYPES:
+            for posting_format in ("vbyte", "block"):
+                model = BM25(
+                        num_partitions=3,
+                        posting_format=posting_format,
+                        bloom_filter_type=filter_type
+                        )
+                model.index_documents(documents)
+                loaded = save_and_load(model, os.path.join(tmp_dir, f"db_{filter_type}_{posting_format}"))
+                check_same_results(model, loaded, queries, (filter_type, posting_format))
+
+        ## Doc freqs and partition sizes are saved as well.
+        reference = ReferenceBM25(documents)
+        model = BM25(bloom_df_threshold=1e9, num_partitions=3)
+        model.index_documents(documents)
+        loaded = save_and_load(model, os.path.join(tmp_dir, "db_exact"))
+        check_modes_exact(loaded, reference, queries, ks=(10,))
+
+
+def test_save_load_csv():
+    documents, queries, frequent_queries = make_zipf_docs(num_docs=1000, seed=4)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, "docs.csv")
+        write_csv(filename, documents)
+
+        model = BM25(num_partitions=2)
+        model.index_file(filename, ["text"])
+        loaded = save_and_load(model, os.path.join(tmp_dir, "db"))
+        for query in queries + frequent_queries:
+            rows   = model.get_topk_docs(query, k=10)
+            loaded_rows = loaded.get_topk_docs(query, k=10)
+            assert [row["score"] for row in rows] == [row["score"] for row in loaded_rows], query
+
+
+def test_load_checks_format():
+    ## metadata.bin starts with a magic and a format version. An index of
+    ## another format fails to load with an error naming both versions.
+    documents, _, _ = make_zipf_docs(seed=4)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        db_dir = os.path.join(tmp_dir, "db")
+        model  = BM25(num_partitions=2)
+        model.index_documents(documents)
+        model.save(db_dir)
+
+        metadata_path = os.path.join(db_dir, "metadata.bin")
+        with open(metadata_path, "rb") as f:
+            metadata = f.read()
+        assert metadata[:8] == b"BLOOM25I", metadata[:8]
+
+        load = f"from bloom25 import BM25; BM25().load({db_dir!r})"
+        for header, message in (
+                (b"BLOOM25I" + (99).to_bytes(4, "little"), "has index format 99"),
+                (b"\0" * 12, "is not a saved index"),
+                ):
+            with open(metadata_path, "wb") as f:
+                f.write(header + metadata[12:])
+            process = subprocess.run([sys.executable, "-c", load], capture_output=True, text=True)
+            assert process.returncode != 0, process
+            assert message in process.stderr, process.stderr
+
+
+if __name__ == '__main__':
+    test_filter_types()
+    test_bloom_doc_scores()
+    test_bloom_term_scores_one_tf()
+    test_bitmap_terms_exact()
+    test_save_load_round_trip()
+    test_save_load_csv()
+    test_load_checks_format()
+    print("All filter tests passed.")
@@ -0,0 +1,133 @@
+from bloom25 import BM25
+import csv
+import json
+import os
+import tempfile
+
+from reference import ReferenceBM25, assert_matches_reference
+
+
+## Terms the engine and str.upper() uppercase the same way.
+WORDS = ["ALPHA", "日本語", "ÉCOLE", "Ω", "x"]
+
+POSTING_BUILDS = ["append", "two_pass"]
+
+
+def make_boundary_docs():
+    ## The tokenizer classifies 16 or 32 bytes at a time. Separators and
+    ## multi byte UTF-8 terms land on either side of the 16, 32 and 64 byte
+    ## boundaries, and some fields are empty or only spaces.
+    documents = []
+    for length in range(1, 70):
+        prefix = "a" * length
+        for word in WORDS:
+            documents.append(f"{prefix} {word} {prefix}{word}")
+            documents.append(f"{word}{prefix}  {word}")
+    documents += ["", " ", "  x  ", "x" * 100, "ALPHA" + " " * 40 + "ALPHA"]
+
+    queries = WORDS + [
+        "a" * length for length in (1, 15, 16, 17, 31, 32, 33, 63, 64, 65)
+    ] + [
+        "a" * 31 + "日本語", "ÉCOLE" + "a" * 16, "x" * 100, "ALPHA x Ω",
+    ]
+    return documents, queries
+
+
+def write_csv(filename: str, documents, quoting=csv.QUOTE_MINIMAL):
+    with open(filename, "w", newline="", encoding="utf-8") as f:
+        ## The header is matched unquoted; only the rows use `quoting`.
+        f.write("id,text\n")
+        writer = csv.writer(f, lineterminator="\n", quoting=quoting)
+        for idx, doc in enumerate(documents):
+            writer.writerow([idx, doc])
+
+
+def write_json(filename: str, documents):
+    with open(filename, "w", encoding="utf-8") as f:
+        for idx, doc in enumerate(documents):
+            f.write(json.dumps({"id": str(idx), "text": doc}, ensure_ascii=False) + "\n")
+
+
+def check_file_index(model, reference, queries, context, match_ids: bool = True, k: int = 1000):
+    for query in queries:
+        expected = reference.scores(query)
+        rows = model.get_topk_docs(query, k=k)
+        assert len(rows) == min(k, len(expected)), (context, query, len(rows), len(expected))
+
+        scores = sorted((float(row["score"]) for row in rows), reverse=True)
+        expected_scores = sorted(expected.values(), reverse=True)[:k]
+        for score, expected_score in zip(scores, expected_scores):
+            assert abs(score - expected_score) < 1e-3, (context, query, score, expected_score)
+
+        ## Returned rows are matched to docs through their id column.
+        if not match_ids:
+            continue
+        for row in rows:
+            doc_id = int(row["id"])
+            assert doc_id in expected, (context, query, doc_id)
+            assert abs(float(row["score"]) - expected[doc_id]) < 1e-3, (context, query, row, expected[doc_id])
+
+
+def test_in_memory():
+    documents, queries = make_boundary_docs()
+    reference = ReferenceBM25(documents)
+
+    for posting_build in POSTING_BUILDS:
+        for num_partitions in (1, 3):
+            model = BM25(
+                    bloom_df_threshold=1e9,
+                    num_partitions=num_partitions,
+                    posting_build=posting_build
+                    )
+            model.index_documents(documents)
+            for query in queries:
+                scores, indices = model.get_topk_indices(query, k=1000)
+                assert_matches_reference(reference, query, scores, indices, 1000)
+
+
+def test_csv():
+    documents, queries = make_boundary_docs()
+    reference = ReferenceBM25(documents)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        for quoting in (csv.QUOTE_MINIMAL, csv.QUOTE_ALL):
+            filename = os.path.join(tmp_dir, f"docs_{quoting}.csv")
+            write_csv(filename, documents, quoting)
+            for posting_build in POSTING_BUILDS:
+                for num_partitions in (1, 3):
+                    model = BM25(
+                            bloom_df_threshold=1e9,
+                            num_partitions=num_partitions,
+                            posting_build=posting_build
+                            )
+                    model.index_file(filename, ["text"])
+                    check_file_index(model, reference, queries, (quoting, posting_build, num_partitions))
+
+
+def test_json():
+    documents, queries = make_boundary_docs()
+    ## JSON escapes quotes and backslashes, which the tokenizer unescapes.
+    documents += ['say "hi"', 'back\\slash', 'end\\']
+    queries += ['"HI"', 'BACK\\SLASH', 'END\\']
+    reference = ReferenceBM25(documents)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, "docs.json")
+        write_json(filename, documents)
+        for posting_build in POSTING_BUILDS:
+            for num_partitions in (1, 3):
+                model = BM25(
+                        bloom_df_threshold=1e9,
+                        num_partitions=num_partitions,
+                        posting_build=posting_build
+                        )
+                model.index_file(filename, ["text"])
+                ## JSON rows are not split into columns, so only scores are compared.
+                check_file_index(model, reference, queries, (posting_build, num_partitions), match_ids=False)
+
+
+if __name__ == '__main__':
+    test_in_memory()
+    test_csv()
+    test_json()
+    print("All ingest tests passed.")
@@ -0,0 +1,123 @@
+from bloom25 import BM25
+import csv
+import os
+import random
+import tempfile
+
+from reference import ReferenceBM25, assert_matches_reference
+
+
+## Lists of at most 8 doc id bytes and 2 tf runs are stored inline in their
+## entry. Short lists with more runs live in the arena, with their runs
+## following the padded doc id bytes.
+QUERY_MODES = ["bloom", "streaming", "maxscore", "bmw", "impact", "taat", "auto"]
+
+
+def make_small_list_docs(num_docs: int = 400, seed: int = 0):
+    rng = random.Random(seed)
+    docs = [[] for _ in range(num_docs)]
+
+    ## Terms of df 1 to 12 spread over nearby docs with varying tfs, so their
+    ## lists have 1 to 12 doc id bytes and up to as many runs.
+    small_terms = []
+    for term_idx in range(300):
+        term = f"small{term_idx}"
+        df   = rng.randint(1, 12)
+        start = rng.randrange(num_docs - 40)
+        for doc_id in rng.sample(range(start, start + 40), df):
+            docs[doc_id].extend([term] * rng.randint(1, 4))
+        small_terms.append(term)
+
+    ## Filler so docs differ in length and some lists span many blocks.
+    filler = [f"fill{idx}" for idx in range(20)]
+    for doc in docs:
+        doc.extend(rng.choices(filler, k=rng.randint(1, 30)))
+        rng.shuffle(doc)
+
+    documents = [' '.join(doc) for doc in docs]
+    queries = [' '.join(rng.sample(small_terms, rng.randint(1, 3))) for _ in range(60)]
+    queries += [f"{rng.choice(small_terms)} {rng.choice(filler)}" for _ in range(20)]
+    return documents, queries
+
+
+def topk(model, query: str, k: int, from_file: bool):
+    if not from_file:
+        return model.get_topk_indices(query, k=k)
+
+    ## Doc ids of a file index are local to their partition, so rows are
+    ## matched through their id column.
+    rows = model.get_topk_docs(query, k=k)
+    return [float(row["score"]) for row in rows], [int(row["id"]) for row in rows]
+
+
+def check_model(model, reference, queries, k: int = 10, from_file: bool = False):
+    for mode in QUERY_MODES:
+        model.set_query_mode(mode)
+        for query in queries:
+            scores, indices = topk(model, query, k, from_file)
+            assert_matches_reference(reference, query, scores, indices, k)
+    model.set_query_mode("bloom")
+
+
+def test_multi_run_short_list():
+    ## foo has 3 doc id bytes and 3 runs, so it is not inline.
+    documents = ["foo bar", "foo foo baz", "foo qux"] + [f"filler{idx}" for idx in range(20)]
+    reference = ReferenceBM25(documents)
+
+    for posting_build in ("append", "two_pass"):
+        model = BM25(bloom_df_threshold=1e9, num_partitions=1, posting_build=posting_build)
+        model.index_documents(documents)
+        check_model(model, reference, ["foo", "foo bar", "baz qux"])
+
+
+def test_small_lists_in_memory():
+    documents, queries = make_small_list_docs()
+    reference = ReferenceBM25(documents)
+
+    for posting_build in ("append", "two_pass"):
+        for posting_format in ("vbyte", "block"):
+            for num_partitions in (1, 3):
+                model = BM25(
+                        bloom_df_threshold=1e9,
+                        num_partitions=num_partitions,
+                        posting_format=posting_format,
+                        posting_build=posting_build
+                        )
+                model.index_documents(documents)
+                check_model(model, reference, queries)
+
+
+def test_small_lists_csv_and_reload():
+    documents, queries = make_small_list_docs(seed=1)
+    reference = ReferenceBM25(documents)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, "docs.csv")
+        with open(filename, "w", newline="") as f:
+            writer = csv.writer(f, lineterminator="\n")
+            writer.writerow(["id", "text"])
+            for idx, doc in enumerate(documents):
+                writer.writerow([idx, doc])
+
+        for posting_build in ("append", "two_pass"):
+            for num_partitions in (1, 3, 4):
+                model = BM25(
+                        bloom_df_threshold=1e9,
+                        num_partitions=num_partitions,
+                        posting_build=posting_build
+                        )
+                model.index_file(filename, ["text"])
+                check_model(model, reference, queries, from_file=True)
+
+                db_dir = os.path.join(tmp_dir, f"db_{posting_build}_{num_partitions}")
+                model.save(db_dir)
+                loaded = BM25()
+                loaded.load(db_dir)
+                check_model(loaded, reference, queries, from_file=True)
+
+
+if __name__ == '__main__':
+    test_multi_run_short_list()
+    test_small_lists_in_memory()
+    test_small_lists_csv_and_reload()
+    print("All posting layout tests passed.")
@@ -0,0 +1,408 @@
+from bloom25 import BM25, alloc_count
+import random
+
+from reference import ReferenceBM25, assert_matches_reference
+
+
+QUERY_MODES = ["bloom", "streaming", "maxscore", "bmw", "impact", "taat", "auto"]
+
+
+def make_zipf_docs(num_docs: int = 4000, seed: int = 0):
+    ## Zipf distributed terms, so queries mix high and low df terms.
+    rng = random.Random(seed)
+    vocab = [
+        'w' + ''.join(rng.choice('abcdefghij') for _ in range(5))
+        for _ in range(2000)
+    ]
+    weights = [1.0 / (idx + 1) ** 1.1 for idx in range(len(vocab))]
+
+    documents = [
+        ' '.join(rng.choices(vocab, weights, k=rng.randint(3, 40)))
+        for _ in range(num_docs)
+    ]
+    queries = [
+        ' '.join(rng.choices(vocab, weights, k=rng.randint(1, 5)))
+        for _ in range(40)
+    ]
+    ## Only the most frequent terms.
+    frequent_queries = [
+        ' '.join(rng.sample(vocab[:6], rng.randint(1, 3)))
+        for _ in range(10)
+    ]
+    return documents, queries, frequent_queries
+
+
+def assert_same_results(results, expected, context, tol=1e-5):
+    ## Equal scores merge from partitions in any order, so ties may swap, and
+    ## docs tied with the k-th score may be swapped for other tied docs. The
+    ## shared threshold changes which terms a pruned path sums first, so
+    ## scores may differ in the last bits.
+    scores, indices = results
+    expected_scores, expected_indices = expected
+    assert len(scores) == len(expected_scores), (context, len(scores), len(expected_scores))
+    for score, expected_score in zip(scores, expected_scores):
+        assert abs(score - expected_score) < tol, (context, scores[:5], expected_scores[:5])
+    if len(scores) == 0:
+        return
+    kth_score = scores[-1] + tol
+    above = {doc_id for score, doc_id in zip(scores, indices) if score > kth_score}
+    expected_above = {doc_id for score, doc_id in zip(expected_scores, expected_indices) if score > kth_score}
+    assert above == expected_above, (context, indices[:5], expected_indices[:5])
+
+
+def check_exact(model, reference, queries, ks=(1, 10, 100)):
+    for k in ks:
+        for query in queries:
+            scores, indices = model.get_topk_indices(query, k=k)
+            assert_matches_reference(reference, query, scores, indices, k)
+
+
+def check_modes_exact(model, reference, queries, ks=(1, 10, 100)):
+    for mode in QUERY_MODES:
+        model.set_query_mode(mode)
+        check_exact(model, reference, queries, ks)
+    model.set_query_mode("bloom")
+
+
+def test_query_threads():
+    ## Results do not depend on how partitions are spread over the workers.
+    documents, queries, frequent_queries = make_zipf_docs()
+    reference = ReferenceBM25(documents)
+
+    for num_partitions in (1, 3):
+        for num_query_threads, pin_query_threads in ((0, False), (1, False), (2, True), (8, False)):
+            model = BM25(
+                    bloom_df_threshold=1e9,
+                    num_partitions=num_partitions,
+                    num_query_threads=num_query_threads,
+                    pin_query_threads=pin_query_threads
+                    )
+            model.index_documents(documents)
+            check_exact(model, reference, queries + frequent_queries)
+
+
+def test_modes_match_reference():
+    documents, queries, frequent_queries = make_zipf_docs()
+    reference = ReferenceBM25(documents)
+
+    for num_partitions in (1, 3):
+        for posting_format in ("vbyte", "block"):
+            for posting_build in ("append", "two_pass"):
+                model = BM25(
+                        bloom_df_threshold=1e9,
+                        num_partitions=num_partitions,
+                        posting_format=posting_format,
+                        posting_build=posting_build
+                        )
+                model.index_documents(documents)
+                check_modes_exact(model, reference, queries + frequent_queries)
+
+
+def test_partition_count():
+    ## Statistics are global, so a doc scores the same for any number of
+    ## partitions.
+    documents, queries, frequent_queries = make_zipf_docs(seed=9)
+    reference = ReferenceBM25(documents)
+
+    for num_partitions in (2, 5, 7):
+        model = BM25(bloom_df_threshold=1e9, num_partitions=num_partitions)
+        model.index_documents(documents)
+        check_modes_exact(model, reference, queries + frequent_queries, ks=(10,))
+
+
+def test_empty_partitions():
+    ## With fewer docs than partitions, the first partitions are empty and
+    ## must not change the global statistics.
+    documents = [
+        "alpha beta", "beta gamma gamma", "delta", "alpha alpha beta delta",
+        "epsilon", "beta epsilon epsilon",
+    ]
+    queries   = ["alpha", "beta", "gamma delta", "alpha beta gamma delta"]
+    reference = ReferenceBM25(documents)
+
+    for num_partitions in (5, 8):
+        model = BM25(bloom_df_threshold=1e9, num_partitions=num_partitions)
+        model.index_documents(documents)
+        check_modes_exact(model, reference, queries, ks=(1, 10))
+
+
+def test_shared_threshold():
+    ## With one worker, partitions run in turn, so later partitions of a
+    ## query start from the k-th score of earlier ones.
+    documents, queries, frequent_queries = make_zipf_docs(seed=10)
+    reference = ReferenceBM25(documents)
+
+    model = BM25(bloom_df_threshold=1e9, num_partitions=8, num_query_threads=1)
+    model.index_documents(documents)
+    for mode in ("streaming", "maxscore", "bmw"):
+        model.set_query_mode(mode)
+        model.threshold_stats(reset=True)
+        check_exact(model, reference, queries + frequent_queries, ks=(1, 10))
+
+        stats = model.threshold_stats(reset=True)
+        assert stats["threshold_raises"] > 0, (mode, stats)
+        assert stats["docs_skipped"] > 0, (mode, stats)
+        assert all(value == 0 for value in model.threshold_stats().values()), mode
+    model.set_query_mode("bloom")
+
+    ## Frequent terms in bloom filters. Candidates of low df terms are
+    ## probed in batches, raising and adopting the threshold as they go.
+    model = BM25(num_partitions=8, num_query_threads=1)
+    model.index_documents(documents)
+    model.threshold_stats(reset=True)
+    check_exact(model, reference, queries + frequent_queries, ks=(1, 10))
+
+    stats = model.threshold_stats(reset=True)
+    assert stats["threshold_raises"] > 0, stats
+    assert stats["candidates_skipped"] + stats["bloom_probes_skipped"] > 0, stats
+
+
+def test_long_docs():
+    ## Lengths from 24 on are rounded to one byte norms. Term freqs stay
+    ## below 256, the largest stored tf.
+    rng = random.Random(11)
+    vocab = ['w%d' % idx for idx in range(300)]
+    weights = [1.0 / (idx + 1) for idx in range(len(vocab))]
+    documents = [
+        ' '.join(rng.choices(vocab, weights, k=rng.choice((1, 23, 24, 25, rng.randint(2, 1000)))))
+        for _ in range(3000)
+    ]
+    queries = ['w0', 'w5 w17', 'w250', 'w3 w150 w299', 'w1 w2 w3']
+    reference = ReferenceBM25(documents)
+
+    for posting_format in ("vbyte", "block"):
+        model = BM25(bloom_df_threshold=1e9, num_partitions=3, posting_format=posting_format)
+        model.index_documents(documents)
+        check_modes_exact(model, reference, queries)
+
+
+def test_impact_budget():
+    ## A budget of 0 reads until the top-k is settled. A small budget returns
+    ## partial scores, which never exceed the exact ones.
+    documents, queries, frequent_queries = make_zipf_docs(seed=12)
+    queries = queries + frequent_queries
+    reference = ReferenceBM25(documents)
+
+    model = BM25(bloom_df_threshold=1e9, num_partitions=2)
+    model.index_documents(documents)
+    model.set_query_mode("impact", impact_budget=0)
+    check_exact(model, reference, queries, ks=(10,))
+
+    model.set_query_mode("impact", impact_budget=200)
+    num_found, num_expected = 0, 0
+    for query in queries:
+        expected = reference.scores(query)
+        if max(expected.values(), default=-1.0) <= 0.0:
+            continue
+        expected_ids = set(sorted(expected, key=expected.get, reverse=True)[:10])
+        scores, indices = model.get_topk_indices(query, k=10)
+        assert 0 < len(scores) <= 10, query
+        for score, doc_id in zip(scores, indices):
+            assert score <= expected[doc_id] + 1e-3, (query, doc_id, score, expected[doc_id])
+        num_found    += len(expected_ids & set(indices))
+        num_expected += len(expected_ids)
+    assert num_found >= 0.5 * num_expected, (num_found, num_expected)
+    model.set_query_mode("bloom")
+
+
+def test_impact_fallbacks():
+    ## "common" is in more than half the docs, so its idf is negative and
+    ## partial scores are no lower bound. Such partitions run "bmw" instead.
+    rng = random.Random(16)
+    documents = [
+        ' '.join(rng.choices(['common'] * 3 + ['rare%d' % (idx % 40)], k=rng.randint(1, 8)))
+        for idx in range(2000)
+    ]
+    reference = ReferenceBM25(documents)
+
+    model = BM25(bloom_df_threshold=1e9, num_partitions=4)
+    model.index_documents(documents)
+    model.set_query_mode("impact")
+    model.impact_fallbacks(reset=True)
+
+    check_exact(model, reference, ["rare3", "rare7 rare12"], ks=(1, 10))
+    assert model.impact_fallbacks() == 0
+
+    check_exact(model, reference, ["common", "common rare5"], ks=(1, 10))
+    assert model.impact_fallbacks(reset=True) == 2 * 2 * 4
+    assert model.impact_fallbacks() == 0
+    model.set_query_mode("bloom")
+
+
+def test_warm_queries_do_not_allocate():
+    ## Needs a build with BLOOM25_COUNT_ALLOCS=1, otherwise alloc_count()
+    ## stays 0. One worker, so every partition reuses the same scratch and
+    ## the warm up rounds reach its final capacity.
+    documents, queries, frequent_queries = make_zipf_docs(seed=13)
+    queries = queries + frequent_queries
+
+    num_allocs = alloc_count()
+    model = BM25(num_partitions=4, num_query_threads=1)
+    model.index_documents(documents)
+    if alloc_count() == 0:
+        print("alloc_count() is not compiled in, skipping test_warm_queries_do_not_allocate.")
+        return
+    assert alloc_count() > num_allocs
+
+    for mode in QUERY_MODES:
+        model.set_query_mode(mode)
+        for _ in range(2):
+            for query in queries:
+                model.get_topk_indices(query, k=100)
+
+        num_allocs = alloc_count()
+        for query in queries:
+            model.get_topk_indices(query, k=100)
+        assert alloc_count() == num_allocs, (mode, alloc_count() - num_allocs)
+    model.set_query_mode("bloom")
+
+
+def test_large_k():
+    ## Result buffers are sized by the hits found, so k far above the
+    ## number of docs returns every hit without reserving k slots.
+    documents, queries, frequent_queries = make_zipf_docs(num_docs=1000, seed=15)
+    queries = queries[:10] + frequent_queries[:3]
+    reference = ReferenceBM25(documents)
+
+    model = BM25(bloom_df_threshold=1e9, num_partitions=3, num_query_threads=2)
+    model.index_documents(documents)
+    for mode in QUERY_MODES:
+        model.set_query_mode(mode)
+        for k in (10 ** 6, 2 ** 31 - 1):
+            check_exact(model, reference, queries, ks=(k,))
+            scores, indices, offsets = model.get_topk_indices_batch(queries, k=k)
+            for query_idx, query in enumerate(queries):
+                start, end = offsets[query_idx], offsets[query_idx + 1]
+                assert_matches_reference(reference, query, scores[start:end], indices[start:end], k)
+    model.set_query_mode("bloom")
+
+
+def test_explain():
+    documents, queries, frequent_queries = make_zipf_docs(seed=16)
+    model = BM25(num_partitions=3)
+    model.index_documents(documents)
+
+    for query in queries + frequent_queries:
+        for k in (1, 10, 1000):
+            plans = model.explain(query, k=k)
+            assert [plan["partition_id"] for plan in plans] == [0, 1, 2], plans
+            for plan in plans:
+                ## The cheapest eligible mode is chosen.
+                assert plan["mode"] in plan["costs"], plan
+                assert plan["estimated_cost"] == min(plan["costs"].values()), plan
+                assert plan["num_terms"] + plan["num_bloom_terms"] > 0, plan
+                assert 0.0 < plan["block_selectivity"] <= 1.0, plan
+                ## Term-at-a-time only scores low df terms.
+                assert ("taat" in plan["costs"]) == (plan["num_bloom_terms"] == 0), plan
+
+    ## Pruned and impact modes ignore query_max_df, so they are not eligible
+    ## once it drops a term. Frequent terms occur in every partition.
+    model = BM25(bloom_df_threshold=1e9, num_partitions=3)
+    model.index_documents(documents)
+    for query in frequent_queries:
+        assert any(set(plan["costs"]) > {"bloom", "streaming", "taat"} for plan in model.explain(query)), query
+        for plan in model.explain(query, k=10, query_max_df=1):
+            assert set(plan["costs"]) <= {"bloom", "streaming", "taat"}, plan
+
+    ## "needle" is in every third doc, all of one length except one short
+    ## doc per partition. Only the blocks holding a short doc can reach the
+    ## top score, so Block-Max WAND skips the others.
+    documents = []
+    for idx in range(9000):
+        if idx % 3 != 0:
+            documents.append("filler%d hay hay hay" % idx)
+        elif idx % 3000 == 0:
+            documents.append("needle")
+        else:
+            documents.append("needle filler%d hay hay hay" % idx)
+    reference = ReferenceBM25(documents)
+
+    model = BM25(bloom_df_threshold=1e9, num_partitions=3)
+    model.index_documents(documents)
+    for plan in model.explain("needle", k=1):
+        assert plan["block_selectivity"] < 0.2, plan
+        assert plan["mode"] == "bmw", plan
+    ## A threshold reached by every block skips nothing.
+    for plan in model.explain("needle", k=100):
+        assert plan["block_selectivity"] == 1.0, plan
+        assert plan["mode"] != "bmw", plan
+
+    model.set_query_mode("auto")
+    check_exact(model, reference, ["needle", "needle hay", "hay"], ks=(1, 10, 100))
+    model.set_query_mode("bloom")
+
+
+def test_wide_doc_id_gaps():
+    ## Doc id gaps of 1, 2 and 3 vbyte bytes, mixed within single lists.
+    rng = random.Random(6)
+    num_docs = 50000
+    documents = []
+    for doc_id in range(num_docs):
+        terms = ["common"]
+        if doc_id % 3 == 0:
+            terms.append("every3")
+        if doc_id % 300 == 0:
+            terms.append("every300")
+        if doc_id % 17000 == 0 or rng.random() < 0.001:
+            terms.append("sparse")
+        terms.extend(["common"] * rng.randint(0, 3))
+        documents.append(' '.join(terms))
+    queries = ["every3", "every300", "sparse", "sparse every300", "every3 sparse", "common sparse"]
+
+    reference = ReferenceBM25(documents)
+    for posting_format in ("vbyte", "block"):
+        model = BM25(bloom_df_threshold=1e9, num_partitions=2, posting_format=posting_format)
+        model.index_documents(documents)
+        check_modes_exact(model, reference, queries, ks=(10, 1000))
+
+
+def test_batch_matches_single():
+    documents, queries, frequent_queries = make_zipf_docs(seed=2)
+    queries = queries + frequent_queries + [None, ""]
+
+    for bloom_df_threshold in (1e9, 0.01):
+        model = BM25(bloom_df_threshold=bloom_df_threshold, num_partitions=4, num_query_threads=2)
+        model.index_documents(documents)
+        for mode in QUERY_MODES:
+            model.set_query_mode(mode)
+            for k in (1, 7, 100, 5000):
+                scores, indices, offsets = model.get_topk_indices_batch(queries, k=k)
+                assert len(offsets) == len(queries) + 1
+                assert offsets[-1] == len(scores) == len(indices)
+                for query_idx, query in enumerate(queries):
+                    start, end = offsets[query_idx], offsets[query_idx + 1]
+                    assert_same_results(
+                            (scores[start:end], indices[start:end]),
+                            model.get_topk_indices(query or "", k=k),
+                            (mode, k, query)
+                            )
+
+
+def test_scratch_reuse():
+    ## One worker scores every query into the same accumulator. Scores of a
+    ## query must not leak into the next one.
+    documents, queries, frequent_queries = make_zipf_docs(seed=5)
+    reference = ReferenceBM25(documents)
+
+    model = BM25(bloom_df_threshold=1e9, num_partitions=2, num_query_threads=1)
+    model.index_documents(documents)
+    for _ in range(2):
+        check_modes_exact(model, reference, frequent_queries + queries[::-1], ks=(10, 10 ** 6))
+
+
+if __name__ == '__main__':
+    test_query_threads()
+    test_modes_match_reference()
+    test_partition_count()
+    test_empty_partitions()
+    test_shared_threshold()
+    test_long_docs()
+    test_impact_budget()
+    test_impact_fallbacks()
+    test_warm_queries_do_not_allocate()
+    test_large_k()
+    test_explain()
+    test_wide_doc_id_gaps()
+    test_batch_matches_single()
+    test_scratch_reuse()
+    print("All query mode tests passed.")